@@ -1,3 +1,7 @@
+#if defined (__linux__)
+#define _GNU_SOURCE
+#endif
+
 #include <StormLib.h>
 #include <StormPort.h>
 #include <compat-5.3.h>
@@ -5,10 +9,27 @@
 #include <lua.h>
 #include <luaconf.h>
 
+#include <ctype.h>
+#include <errno.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#if defined (_WIN32)
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 /*
  * This module attempts to mirror the StormLib API, within reason.  As such,
@@ -25,13 +46,30 @@
  */
 #define STORMLIB_OBJECT_METATABLE "StormLib Handle"
 
+struct job;
+
+static bool
+job_is_running (
+	struct job *job);
+
+static void
+job_join (
+	struct job *job);
+
+/*
+ * A handle is busy while `job` has it to itself (e.g. an archive being
+ * compacted in the background).  The handles of files and finders are
+ * busy along with the `parent` archive, which outlives them open.
+ */
 struct object
 {
 	HANDLE handle;
 	SFILECLOSEARCHIVE close;
 	HANDLE archive;
+	struct object *parent;
 	lua_State *compact;
 	lua_State *insert;
+	struct job *job;
 };
 
 static int
@@ -130,11 +168,12 @@ to_object (
  * errors on a closed file.
  */
 static HANDLE
-to_handle (
+to_handle_at (
 	lua_State *L,
+	const int index,
 	is_type_function is_type)
 {
-	const struct object *object = to_object (L, 1);
+	const struct object *object = to_object (L, index);
 
 	if (is_closed (object))
 	{
@@ -146,9 +185,24 @@ to_handle (
 		luaL_error (L, "attempt to use an invalid handle");
 	}
 
+	if ((object->job && job_is_running (object->job))
+		|| (object->parent && object->parent->job
+			&& job_is_running (object->parent->job)))
+	{
+		luaL_error (L, "attempt to use a busy handle");
+	}
+
 	return object->handle;
 }
 
+static HANDLE
+to_handle (
+	lua_State *L,
+	is_type_function is_type)
+{
+	return to_handle_at (L, 1, is_type);
+}
+
 static HANDLE
 to_archive (
 	lua_State *L)
@@ -208,7 +262,12 @@ object_finalize (
 
 		while (lua_next (L, -2))
 		{
-			object_finalize (L, to_object (L, -1));
+			/* Skips the archive itself (see `object_initialize ()`). */
+			if (lua_type (L, -1) == LUA_TUSERDATA)
+			{
+				object_finalize (L, to_object (L, -1));
+			}
+
 			lua_pop (L, 1);
 		}
 
@@ -245,6 +304,18 @@ object_garbage_collect (
 {
 	struct object *object = to_object (L, 1);
 
+	/* Whatever runs on the handle has to finish first. */
+	if (object->job)
+	{
+		job_join (object->job);
+	}
+
+	/* As does whatever runs on its archive, which closing it touches. */
+	if (!is_closed (object) && object->parent && object->parent->job)
+	{
+		job_join (object->parent->job);
+	}
+
 	if (!is_closed (object))
 	{
 		object_close (L);
@@ -282,8 +353,10 @@ object_initialize (
 	object->handle = handle;
 	object->close = close;
 	object->archive = archive;
+	object->parent = NULL;
 	object->compact = NULL;
 	object->insert = NULL;
+	object->job = NULL;
 
 	if (luaL_newmetatable (L, STORMLIB_OBJECT_METATABLE))
 	{
@@ -292,14 +365,23 @@ object_initialize (
 
 	lua_setmetatable (L, -2);
 
+	/*
+	 * Besides its files and finders, the table of an archive holds the
+	 * archive itself (as light userdata), such that they can find it.
+	 */
 	if (is_archive (object))
 	{
 		lua_newtable (L);
+		lua_pushlightuserdata (L, object);
+		lua_rawsetp (L, -2, handle);
 		lua_rawsetp (L, LUA_REGISTRYINDEX, handle);
 	}
 	else
 	{
 		lua_rawgetp (L, LUA_REGISTRYINDEX, archive);
+		lua_rawgetp (L, -1, archive);
+		object->parent = lua_touserdata (L, -1);
+		lua_pop (L, 1);
 		lua_pushvalue (L, -2);
 		lua_rawsetp (L, -2, handle);
 		lua_pop (L, 1);
@@ -538,6 +620,53 @@ archive_set_limit (
 		L, SFileSetMaxFileCount (archive, limit));
 }
 
+/**
+ * `SFileGetAttributes (archive)`
+ */
+static int
+archive_get_attributes (
+	lua_State *L)
+{
+	HANDLE archive = to_archive (L);
+	const DWORD attributes = SFileGetAttributes (archive);
+
+	if (attributes == SFILE_INVALID_ATTRIBUTES)
+	{
+		return to_error (L);
+	}
+
+	lua_pushinteger (L, attributes);
+	return 1;
+}
+
+/**
+ * `SFileSetAttributes (archive, attributes)`
+ */
+static int
+archive_set_attributes (
+	lua_State *L)
+{
+	HANDLE archive = to_archive (L);
+	const DWORD attributes = luaL_checkinteger (L, 2);
+
+	return to_result (
+		L, SFileSetAttributes (archive, attributes));
+}
+
+/**
+ * `SFileUpdateFileAttributes (archive, name)`
+ */
+static int
+archive_update_attributes (
+	lua_State *L)
+{
+	HANDLE archive = to_archive (L);
+	const char *name = luaL_checkstring (L, 2);
+
+	return to_result (
+		L, SFileUpdateFileAttributes (archive, name));
+}
+
 /*
  * `SFileOpenPatchArchive (archive, path [, prefix])`
  */
@@ -642,8 +771,39 @@ file_seek (
 	return 1;
 }
 
+/*
+ * Buffers (see `SBufferCreate`) are implemented further below.  A few of
+ * the wrapped functions accept one, and fill it in place rather than
+ * returning a new string.
+ */
+struct buffer;
+
+static struct buffer *
+test_buffer (
+	lua_State *L,
+	const int index);
+
+static const char *
+check_bytes (
+	lua_State *L,
+	const int index,
+	size_t *size);
+
+static char *
+buffer_fill (
+	struct buffer *buffer,
+	const size_t capacity);
+
+static void
+buffer_filled (
+	struct buffer *buffer,
+	const size_t size);
+
 /**
- * `SFileReadFile (file, bytes_to_read)`
+ * `SFileReadFile (file, bytes_to_read [, buffer])`
+ *
+ * When `buffer` is provided, its contents are replaced by the bytes read,
+ * and it is returned in place of a string.
  */
 static int
 file_read (
@@ -651,18 +811,35 @@ file_read (
 {
 	HANDLE file = to_file (L);
 	const DWORD bytes_to_read = luaL_checkinteger (L, 2);
+	struct buffer *out = test_buffer (L, 3);
 
 	luaL_Buffer buffer;
-	char *bytes = luaL_buffinitsize (L, &buffer, bytes_to_read);
+	char *bytes = out
+		? buffer_fill (out, bytes_to_read)
+		: luaL_buffinitsize (L, &buffer, bytes_to_read);
 	DWORD bytes_read = 0;
 
+	if (bytes == NULL)
+	{
+		return to_error (L);
+	}
+
 	if (!SFileReadFile (file, bytes, bytes_to_read, &bytes_read, NULL)
 		&& GetLastError () != ERROR_HANDLE_EOF)
 	{
 		return to_error (L);
 	}
 
-	luaL_pushresultsize (&buffer, bytes_read);
+	if (out)
+	{
+		buffer_filled (out, bytes_read);
+		lua_pushvalue (L, 3);
+	}
+	else
+	{
+		luaL_pushresultsize (&buffer, bytes_read);
+	}
+
 	return 1;
 }
 
@@ -677,1070 +854,10415 @@ reader_close (
 	return object_close (L);
 }
 
-typedef int
-(*info_function) (
-	lua_State *L,
-	void *buffer,
-	const DWORD size);
+/*
+ * A view onto a table of fixed-size entries, such as the hash table.  Each
+ * field is described by its offset and width, in bits, within an entry of
+ * `stride` bits.  Fields of an aligned view are read as they lie in memory
+ * (i.e. as the structures of StormLib).  Fields of a packed view are read
+ * from a bit array, least significant bit first (e.g. the BET table).
+ *
+ * A view pushed onto the stack holds a copy of the entries, which can be
+ * scanned without creating a table per entry.
+ */
+#define STORMLIB_VIEW_METATABLE "StormLib View"
 
-static int
-info_not_implemented_yet (
-	lua_State *L)
+/*
+ * The most fields that a view pushed onto the stack can have.
+ */
+#define STORMLIB_VIEW_FIELDS 8
+
+struct view_field
 {
-	lua_pushnil (L);
-	lua_pushliteral (L, "info class not implemented yet");
-	return 2;
-}
+	const char *name;
+	size_t offset;
+	size_t width;
+};
 
-static int
-info_integer32 (
-	lua_State *L,
-	void *buffer,
-	const DWORD size)
+#define VIEW_FIELD_AS(type, field, name) \
+	{ name, offsetof (type, field) * 8, sizeof (((type *) 0)->field) * 8 }
+
+#define VIEW_FIELD(type, field) \
+	VIEW_FIELD_AS (type, field, #field)
+
+struct view
 {
-	DWORD *info = buffer;
-	lua_pushinteger (L, (lua_Integer) *info);
-	return 1;
-}
+	const unsigned char *data;
+	size_t size;
+	size_t count;
+	size_t stride;
+	bool packed;
+	const struct view_field *fields;
+	size_t width;
+};
 
-static int
-info_integer64 (
-	lua_State *L,
-	void *buffer,
-	const DWORD size)
+struct view_data
 {
-	ULONGLONG *info = buffer;
-	lua_pushinteger (L, (lua_Integer) *info);
-	return 1;
+	struct view view;
+	struct view_field fields [STORMLIB_VIEW_FIELDS];
+	unsigned char data [];
+};
+
+/*
+ * Limits the count to what the data holds.  Returns `false` if a field
+ * does not fit within an entry.
+ */
+static bool
+view_check (
+	struct view *view)
+{
+	if (view->width > STORMLIB_VIEW_FIELDS
+		|| (!view->packed && view->stride % 8 != 0))
+	{
+		return false;
+	}
+
+	for (size_t i = 0; i < view->width; i++)
+	{
+		const struct view_field *field = &view->fields [i];
+
+		if (field->offset + field->width > view->stride
+			|| (view->packed && field->width > 64)
+			|| (!view->packed && (field->offset % 8 != 0
+				|| field->width % 8 != 0)))
+		{
+			return false;
+		}
+	}
+
+	size_t limit = 0;
+
+	if (view->stride > 0)
+	{
+		limit = view->packed
+			? view->size * 8 / view->stride
+			: view->size / (view->stride / 8);
+	}
+
+	if (view->count > limit)
+	{
+		view->count = limit;
+	}
+
+	return true;
 }
 
-static int
-info_string (
-	lua_State *L,
-	void *buffer,
-	const DWORD size)
+static ULONGLONG
+view_bits (
+	const unsigned char *data,
+	size_t position,
+	size_t width)
 {
-	lua_pushstring (L, buffer);
-	return 1;
+	ULONGLONG value = 0;
+	size_t shift = 0;
+
+	while (width > 0)
+	{
+		const size_t skip = position % 8;
+		const size_t take = width < 8 - skip ? width : 8 - skip;
+		const unsigned int bits =
+			(data [position / 8] >> skip) & ((1u << take) - 1);
+
+		value = value | (ULONGLONG) bits << shift;
+		shift = shift + take;
+		position = position + take;
+		width = width - take;
+	}
+
+	return value;
 }
 
-static int
-info_string_array (
+static void
+view_push_field (
 	lua_State *L,
-	void *buffer,
-	const DWORD size)
+	const struct view *view,
+	const size_t index,
+	const struct view_field *field)
 {
-	lua_newtable (L);
-	int count = 1;
+	const size_t position = index * view->stride + field->offset;
 
-	for (const char *name = buffer;
-		name [0] != '\0';
-		name = name + strlen (name) + 1)
+	if (view->packed)
 	{
-		lua_pushstring (L, name);
-		lua_rawseti (L, -2, count++);
+		lua_pushinteger (L,
+			(lua_Integer) view_bits (view->data, position, field->width));
+		return;
 	}
 
-	return 1;
+	const unsigned char *data = view->data + position / 8;
+
+	switch (field->width)
+	{
+		case 8:
+		{
+			lua_pushinteger (L, *data);
+			break;
+		}
+
+		case 16:
+		{
+			uint16_t value;
+			memcpy (&value, data, sizeof (value));
+			lua_pushinteger (L, value);
+			break;
+		}
+
+		case 32:
+		{
+			uint32_t value;
+			memcpy (&value, data, sizeof (value));
+			lua_pushinteger (L, (lua_Integer) value);
+			break;
+		}
+
+		case 64:
+		{
+			uint64_t value;
+			memcpy (&value, data, sizeof (value));
+			lua_pushinteger (L, (lua_Integer) value);
+			break;
+		}
+
+		default:
+		{
+			/* Anything else (e.g. an MD5) is left as bytes. */
+			lua_pushlstring (L, (const char *) data, field->width / 8);
+			break;
+		}
+	}
 }
 
-static int
-info_mpq_header (
+/*
+ * Pushes entry `index` as a table of its fields.  An entry with a single
+ * field is pushed as that field alone.
+ */
+static void
+view_push_entry (
 	lua_State *L,
-	void *buffer,
-	const DWORD size)
+	const struct view *view,
+	const size_t index)
 {
-	return info_not_implemented_yet (L);
+	if (view->width == 1)
+	{
+		view_push_field (L, view, index, &view->fields [0]);
+		return;
+	}
+
+	lua_createtable (L, 0, (int) view->width);
+
+	for (size_t i = 0; i < view->width; i++)
+	{
+		view_push_field (L, view, index, &view->fields [i]);
+		lua_setfield (L, -2, view->fields [i].name);
+	}
 }
 
-static int
-info_het_header (
+/*
+ * Pushes every entry, as an array.
+ */
+static void
+view_push_all (
 	lua_State *L,
-	void *buffer,
-	const DWORD size)
+	const struct view *view)
 {
-	return info_not_implemented_yet (L);
+	lua_createtable (L, (int) view->count, 0);
+
+	for (size_t i = 0; i < view->count; i++)
+	{
+		view_push_entry (L, view, i);
+		lua_rawseti (L, -2, (lua_Integer) i + 1);
+	}
 }
 
-static int
-info_het_table (
+static const struct view *
+to_view (
 	lua_State *L,
-	void *buffer,
-	const DWORD size)
+	const int index)
 {
-	return info_not_implemented_yet (L);
+	const struct view_data *data = luaL_checkudata (
+		L, index, STORMLIB_VIEW_METATABLE);
+	return &data->view;
 }
 
-static int
-info_bet_header (
+static size_t
+check_view_index (
 	lua_State *L,
-	void *buffer,
-	const DWORD size)
+	const struct view *view,
+	const int index)
 {
-	return info_not_implemented_yet (L);
+	const lua_Integer i = luaL_checkinteger (L, index);
+	luaL_argcheck (L, i >= 1 && (size_t) i <= view->count, index,
+		"index out of range");
+	return (size_t) i - 1;
 }
 
-static int
-info_bet_table (
+/*
+ * A field is given by its name, or its position.
+ */
+static const struct view_field *
+check_view_field (
 	lua_State *L,
-	void *buffer,
-	const DWORD size)
+	const struct view *view,
+	const int index)
 {
-	return info_not_implemented_yet (L);
+	if (lua_isnoneornil (L, index))
+	{
+		return &view->fields [0];
+	}
+
+	if (lua_type (L, index) == LUA_TNUMBER)
+	{
+		const lua_Integer i = lua_tointeger (L, index);
+		luaL_argcheck (L, i >= 1 && (size_t) i <= view->width,
+			index, "field out of range");
+		return &view->fields [i - 1];
+	}
+
+	const char *name = luaL_checkstring (L, index);
+
+	for (size_t i = 0; i < view->width; i++)
+	{
+		if (strcmp (view->fields [i].name, name) == 0)
+		{
+			return &view->fields [i];
+		}
+	}
+
+	luaL_argerror (L, index, "invalid field");
+	return NULL;
 }
 
+/**
+ * `view:get (i [, field])`
+ *
+ * Returns a field of entry `i`, by name or position (by default, the
+ * first).
+ */
 static int
-info_file_entry (
-	lua_State *L,
-	void *buffer,
-	const DWORD size)
+view_get (
+	lua_State *L)
 {
-	TFileEntry *info = buffer;
-
-	lua_createtable (L, 0, 8);
-	lua_pushinteger (L, (lua_Integer) info->FileNameHash);
-	lua_setfield (L, -2, "FileNameHash");
-	lua_pushinteger (L, (lua_Integer) info->ByteOffset);
-	lua_setfield (L, -2, "ByteOffset");
-	lua_pushinteger (L, (lua_Integer) info->FileTime);
-	lua_setfield (L, -2, "FileTime");
-	lua_pushinteger (L, info->dwFileSize);
-	lua_setfield (L, -2, "dwFileSize");
-	lua_pushinteger (L, info->dwCmpSize);
-	lua_setfield (L, -2, "dwCmpSize");
-	lua_pushinteger (L, info->dwFlags);
-	lua_setfield (L, -2, "dwFlags");
-	lua_pushinteger (L, info->dwCrc32);
-	lua_setfield (L, -2, "dwCrc32");
-	lua_pushstring (L, (const char *) info->md5);
-	lua_setfield (L, -2, "md5");
-	lua_pushstring (L, info->szFileName);
-	lua_setfield (L, -2, "szFileName");
+	const struct view *view = to_view (L, 1);
+	const size_t index = check_view_index (L, view, 2);
+	const struct view_field *field = check_view_field (L, view, 3);
 
+	view_push_field (L, view, index, field);
 	return 1;
 }
 
-static void
-info_load_hash_entry (
-	lua_State *L,
-	const TMPQHash *info)
-{
-	lua_createtable (L, 0, 6);
-	lua_pushinteger (L, info->dwName1);
-	lua_setfield (L, -2, "dwName1");
-	lua_pushinteger (L, info->dwName2);
-	lua_setfield (L, -2, "dwName2");
-	lua_pushinteger (L, info->lcLocale);
-	lua_setfield (L, -2, "lcLocale");
-	lua_pushinteger (L, info->Platform);
-	lua_setfield (L, -2, "Platform");
-	lua_pushinteger (L, info->Reserved);
-	lua_setfield (L, -2, "Reserved");
-	lua_pushinteger (L, info->dwBlockIndex);
-	lua_setfield (L, -2, "dwBlockIndex");
-}
-
+/**
+ * `view:entry (i)`
+ *
+ * Returns entry `i`, as a table of its fields.
+ */
 static int
-info_hash_entry (
-	lua_State *L,
-	void *buffer,
-	const DWORD size)
+view_entry (
+	lua_State *L)
 {
-	info_load_hash_entry (L, buffer);
+	const struct view *view = to_view (L, 1);
+	const size_t index = check_view_index (L, view, 2);
+
+	view_push_entry (L, view, index);
 	return 1;
 }
 
+/**
+ * `view:fields ()`
+ *
+ * Returns an array of the names of the fields.
+ */
 static int
-info_hash_table (
-	lua_State *L,
-	void *buffer,
-	const DWORD size)
+view_fields (
+	lua_State *L)
 {
-	const TMPQHash *info = buffer;
-	const size_t count = size / sizeof (TMPQHash);
-	lua_createtable (L, (int) count, 0);
+	const struct view *view = to_view (L, 1);
+	lua_createtable (L, (int) view->width, 0);
 
-	for (int i = 0; i < count; i++, info++)
+	for (size_t i = 0; i < view->width; i++)
 	{
-		info_load_hash_entry (L, info);
-		lua_rawseti (L, -2, i + 1);
+		lua_pushstring (L, view->fields [i].name);
+		lua_rawseti (L, -2, (lua_Integer) i + 1);
 	}
 
 	return 1;
 }
 
+/**
+ * `view:tostring ()`
+ *
+ * Returns the entries as they are stored.
+ */
 static int
-info_block_table (
-	lua_State *L,
-	void *buffer,
-	const DWORD size)
+view_contents (
+	lua_State *L)
 {
-	const TMPQBlock *info = buffer;
-	const size_t count = size / sizeof (TMPQBlock);
-	lua_createtable (L, (int) count, 0);
+	const struct view *view = to_view (L, 1);
+	lua_pushlstring (L, (const char *) view->data, view->size);
+	return 1;
+}
 
-	for (int i = 0; i < count; i++, info++)
-	{
-		lua_createtable (L, 0, 4);
-		lua_pushinteger (L, info->dwFilePos);
-		lua_setfield (L, -2, "dwFilePos");
-		lua_pushinteger (L, info->dwCSize);
-		lua_setfield (L, -2, "dwCsize");
-		lua_pushinteger (L, info->dwFSize);
-		lua_setfield (L, -2, "dwFSize");
-		lua_pushinteger (L, info->dwFlags);
-		lua_setfield (L, -2, "dwFlags");
-		lua_rawseti (L, -2, i + 1);
-	}
+/**
+ * `view:pointer ()`
+ *
+ * Returns a light userdata pointing at the entries, and their size.  It is
+ * valid for as long as the view.
+ */
+static int
+view_pointer (
+	lua_State *L)
+{
+	const struct view *view = to_view (L, 1);
+	lua_pushlightuserdata (L, (void *) view->data);
+	lua_pushinteger (L, (lua_Integer) view->size);
+	return 2;
+}
 
+static int
+view_length (
+	lua_State *L)
+{
+	const struct view *view = to_view (L, 1);
+	lua_pushinteger (L, (lua_Integer) view->count);
 	return 1;
 }
 
 static int
-info_helper (
+view_to_string (
+	lua_State *L)
+{
+	const struct view *view = to_view (L, 1);
+	lua_pushfstring (L, "%s (%p)", STORMLIB_VIEW_METATABLE, view);
+	return 1;
+}
+
+static const luaL_Reg
+view_methods [] =
+{
+	{ "__len", view_length },
+	{ "__tostring", view_to_string },
+	{ "entry", view_entry },
+	{ "fields", view_fields },
+	{ "get", view_get },
+	{ "pointer", view_pointer },
+	{ "tostring", view_contents },
+	{ NULL, NULL }
+};
+
+/*
+ * Pushes a view holding a copy of the entries of `view`.
+ */
+static void
+view_new (
 	lua_State *L,
-	HANDLE (to_handle) (
-		lua_State *L),
-	const SFileInfoClass class,
-	info_function info)
+	const struct view *view)
 {
-	HANDLE handle = to_handle (L);
-	DWORD size = 0;
-	SFileGetFileInfo (handle, class, NULL, 0, &size);
+	struct view_data *data = lua_newuserdata (
+		L, sizeof (*data) + view->size);
 
-	/*
-	 * Passing a `NULL` buffer here will elicit a related error.  It will
-	 * also cause a valid size to be set.  We leverage that fact.
-	 */
-	if (!SFileGetFileInfo (handle, class, NULL, 0, &size)
-		&& GetLastError () != ERROR_INSUFFICIENT_BUFFER)
+	memcpy (data->fields, view->fields,
+		view->width * sizeof (*view->fields));
+	if (view->size > 0)
 	{
-		return to_error (L);
+		memcpy (data->data, view->data, view->size);
 	}
 
-	/*
-	 * Unsure if StormLib will return zero size.  But if it does, we will
-	 * consider it an error and return accordingly.
-	 */
-	if (size == 0)
+	data->view = *view;
+	data->view.fields = data->fields;
+	data->view.data = data->data;
+
+	if (luaL_newmetatable (L, STORMLIB_VIEW_METATABLE))
 	{
-		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
-		return to_error (L);
+		luaL_setfuncs (L, view_methods, 0);
+		lua_pushvalue (L, -1);
+		lua_setfield (L, -2, "__index");
 	}
 
-	void *buffer = calloc (1, size);
-	if (buffer == NULL)
+	lua_setmetatable (L, -2);
+}
+
+/*
+ * Pushes `view` as a view when `packed` is true, or else as an array.  A
+ * view that does not make sense (i.e. a corrupt table) is an error.
+ */
+static bool
+view_push (
+	lua_State *L,
+	struct view *view,
+	const bool packed)
+{
+	if (!view_check (view))
 	{
-		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
-		return to_error (L);
+		SetLastError (ERROR_FILE_CORRUPT);
+		return false;
 	}
 
-	int result = 0;
-	if (SFileGetFileInfo (handle, class, buffer, size, NULL))
+	if (packed)
 	{
-		result = info (L, buffer, size);
+		view_new (L, view);
 	}
 	else
 	{
-		result = to_error (L);
+		view_push_all (L, view);
 	}
 
-	free (buffer);
-	return result;
+	return true;
 }
 
+#define VIEW_FIELDS(fields) \
+	fields, sizeof (fields) / sizeof (*fields)
+
+typedef int
+(*info_function) (
+	lua_State *L,
+	void *buffer,
+	const DWORD size);
+
 static int
-info_archive (
+info_not_implemented_yet (
+	lua_State *L)
+{
+	lua_pushnil (L);
+	lua_pushliteral (L, "info class not implemented yet");
+	return 2;
+}
+
+static int
+info_integer32 (
 	lua_State *L,
-	const SFileInfoClass class,
-	info_function info)
+	void *buffer,
+	const DWORD size)
 {
-	return info_helper (L, to_archive, class, info);
+	DWORD *info = buffer;
+	lua_pushinteger (L, (lua_Integer) *info);
+	return 1;
 }
 
 static int
-info_file (
+info_integer64 (
 	lua_State *L,
-	const SFileInfoClass class,
-	info_function info)
+	void *buffer,
+	const DWORD size)
 {
-	return info_helper (L, to_file, class, info);
+	ULONGLONG *info = buffer;
+	lua_pushinteger (L, (lua_Integer) *info);
+	return 1;
 }
 
-/**
- * `SFileGetFileInfo (file, class)`
- */
 static int
-stormlib_info (
-	lua_State *L)
+info_string (
+	lua_State *L,
+	void *buffer,
+	const DWORD size)
 {
-	const SFileInfoClass class = luaL_checkinteger (L, 2);
+	lua_pushstring (L, buffer);
+	return 1;
+}
 
-	switch (class)
+static int
+info_string_array (
+	lua_State *L,
+	void *buffer,
+	const DWORD size)
+{
+	lua_newtable (L);
+	int count = 1;
+
+	for (const char *name = buffer;
+		name [0] != '\0';
+		name = name + strlen (name) + 1)
 	{
-		case SFileMpqFileName:
-		case SFileMpqStreamBitmap:
-		{
-			return info_archive (L, class, info_string);
-		}
+		lua_pushstring (L, name);
+		lua_rawseti (L, -2, count++);
+	}
 
-		case SFileMpqUserDataOffset:
-		{
-			return info_archive (L, class, info_integer64);
-		}
+	return 1;
+}
 
-		case SFileMpqUserDataHeader:
-		case SFileMpqUserData:
-		{
-			HANDLE handle = to_archive (L);
+/*
+ * Pushes a single structure, of at least `expected` bytes, as a table of
+ * its fields.
+ */
+static int
+info_structure (
+	lua_State *L,
+	const void *buffer,
+	const size_t size,
+	const size_t expected,
+	const struct view_field *fields,
+	const size_t width)
+{
+	const struct view view =
+	{
+		buffer, size, 1, expected * 8, false, fields, width
+	};
 
-			/*
-			 * Ensure that the MPQ user data exists, else we may run into a
-			 * segmentation fault.
-			 *
-			 * TODO: StormLib 9.24: Remove this check.
-			 */
-			if (((TMPQArchive *) handle)->pUserData == NULL)
-			{
-				SetLastError (ERROR_INVALID_PARAMETER);
-				return to_error (L);
-			}
+	if (size < expected)
+	{
+		SetLastError (ERROR_INSUFFICIENT_BUFFER);
+		return to_error (L);
+	}
 
-			return info_archive (L, class, info_string);
-		}
+	view_push_entry (L, &view, 0);
+	return 1;
+}
 
-		case SFileMpqHeaderOffset:
-		{
-			return info_archive (L, class, info_integer64);
-		}
+static const struct view_field
+info_mpq_header_fields [] =
+{
+	VIEW_FIELD (TMPQHeader, dwID),
+	VIEW_FIELD (TMPQHeader, dwHeaderSize),
+	VIEW_FIELD (TMPQHeader, dwArchiveSize),
+	VIEW_FIELD (TMPQHeader, wFormatVersion),
+	VIEW_FIELD (TMPQHeader, wSectorSize),
+	VIEW_FIELD (TMPQHeader, dwHashTablePos),
+	VIEW_FIELD (TMPQHeader, dwBlockTablePos),
+	VIEW_FIELD (TMPQHeader, dwHashTableSize),
+	VIEW_FIELD (TMPQHeader, dwBlockTableSize),
+	VIEW_FIELD (TMPQHeader, HiBlockTablePos64),
+	VIEW_FIELD (TMPQHeader, wHashTablePosHi),
+	VIEW_FIELD (TMPQHeader, wBlockTablePosHi),
+	VIEW_FIELD (TMPQHeader, ArchiveSize64),
+	VIEW_FIELD (TMPQHeader, BetTablePos64),
+	VIEW_FIELD (TMPQHeader, HetTablePos64),
+	VIEW_FIELD (TMPQHeader, HashTableSize64),
+	VIEW_FIELD (TMPQHeader, BlockTableSize64),
+	VIEW_FIELD (TMPQHeader, HiBlockTableSize64),
+	VIEW_FIELD (TMPQHeader, HetTableSize64),
+	VIEW_FIELD (TMPQHeader, BetTableSize64),
+	VIEW_FIELD (TMPQHeader, dwRawChunkSize),
+	VIEW_FIELD (TMPQHeader, MD5_BlockTable),
+	VIEW_FIELD (TMPQHeader, MD5_HashTable),
+	VIEW_FIELD (TMPQHeader, MD5_HiBlockTable),
+	VIEW_FIELD (TMPQHeader, MD5_BetTable),
+	VIEW_FIELD (TMPQHeader, MD5_HetTable),
+	VIEW_FIELD (TMPQHeader, MD5_MpqHeader)
+};
 
-		case SFileMpqHeaderSize:
-		{
-			return info_archive (L, class, info_integer32);
-		}
+static int
+info_mpq_header (
+	lua_State *L,
+	void *buffer,
+	const DWORD size)
+{
+	return info_structure (L, buffer, size, sizeof (TMPQHeader),
+		VIEW_FIELDS (info_mpq_header_fields));
+}
 
-		case SFileMpqHeader:
-		{
-			return info_archive (L, class, info_mpq_header);
-		}
+/*
+ * The extended header is flattened into the HET and BET headers.
+ */
+#define VIEW_EXT_HEADER(type) \
+	VIEW_FIELD_AS (type, ExtHdr.dwSignature, "dwSignature"), \
+	VIEW_FIELD_AS (type, ExtHdr.dwVersion, "dwVersion"), \
+	VIEW_FIELD_AS (type, ExtHdr.dwDataSize, "dwDataSize")
 
-		case SFileMpqHetTableOffset:
-		case SFileMpqHetTableSize:
-		{
-			return info_archive (L, class, info_integer64);
-		}
+static const struct view_field
+info_het_header_fields [] =
+{
+	VIEW_EXT_HEADER (TMPQHetHeader),
+	VIEW_FIELD (TMPQHetHeader, dwTableSize),
+	VIEW_FIELD (TMPQHetHeader, dwEntryCount),
+	VIEW_FIELD (TMPQHetHeader, dwTotalCount),
+	VIEW_FIELD (TMPQHetHeader, dwNameHashBitSize),
+	VIEW_FIELD (TMPQHetHeader, dwIndexSizeTotal),
+	VIEW_FIELD (TMPQHetHeader, dwIndexSizeExtra),
+	VIEW_FIELD (TMPQHetHeader, dwIndexSize),
+	VIEW_FIELD (TMPQHetHeader, dwIndexTableSize)
+};
 
-		case SFileMpqHetHeader:
-		{
-			return info_archive (L, class, info_het_header);
+static int
+info_het_header (
+	lua_State *L,
+	void *buffer,
+	const DWORD size)
+{
+	return info_structure (L, buffer, size, sizeof (TMPQHetHeader),
+		VIEW_FIELDS (info_het_header_fields));
+}
+
+static const struct view_field
+info_het_table_fields [] =
+{
+	VIEW_FIELD (TMPQHetTable, AndMask64),
+	VIEW_FIELD (TMPQHetTable, OrMask64),
+	VIEW_FIELD (TMPQHetTable, dwEntryCount),
+	VIEW_FIELD (TMPQHetTable, dwTotalCount),
+	VIEW_FIELD (TMPQHetTable, dwNameHashBitSize),
+	VIEW_FIELD (TMPQHetTable, dwIndexSizeTotal),
+	VIEW_FIELD (TMPQHetTable, dwIndexSizeExtra),
+	VIEW_FIELD (TMPQHetTable, dwIndexSize)
+};
+
+/*
+ * StormLib loads the table anew, and hands over a pointer to it.  Its
+ * arrays are added to the table of fields as arrays, or as views when
+ * `packed` is given.
+ */
+static int
+info_het_table (
+	lua_State *L,
+	void *buffer,
+	const DWORD size)
+{
+	TMPQHetTable *table = *(TMPQHetTable **) buffer;
+	const bool packed = lua_toboolean (L, 3);
+
+	const struct view_field hash = { "NameHash", 0, 8 };
+	const struct view_field index = { "BetIndex", 0, table->dwIndexSize };
+
+	struct view hashes =
+	{
+		table->pNameHashes, table->dwTotalCount, table->dwTotalCount, 8,
+		false, &hash, 1
+	};
+
+	struct view indexes =
+	{
+		table->pBetIndexes->Elements, table->pBetIndexes->NumberOfBytes,
+		table->dwTotalCount, table->dwIndexSizeTotal, true, &index, 1
+	};
+
+	info_structure (L, table, sizeof (*table), sizeof (*table),
+		VIEW_FIELDS (info_het_table_fields));
+
+	bool status = view_push (L, &hashes, packed);
+
+	if (status)
+	{
+		lua_setfield (L, -2, "pNameHashes");
+		status = view_push (L, &indexes, packed);
+	}
+
+	if (status)
+	{
+		lua_setfield (L, -2, "pBetIndexes");
+	}
+
+	const DWORD error = GetLastError ();
+	SFileFreeFileInfo (table, SFileMpqHetTable);
+	SetLastError (error);
+	return status ? 1 : to_error (L);
+}
+
+static const struct view_field
+info_bet_header_fields [] =
+{
+	VIEW_EXT_HEADER (TMPQBetHeader),
+	VIEW_FIELD (TMPQBetHeader, dwTableSize),
+	VIEW_FIELD (TMPQBetHeader, dwEntryCount),
+	VIEW_FIELD (TMPQBetHeader, dwUnknown08),
+	VIEW_FIELD (TMPQBetHeader, dwTableEntrySize),
+	VIEW_FIELD (TMPQBetHeader, dwBitIndex_FilePos),
+	VIEW_FIELD (TMPQBetHeader, dwBitIndex_FileSize),
+	VIEW_FIELD (TMPQBetHeader, dwBitIndex_CmpSize),
+	VIEW_FIELD (TMPQBetHeader, dwBitIndex_FlagIndex),
+	VIEW_FIELD (TMPQBetHeader, dwBitIndex_Unknown),
+	VIEW_FIELD (TMPQBetHeader, dwBitCount_FilePos),
+	VIEW_FIELD (TMPQBetHeader, dwBitCount_FileSize),
+	VIEW_FIELD (TMPQBetHeader, dwBitCount_CmpSize),
+	VIEW_FIELD (TMPQBetHeader, dwBitCount_FlagIndex),
+	VIEW_FIELD (TMPQBetHeader, dwBitCount_Unknown),
+	VIEW_FIELD (TMPQBetHeader, dwBitTotal_NameHash2),
+	VIEW_FIELD (TMPQBetHeader, dwBitExtra_NameHash2),
+	VIEW_FIELD (TMPQBetHeader, dwBitCount_NameHash2),
+	VIEW_FIELD (TMPQBetHeader, dwNameHashArraySize),
+	VIEW_FIELD (TMPQBetHeader, dwFlagCount)
+};
+
+static int
+info_bet_header (
+	lua_State *L,
+	void *buffer,
+	const DWORD size)
+{
+	return info_structure (L, buffer, size, sizeof (TMPQBetHeader),
+		VIEW_FIELDS (info_bet_header_fields));
+}
+
+static const struct view_field
+info_bet_table_fields [] =
+{
+	VIEW_FIELD (TMPQBetTable, dwTableEntrySize),
+	VIEW_FIELD (TMPQBetTable, dwBitIndex_FilePos),
+	VIEW_FIELD (TMPQBetTable, dwBitIndex_FileSize),
+	VIEW_FIELD (TMPQBetTable, dwBitIndex_CmpSize),
+	VIEW_FIELD (TMPQBetTable, dwBitIndex_FlagIndex),
+	VIEW_FIELD (TMPQBetTable, dwBitIndex_Unknown),
+	VIEW_FIELD (TMPQBetTable, dwBitCount_FilePos),
+	VIEW_FIELD (TMPQBetTable, dwBitCount_FileSize),
+	VIEW_FIELD (TMPQBetTable, dwBitCount_CmpSize),
+	VIEW_FIELD (TMPQBetTable, dwBitCount_FlagIndex),
+	VIEW_FIELD (TMPQBetTable, dwBitCount_Unknown),
+	VIEW_FIELD (TMPQBetTable, dwBitTotal_NameHash2),
+	VIEW_FIELD (TMPQBetTable, dwBitExtra_NameHash2),
+	VIEW_FIELD (TMPQBetTable, dwBitCount_NameHash2),
+	VIEW_FIELD (TMPQBetTable, dwEntryCount),
+	VIEW_FIELD (TMPQBetTable, dwFlagCount)
+};
+
+/*
+ * As with the HET table, the BET table is handed over by StormLib.  The
+ * file table is described by the bit positions that the table holds.
+ */
+static int
+info_bet_table (
+	lua_State *L,
+	void *buffer,
+	const DWORD size)
+{
+	TMPQBetTable *table = *(TMPQBetTable **) buffer;
+	const bool packed = lua_toboolean (L, 3);
+
+	/*
+	 * Hashes are `dwBitTotal_NameHash2` bits apart, of which only the
+	 * first `dwBitCount_NameHash2` hold the hash.
+	 */
+	const struct view_field hash =
+	{
+		"NameHash2", 0, table->dwBitCount_NameHash2
+	};
+
+	const struct view_field flag = { "FileFlags", 0, 32 };
+
+	const struct view_field entry [] =
+	{
+		{ "FilePos", table->dwBitIndex_FilePos,
+			table->dwBitCount_FilePos },
+		{ "FileSize", table->dwBitIndex_FileSize,
+			table->dwBitCount_FileSize },
+		{ "CmpSize", table->dwBitIndex_CmpSize,
+			table->dwBitCount_CmpSize },
+		{ "FlagIndex", table->dwBitIndex_FlagIndex,
+			table->dwBitCount_FlagIndex },
+		{ "Unknown", table->dwBitIndex_Unknown,
+			table->dwBitCount_Unknown }
+	};
+
+	struct view hashes =
+	{
+		table->pNameHashes->Elements, table->pNameHashes->NumberOfBytes,
+		table->dwEntryCount, table->dwBitTotal_NameHash2, true, &hash, 1
+	};
+
+	struct view files =
+	{
+		table->pFileTable->Elements, table->pFileTable->NumberOfBytes,
+		table->dwEntryCount, table->dwTableEntrySize, true,
+		VIEW_FIELDS (entry)
+	};
+
+	struct view flags =
+	{
+		(const unsigned char *) table->pFileFlags,
+		table->dwFlagCount * sizeof (DWORD), table->dwFlagCount, 32,
+		false, &flag, 1
+	};
+
+	info_structure (L, table, sizeof (*table), sizeof (*table),
+		VIEW_FIELDS (info_bet_table_fields));
+
+	bool status = view_push (L, &hashes, packed);
+
+	if (status)
+	{
+		lua_setfield (L, -2, "pNameHashes");
+		status = view_push (L, &files, packed);
+	}
+
+	if (status)
+	{
+		lua_setfield (L, -2, "pFileTable");
+		status = view_push (L, &flags, packed);
+	}
+
+	if (status)
+	{
+		lua_setfield (L, -2, "pFileFlags");
+	}
+
+	const DWORD error = GetLastError ();
+	SFileFreeFileInfo (table, SFileMpqBetTable);
+	SetLastError (error);
+	return status ? 1 : to_error (L);
+}
+
+static int
+info_file_entry (
+	lua_State *L,
+	void *buffer,
+	const DWORD size)
+{
+	TFileEntry *info = buffer;
+
+	lua_createtable (L, 0, 8);
+	lua_pushinteger (L, (lua_Integer) info->FileNameHash);
+	lua_setfield (L, -2, "FileNameHash");
+	lua_pushinteger (L, (lua_Integer) info->ByteOffset);
+	lua_setfield (L, -2, "ByteOffset");
+	lua_pushinteger (L, (lua_Integer) info->FileTime);
+	lua_setfield (L, -2, "FileTime");
+	lua_pushinteger (L, info->dwFileSize);
+	lua_setfield (L, -2, "dwFileSize");
+	lua_pushinteger (L, info->dwCmpSize);
+	lua_setfield (L, -2, "dwCmpSize");
+	lua_pushinteger (L, info->dwFlags);
+	lua_setfield (L, -2, "dwFlags");
+	lua_pushinteger (L, info->dwCrc32);
+	lua_setfield (L, -2, "dwCrc32");
+	lua_pushlstring (L, (const char *) info->md5, MD5_DIGEST_SIZE);
+	lua_setfield (L, -2, "md5");
+	lua_pushstring (L, info->szFileName);
+	lua_setfield (L, -2, "szFileName");
+
+	return 1;
+}
+
+static const struct view_field
+info_hash_fields [] =
+{
+	VIEW_FIELD (TMPQHash, dwName1),
+	VIEW_FIELD (TMPQHash, dwName2),
+	VIEW_FIELD (TMPQHash, lcLocale),
+	VIEW_FIELD (TMPQHash, Platform),
+	VIEW_FIELD (TMPQHash, Reserved),
+	VIEW_FIELD (TMPQHash, dwBlockIndex)
+};
+
+static int
+info_hash_entry (
+	lua_State *L,
+	void *buffer,
+	const DWORD size)
+{
+	return info_structure (L, buffer, size, sizeof (TMPQHash),
+		VIEW_FIELDS (info_hash_fields));
+}
+
+static int
+info_hash_table (
+	lua_State *L,
+	void *buffer,
+	const DWORD size)
+{
+	struct view view =
+	{
+		buffer, size, size / sizeof (TMPQHash), sizeof (TMPQHash) * 8,
+		false, VIEW_FIELDS (info_hash_fields)
+	};
+
+	if (!view_push (L, &view, lua_toboolean (L, 3)))
+	{
+		return to_error (L);
+	}
+
+	return 1;
+}
+
+/*
+ * The compressed size has long been named `dwCsize` here.
+ */
+static const struct view_field
+info_block_fields [] =
+{
+	VIEW_FIELD (TMPQBlock, dwFilePos),
+	VIEW_FIELD_AS (TMPQBlock, dwCSize, "dwCsize"),
+	VIEW_FIELD (TMPQBlock, dwFSize),
+	VIEW_FIELD (TMPQBlock, dwFlags)
+};
+
+static int
+info_block_table (
+	lua_State *L,
+	void *buffer,
+	const DWORD size)
+{
+	struct view view =
+	{
+		buffer, size, size / sizeof (TMPQBlock), sizeof (TMPQBlock) * 8,
+		false, VIEW_FIELDS (info_block_fields)
+	};
+
+	if (!view_push (L, &view, lua_toboolean (L, 3)))
+	{
+		return to_error (L);
+	}
+
+	return 1;
+}
+
+static int
+info_helper (
+	lua_State *L,
+	HANDLE (to_handle) (
+		lua_State *L),
+	const SFileInfoClass class,
+	info_function info)
+{
+	HANDLE handle = to_handle (L);
+	DWORD size = 0;
+	SFileGetFileInfo (handle, class, NULL, 0, &size);
+
+	/*
+	 * Passing a `NULL` buffer here will elicit a related error.  It will
+	 * also cause a valid size to be set.  We leverage that fact.
+	 */
+	if (!SFileGetFileInfo (handle, class, NULL, 0, &size)
+		&& GetLastError () != ERROR_INSUFFICIENT_BUFFER)
+	{
+		return to_error (L);
+	}
+
+	/*
+	 * Unsure if StormLib will return zero size.  But if it does, we will
+	 * consider it an error and return accordingly.
+	 */
+	if (size == 0)
+	{
+		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+		return to_error (L);
+	}
+
+	void *buffer = calloc (1, size);
+	if (buffer == NULL)
+	{
+		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+		return to_error (L);
+	}
+
+	int result = 0;
+	if (SFileGetFileInfo (handle, class, buffer, size, NULL))
+	{
+		result = info (L, buffer, size);
+	}
+	else
+	{
+		result = to_error (L);
+	}
+
+	free (buffer);
+	return result;
+}
+
+static int
+info_archive (
+	lua_State *L,
+	const SFileInfoClass class,
+	info_function info)
+{
+	return info_helper (L, to_archive, class, info);
+}
+
+static int
+info_file (
+	lua_State *L,
+	const SFileInfoClass class,
+	info_function info)
+{
+	return info_helper (L, to_file, class, info);
+}
+
+/**
+ * `SFileGetFileInfo (handle, class [, packed])`
+ *
+ * Tables of entries (e.g. `SFileMpqHashTable`) are arrays of tables by
+ * default.  When `packed` is true, they are views instead, which hold the
+ * entries as they are stored and read their fields on demand.
+ */
+static int
+stormlib_info (
+	lua_State *L)
+{
+	const SFileInfoClass class = luaL_checkinteger (L, 2);
+
+	switch (class)
+	{
+		case SFileMpqFileName:
+		case SFileMpqStreamBitmap:
+		{
+			return info_archive (L, class, info_string);
+		}
+
+		case SFileMpqUserDataOffset:
+		{
+			return info_archive (L, class, info_integer64);
+		}
+
+		case SFileMpqUserDataHeader:
+		case SFileMpqUserData:
+		{
+			HANDLE handle = to_archive (L);
+
+			/*
+			 * Ensure that the MPQ user data exists, else we may run into a
+			 * segmentation fault.
+			 *
+			 * TODO: StormLib 9.24: Remove this check.
+			 */
+			if (((TMPQArchive *) handle)->pUserData == NULL)
+			{
+				SetLastError (ERROR_INVALID_PARAMETER);
+				return to_error (L);
+			}
+
+			return info_archive (L, class, info_string);
+		}
+
+		case SFileMpqHeaderOffset:
+		{
+			return info_archive (L, class, info_integer64);
+		}
+
+		case SFileMpqHeaderSize:
+		{
+			return info_archive (L, class, info_integer32);
+		}
+
+		case SFileMpqHeader:
+		{
+			return info_archive (L, class, info_mpq_header);
+		}
+
+		case SFileMpqHetTableOffset:
+		case SFileMpqHetTableSize:
+		{
+			return info_archive (L, class, info_integer64);
+		}
+
+		case SFileMpqHetHeader:
+		{
+			return info_archive (L, class, info_het_header);
+		}
+
+		case SFileMpqHetTable:
+		{
+			return info_archive (L, class, info_het_table);
+		}
+
+		case SFileMpqBetTableOffset:
+		case SFileMpqBetTableSize:
+		{
+			return info_archive (L, class, info_integer64);
+		}
+
+		case SFileMpqBetHeader:
+		{
+			return info_archive (L, class, info_bet_header);
+		}
+
+		case SFileMpqBetTable:
+		{
+			return info_archive (L, class, info_bet_table);
+		}
+
+		case SFileMpqHashTableOffset:
+		case SFileMpqHashTableSize64:
+		{
+			return info_archive (L, class, info_integer64);
+		}
+
+		case SFileMpqHashTableSize:
+		{
+			return info_archive (L, class, info_integer32);
+		}
+
+		case SFileMpqHashTable:
+		{
+			return info_archive (L, class, info_hash_table);
+		}
+
+		case SFileMpqBlockTableOffset:
+		case SFileMpqBlockTableSize64:
+		{
+			return info_archive (L, class, info_integer64);
+		}
+
+		case SFileMpqBlockTableSize:
+		{
+			return info_archive (L, class, info_integer32);
+		}
+
+		case SFileMpqBlockTable:
+		{
+			return info_archive (L, class, info_block_table);
+		}
+
+		case SFileMpqHiBlockTableOffset:
+		case SFileMpqHiBlockTableSize64:
+		{
+			return info_archive (L, class, info_integer64);
+		}
+
+		case SFileMpqHiBlockTable:
+		{
+			return info_not_implemented_yet (L);
+		}
+
+		case SFileMpqSignatures:
+		{
+			return info_archive (L, class, info_integer32);
+		}
+
+		case SFileMpqStrongSignatureOffset:
+		{
+			return info_archive (L, class, info_integer64);
+		}
+
+		case SFileMpqStrongSignatureSize:
+		{
+			return info_archive (L, class, info_integer32);
+		}
+
+		case SFileMpqStrongSignature:
+		{
+			return info_archive (L, class, info_string);
+		}
+
+		case SFileMpqArchiveSize64:
+		{
+			return info_archive (L, class, info_integer64);
+		}
+
+		case SFileMpqArchiveSize:
+		case SFileMpqMaxFileCount:
+		case SFileMpqFileTableSize:
+		case SFileMpqSectorSize:
+		case SFileMpqNumberOfFiles:
+		case SFileMpqRawChunkSize:
+		case SFileMpqStreamFlags:
+		case SFileMpqFlags:
+		{
+			return info_archive (L, class, info_integer32);
+		}
+
+		case SFileInfoPatchChain:
+		{
+			return info_file (L, class, info_string_array);
+		}
+
+		case SFileInfoFileEntry:
+		{
+			return info_file (L, class, info_file_entry);
+		}
+
+		case SFileInfoHashEntry:
+		{
+			return info_file (L, class, info_hash_entry);
+		}
+
+		case SFileInfoHashIndex:
+		case SFileInfoNameHash1:
+		case SFileInfoNameHash2:
+		{
+			return info_file (L, class, info_integer32);
+		}
+
+		case SFileInfoNameHash3:
+		{
+			return info_file (L, class, info_integer64);
+		}
+
+		case SFileInfoLocale:
+		case SFileInfoFileIndex:
+		{
+			return info_file (L, class, info_integer32);
+		}
+
+		case SFileInfoByteOffset:
+		case SFileInfoFileTime:
+		{
+			return info_file (L, class, info_integer64);
+		}
+
+		case SFileInfoFileSize:
+		case SFileInfoCompressedSize:
+		case SFileInfoFlags:
+		case SFileInfoEncryptionKey:
+		case SFileInfoEncryptionKeyRaw:
+		case SFileInfoCRC32:
+		{
+			return info_file (L, class, info_integer32);
+		}
+
+		default:
+		{
+			return luaL_argerror (L, 2, "invalid info class");
+		}
+	}
+}
+
+/**
+ * `SFileGetFileName (file)`
+ */
+static int
+file_name (
+	lua_State *L)
+{
+	HANDLE file = to_file (L);
+	char name [MAX_PATH + 1] = { 0 };
+
+	if (!SFileGetFileName (file, name))
+	{
+		return to_error (L);
+	}
+
+	lua_pushstring (L, name);
+	return 1;
+}
+
+/*
+ * `SFileExtractFile (archive, name, path)`
+ */
+static int
+archive_extract (
+	lua_State *L)
+{
+	HANDLE archive = to_archive (L);
+	const char *name = luaL_checkstring (L, 2);
+	const char *path = luaL_checkstring (L, 3);
+	const DWORD scope = luaL_checkinteger (L, 4);
+
+	return to_result (
+		L, SFileExtractFile (archive, name, path, scope));
+}
+
+/**
+ * `SFileGetFileChecksums (archive, name)`
+ *
+ * Returns the CRC32 and MD5 of the contents of the file.  The MD5 is a
+ * string of 16 bytes.
+ */
+static int
+archive_checksums (
+	lua_State *L)
+{
+	HANDLE archive = to_archive (L);
+	const char *name = luaL_checkstring (L, 2);
+	char md5 [MD5_DIGEST_SIZE];
+	DWORD crc = 0;
+
+	if (!SFileGetFileChecksums (archive, name, &crc, md5))
+	{
+		return to_error (L);
+	}
+
+	lua_pushinteger (L, (lua_Integer) crc);
+	lua_pushlstring (L, md5, sizeof (md5));
+	return 2;
+}
+
+/*
+ * `SFileVerifyFile (archive)`
+ */
+static int
+archive_verify (
+	lua_State *L)
+{
+	HANDLE archive = to_archive (L);
+	const char *name = luaL_checkstring (L, 2);
+	const DWORD flags = luaL_checkinteger (L, 3);
+	const DWORD result = SFileVerifyFile (archive, name, flags);
+
+	if (result & VERIFY_OPEN_ERROR)
+	{
+		return to_error (L);
+	}
+
+	lua_pushinteger (L, result);
+	return 1;
+}
+
+/**
+ * `SFileVerifyRawData (archive, what [, name])`
+ */
+static int
+archive_verify_raw (
+	lua_State *L)
+{
+	HANDLE archive = to_archive (L);
+	const DWORD what = luaL_checkinteger (L, 2);
+	const char *name = luaL_optstring (L, 3, NULL);
+	const DWORD result = SFileVerifyRawData (archive, what, name);
+
+	SetLastError (result);
+	return to_result (L, result == ERROR_SUCCESS);
+}
+
+/**
+ * `SFileSignArchive (archive, type)`
+ */
+static int
+archive_sign (
+	lua_State *L)
+{
+	HANDLE archive = to_archive (L);
+	const DWORD type = luaL_checkinteger (L, 2);
+
+	return to_result (
+		L, SFileSignArchive (archive, type));
+}
+
+/*
+ * `SFileVerifyArchive (archive)`
+ */
+static int
+stormlib_verify (
+	lua_State *L)
+{
+	HANDLE archive = to_archive (L);
+	const DWORD result = SFileVerifyArchive (archive);
+
+	lua_pushinteger (L, result);
+	return 1;
+}
+
+static void
+finder_load_data (
+	lua_State *L,
+	SFILE_FIND_DATA data)
+{
+	lua_createtable (L, 0, 10);
+	lua_pushstring (L, data.cFileName);
+	lua_setfield (L, -2, "cFileName");
+	lua_pushstring (L, data.szPlainName);
+	lua_setfield (L, -2, "szPlainName");
+	lua_pushinteger (L, data.dwHashIndex);
+	lua_setfield (L, -2, "dwHashIndex");
+	lua_pushinteger (L, data.dwBlockIndex);
+	lua_setfield (L, -2, "dwBlockIndex");
+	lua_pushinteger (L, data.dwFileSize);
+	lua_setfield (L, -2, "dwFileSize");
+	lua_pushinteger (L, data.dwFileFlags);
+	lua_setfield (L, -2, "dwFileFlags");
+	lua_pushinteger (L, data.dwCompSize);
+	lua_setfield (L, -2, "dwCompSize");
+	lua_pushinteger (L, data.dwFileTimeLo);
+	lua_setfield (L, -2, "dwFileTimeLo");
+	lua_pushinteger (L, data.dwFileTimeHi);
+	lua_setfield (L, -2, "dwFileTimeHi");
+	lua_pushinteger (L, data.lcLocale);
+	lua_setfield (L, -2, "lcLocale");
+}
+
+/**
+ * `SFileFindFirstFile (archive, mask [, listfile])`
+ */
+static int
+file_finder_open (
+	lua_State *L)
+{
+	HANDLE archive = to_archive (L);
+	const char *mask = luaL_checkstring (L, 2);
+	const char *listfile = luaL_optstring (L, 3, NULL);
+
+	SFILE_FIND_DATA data;
+	HANDLE finder = SFileFindFirstFile (archive, mask, &data, listfile);
+
+	if (finder == NULL)
+	{
+		return to_error (L);
+	}
+
+	object_initialize (L, finder, SFileFindClose, archive);
+	finder_load_data (L, data);
+	return 2;
+}
+
+/**
+ * `SFileFindNextFile (finder)`
+ */
+static int
+file_finder_next (
+	lua_State *L)
+{
+	HANDLE finder = to_file_finder (L);
+	SFILE_FIND_DATA data;
+
+	if (!SFileFindNextFile (finder, &data))
+	{
+		return to_error (L);
+	}
+
+	finder_load_data (L, data);
+	return 1;
+}
+
+/**
+ * `SFileFindClose (finder)`
+ */
+static int
+file_finder_close (
+	lua_State *L)
+{
+	to_file_finder (L);
+	return object_close (L);
+}
+
+/*
+ * `SListFileFindFirstFile (archive, mask [, listfile])`
+ */
+static int
+listfile_finder_open (
+	lua_State *L)
+{
+	HANDLE archive = to_archive (L);
+	const char *mask = luaL_checkstring (L, 2);
+	const char *listfile = luaL_optstring (L, 3, NULL);
+
+	SFILE_FIND_DATA data;
+	HANDLE finder = SListFileFindFirstFile (archive, listfile, mask, &data);
+
+	if (finder == NULL)
+	{
+		return to_error (L);
+	}
+
+	object_initialize (L, finder, SListFileFindClose, archive);
+	lua_pushstring (L, data.cFileName);
+	return 2;
+}
+
+/**
+ * `SListFileFineNextFile (finder)`
+ */
+static int
+listfile_finder_next (
+	lua_State *L)
+{
+	HANDLE finder = to_listfile_finder (L);
+	SFILE_FIND_DATA data;
+
+	if (!SListFileFindNextFile (finder, &data))
+	{
+		return to_error (L);
+	}
+
+	lua_pushstring (L, data.cFileName);
+	return 1;
+}
+
+/**
+ * `SListFileFindClose (finder)`
+ */
+static int
+listfile_finder_close (
+	lua_State *L)
+{
+	to_listfile_finder (L);
+	return object_close (L);
+}
+
+/*
+ * A basic wrapper around `SFileEnumLocales` to make it behave closer to
+ * most of the functions in the public API.  That is, returning `true` on
+ * success, and returning `false` on failure with an error accessible via
+ * `GetLastError`.
+ */
+static bool
+SFileEnumLocalesWrapper (
+	HANDLE archive,
+	const char *name,
+	LCID *locales,
+	DWORD *count)
+{
+	const int status = SFileEnumLocales (archive, name, locales, count, 0);
+	SetLastError (status);
+	return status == ERROR_SUCCESS;
+}
+
+/**
+ * `SFileEnumLocales (archive, name)`
+ */
+static int
+archive_locales (
+	lua_State *L)
+{
+	HANDLE archive = to_archive (L);
+	const char *name = luaL_checkstring (L, 2);
+
+	/*
+	 * Passing a `NULL` buffer here will elicit a related error.  Success
+	 * can also be returned as well, as is the case with a nonexistent file.
+	 * In these cases, a valid count will be set.
+	 */
+	DWORD count = 0;
+	if (!SFileEnumLocalesWrapper (archive, name, NULL, &count)
+		&& GetLastError () != ERROR_INSUFFICIENT_BUFFER)
+	{
+		return to_error (L);
+	}
+
+	lua_createtable (L, (int) count, 0);
+	if (count == 0)
+	{
+		return 1;
+	}
+
+	LCID *locales = calloc (count, sizeof (LCID));
+	if (locales == NULL)
+	{
+		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+		return to_error (L);
+	}
+
+	int result = 1;
+	if (SFileEnumLocalesWrapper (archive, name, locales, &count))
+	{
+		for (int i = 0; i < count; i++)
+		{
+			lua_pushinteger (L, locales [i]);
+			lua_rawseti (L, -2, i + 1);
+		}
+	}
+	else
+	{
+		result = to_error (L);
+	}
+
+	free (locales);
+	return result;
+}
+
+/**
+ * `SFileCreateFile (archive, name, time, size, locale, flags)`
+ */
+static int
+writer_open (
+	lua_State *L)
+{
+	HANDLE archive = to_archive (L);
+	const char *name = luaL_checkstring (L, 2);
+	const ULONGLONG time = luaL_checkinteger (L, 3);
+	const DWORD size = luaL_checkinteger (L, 4);
+	const LCID locale = luaL_checkinteger (L, 5);
+	const DWORD flags = luaL_checkinteger (L, 6);
+	HANDLE writer = NULL;
+
+	if (!SFileCreateFile (
+		archive, name, time, size, locale, flags, &writer))
+	{
+		if (writer)
+		{
+			SFileFinishFile (writer);
+		}
+
+		return to_error (L);
+	}
+
+	return object_initialize (L, writer, SFileFinishFile, archive);
+}
+
+/**
+ * `SFileWriteFile (file, data, compression)`
+ */
+static int
+writer_write (
+	lua_State *L)
+{
+	HANDLE file = to_writer (L);
+	size_t size;
+	const char *data = luaL_checklstring (L, 2, &size);
+	const DWORD compression = luaL_checkinteger (L, 3);
+
+	return to_result (
+		L, SFileWriteFile (file, data, size, compression));
+}
+
+/**
+ * `SFileFinishFile (file)`
+ */
+static int
+writer_close (
+	lua_State *L)
+{
+	to_writer (L);
+	return object_close (L);
+}
+
+/**
+ * `SFileAddFileEx (
+ *     archive, path, name, flags,
+ *     compression, compression_next)`
+ */
+static int
+archive_insert (
+	lua_State *L)
+{
+	HANDLE archive = to_archive (L);
+	const char *path = luaL_checkstring (L, 2);
+	const char *name = luaL_checkstring (L, 3);
+	const DWORD flags = luaL_checkinteger (L, 4);
+	const DWORD compression = luaL_checkinteger (L, 5);
+	const DWORD compression_next = luaL_checkinteger (L, 6);
+
+	return to_result (
+		L, SFileAddFileEx (
+			archive, path, name, flags,
+			compression, compression_next));
+}
+
+/**
+ * `SFileRemoveFile (archive, name)`
+ */
+static int
+archive_remove (
+	lua_State *L)
+{
+	HANDLE archive = to_archive (L);
+	const char *name = luaL_checkstring (L, 2);
+
+	return to_result (
+		L, SFileRemoveFile (archive, name, 0));
+}
+
+/**
+ * `SFileRenameFile (archive, old, new)`
+ */
+static int
+archive_rename (
+	lua_State *L)
+{
+	HANDLE archive = to_archive (L);
+	const char *old = luaL_checkstring (L, 2);
+	const char *new = luaL_checkstring (L, 3);
+
+	return to_result (
+		L, SFileRenameFile (archive, old, new));
+}
+
+/**
+ * `SFileSetFileLocale (file, locale)`
+ */
+static int
+file_locale (
+	lua_State *L)
+{
+	HANDLE file = to_file (L);
+	const LCID locale = luaL_checkinteger (L, 2);
+
+	return to_result (
+		L, SFileSetFileLocale (file, locale));
+}
+
+static void
+insert_callback (
+	void *data,
+	DWORD written,
+	/* NOLINTNEXTLINE(bugprone-easily-swappable-parameters) */
+	DWORD total,
+	char finished)
+{
+	const struct object *object = data;
+	lua_State *L = object->insert;
+
+	lua_rawgetp (L, LUA_REGISTRYINDEX, &object->insert);
+	lua_pushinteger (L, written);
+	lua_pushinteger (L, total);
+	lua_pushboolean (L, finished);
+	lua_call (L, 3, 0);
+}
+
+/**
+ * `SFileSetAddFileCallback (archive [, callback])`
+ */
+static int
+archive_insert_callback (
+	lua_State *L)
+{
+	struct object *object = to_object (L, 1);
+	HANDLE archive = to_archive (L);
+	SFILE_ADDFILE_CALLBACK callback = NULL;
+
+	if (lua_isfunction (L, 2))
+	{
+		callback = insert_callback;
+		object->insert = L;
+	}
+	else if (!lua_isnoneornil (L, 2))
+	{
+		luaL_checktype (L, 2, LUA_TFUNCTION);
+	}
+
+	lua_settop (L, 2);
+	lua_rawsetp (L, LUA_REGISTRYINDEX, &object->insert);
+
+	return to_result (
+		L, SFileSetAddFileCallback (archive, callback, object));
+}
+
+#define STORMLIB_SCRATCH_METATABLE "StormLib Scratch"
+
+/*
+ * Scratch space larger than this is released once a call is done with it,
+ * rather than being kept around for the next.
+ */
+#define STORMLIB_SCRATCH_LIMIT (16 * 1024 * 1024)
+
+/*
+ * Codecs known to leave their input untouched.  StormLib takes the input
+ * as writable memory, so it is copied for anything else (e.g. ADPCM).
+ */
+#define STORMLIB_COMPRESSION_CONST \
+	(MPQ_COMPRESSION_HUFFMANN | MPQ_COMPRESSION_ZLIB \
+	| MPQ_COMPRESSION_PKWARE | MPQ_COMPRESSION_BZIP2 \
+	| MPQ_COMPRESSION_SPARSE | MPQ_COMPRESSION_LZMA)
+
+/*
+ * Working memory for the compression functions, owned by the Lua state
+ * (and anchored in the registry).  It is reused from call to call, which
+ * keeps allocations off the hot path.
+ */
+struct scratch
+{
+	char *data;
+	size_t capacity;
+};
+
+static char scratch_key;
+
+static int
+scratch_garbage_collect (
+	lua_State *L)
+{
+	struct scratch *scratch = luaL_checkudata (
+		L, 1, STORMLIB_SCRATCH_METATABLE);
+
+	free (scratch->data);
+	scratch->data = NULL;
+	scratch->capacity = 0;
+	return 0;
+}
+
+static struct scratch *
+to_scratch (
+	lua_State *L)
+{
+	lua_rawgetp (L, LUA_REGISTRYINDEX, &scratch_key);
+	struct scratch *scratch = lua_touserdata (L, -1);
+	lua_pop (L, 1);
+
+	if (scratch)
+	{
+		return scratch;
+	}
+
+	scratch = lua_newuserdata (L, sizeof (*scratch));
+	memset (scratch, 0, sizeof (*scratch));
+
+	if (luaL_newmetatable (L, STORMLIB_SCRATCH_METATABLE))
+	{
+		lua_pushcfunction (L, scratch_garbage_collect);
+		lua_setfield (L, -2, "__gc");
+	}
+
+	lua_setmetatable (L, -2);
+	lua_rawsetp (L, LUA_REGISTRYINDEX, &scratch_key);
+	return scratch;
+}
+
+/*
+ * Returns at least `size` bytes of scratch space.  The previous contents
+ * are not preserved.
+ */
+static char *
+scratch_reserve (
+	struct scratch *scratch,
+	const size_t size)
+{
+	if (size <= scratch->capacity)
+	{
+		return scratch->data;
+	}
+
+	size_t capacity = scratch->capacity * 2;
+
+	if (capacity < size)
+	{
+		capacity = size;
+	}
+
+	free (scratch->data);
+	scratch->data = malloc (capacity);
+	scratch->capacity = scratch->data ? capacity : 0;
+
+	if (scratch->data == NULL)
+	{
+		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+	}
+
+	return scratch->data;
+}
+
+static void
+scratch_release (
+	struct scratch *scratch)
+{
+	if (scratch->capacity > STORMLIB_SCRATCH_LIMIT)
+	{
+		free (scratch->data);
+		scratch->data = NULL;
+		scratch->capacity = 0;
+	}
+}
+
+/*
+ * Most candidates a single call to `SCompCompress ()` may try.
+ */
+#define STORMLIB_COMPRESSION_CANDIDATES 16
+
+enum comp_mode
+{
+	COMP_COMPRESS,
+	COMP_DECOMPRESS,
+	COMP_DECOMPRESS2
+};
+
+/*
+ * A compression tried by `comp_best ()`, along with the size of its
+ * result and the time it took.
+ */
+struct comp_candidate
+{
+	int compression;
+	int level;
+	int size;
+	clock_t time;
+};
+
+/*
+ * Returns whether the codecs involved might modify the input.  When
+ * decompressing, the codecs are read from the first byte of the input,
+ * unless it is stored as is.
+ */
+static bool
+comp_mutates (
+	const enum comp_mode mode,
+	const char *in,
+	const size_t in_size,
+	const int out_size,
+	const int compression)
+{
+	const int codec = mode == COMP_COMPRESS
+		? compression
+		: in_size > 0 && in_size < (size_t) out_size
+			? (unsigned char) in [0]
+			: 0;
+
+	return (codec & ~STORMLIB_COMPRESSION_CONST) != 0;
+}
+
+static int
+comp_call (
+	const enum comp_mode mode,
+	char *out,
+	int *out_size,
+	void *in,
+	const size_t in_size,
+	const int compression,
+	const int level)
+{
+	switch (mode)
+	{
+		case COMP_COMPRESS:
+		{
+			return SCompCompress (out, out_size,
+				in, (int) in_size, compression, 0, level);
+		}
+
+		case COMP_DECOMPRESS:
+		{
+			return SCompDecompress (out, out_size, in, (int) in_size);
+		}
+
+		case COMP_DECOMPRESS2:
+		{
+			return SCompDecompress2 (out, out_size, in, (int) in_size);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Compresses (or decompresses) `in`, into at most `out_size` bytes.  The
+ * result is written into the buffer `out` when provided, and is otherwise
+ * pushed as a string.  The input is only copied when the codec might
+ * modify it, or when it is also the output (i.e. `same` is set).
+ */
+static bool
+comp_run (
+	lua_State *L,
+	struct scratch *scratch,
+	struct buffer *out,
+	const bool same,
+	const enum comp_mode mode,
+	const char *in,
+	const size_t in_size,
+	int out_size,
+	const int compression,
+	const int level)
+{
+	const bool copy = same
+		|| comp_mutates (mode, in, in_size, out_size, compression);
+	const size_t room = out ? 0 : (size_t) out_size;
+	const size_t needed = room + (copy ? in_size : 0);
+	char *data = scratch_reserve (scratch, needed > 0 ? needed : 1);
+
+	if (data == NULL)
+	{
+		return false;
+	}
+
+	/* Safe, as the input is only given as is when it is left untouched. */
+	void *input = (void *) in;
+
+	if (copy)
+	{
+		input = memcpy (data + room, in, in_size);
+	}
+
+	char *output = out ? buffer_fill (out, (size_t) out_size) : data;
+
+	if (output == NULL
+		|| !comp_call (mode, output, &out_size,
+			input, in_size, compression, level))
+	{
+		return false;
+	}
+
+	if (out)
+	{
+		buffer_filled (out, (size_t) out_size);
+	}
+	else
+	{
+		lua_pushlstring (L, output, (size_t) out_size);
+	}
+
+	return true;
+}
+
+/*
+ * Compresses `in` with each of the `count` candidates, keeping the
+ * smallest result.  Given a `budget` (e.g. 1.05), the fastest candidate
+ * whose result is within that factor of the smallest is kept instead.  The
+ * result is left in scratch space, and the index of the candidate kept is
+ * stored in `chosen`.
+ */
+static char *
+comp_best (
+	struct scratch *scratch,
+	const char *in,
+	const size_t in_size,
+	struct comp_candidate *candidates,
+	const size_t count,
+	const double budget,
+	int *out_size,
+	size_t *chosen)
+{
+	/* Room for the best result so far, the current one, and the input. */
+	const size_t room = in_size > 0 ? in_size : 1;
+	char *data = scratch_reserve (scratch, room * 3);
+
+	if (data == NULL)
+	{
+		return NULL;
+	}
+
+	char *best = data;
+	char *current = data + room;
+	char *copy = data + room * 2;
+	size_t smallest = 0;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		struct comp_candidate *candidate = &candidates [i];
+		void *input = (void *) in;
+
+		if (comp_mutates (COMP_COMPRESS,
+				in, in_size, 0, candidate->compression))
+		{
+			input = memcpy (copy, in, in_size);
+		}
+
+		const clock_t start = clock ();
+		candidate->size = (int) in_size;
+
+		if (!comp_call (COMP_COMPRESS, current, &candidate->size,
+				input, in_size, candidate->compression, candidate->level))
+		{
+			return NULL;
+		}
+
+		candidate->time = clock () - start;
+
+		if (i == 0 || candidate->size < candidates [smallest].size)
+		{
+			char *swap = best;
+			best = current;
+			current = swap;
+			smallest = i;
+		}
+	}
+
+	*chosen = smallest;
+
+	if (budget > 0)
+	{
+		const double limit = candidates [smallest].size * budget;
+
+		for (size_t i = 0; i < count; i++)
+		{
+			if (candidates [i].size <= limit
+				&& candidates [i].time < candidates [*chosen].time)
+			{
+				*chosen = i;
+			}
+		}
+	}
+
+	const struct comp_candidate *candidate = &candidates [*chosen];
+	*out_size = candidate->size;
+
+	if (*chosen == smallest)
+	{
+		return best;
+	}
+
+	/* Only the smallest result is kept, so the chosen one is redone. */
+	void *input = comp_mutates (COMP_COMPRESS,
+			in, in_size, 0, candidate->compression)
+		? memcpy (copy, in, in_size)
+		: (void *) in;
+	*out_size = (int) in_size;
+
+	if (!comp_call (COMP_COMPRESS, current, out_size,
+			input, in_size, candidate->compression, candidate->level))
+	{
+		return NULL;
+	}
+
+	return current;
+}
+
+/*
+ * Reads the candidates from the table at `index`.  Each entry is either a
+ * compression mask, or a table of the mask and level.  Entries without a
+ * level use `level`.
+ */
+static size_t
+comp_candidates (
+	lua_State *L,
+	const int index,
+	const int level,
+	struct comp_candidate *candidates,
+	double *budget)
+{
+	const lua_Integer count = luaL_len (L, index);
+	luaL_argcheck (L, count > 0 && count <= STORMLIB_COMPRESSION_CANDIDATES,
+		index, "invalid number of candidates");
+
+	for (lua_Integer i = 1; i <= count; i++)
+	{
+		struct comp_candidate *candidate = &candidates [i - 1];
+		lua_rawgeti (L, index, i);
+		candidate->level = level;
+
+		if (lua_istable (L, -1))
+		{
+			lua_rawgeti (L, -1, 2);
+
+			if (!lua_isnil (L, -1))
+			{
+				candidate->level = (int) lua_tointeger (L, -1);
+			}
+
+			lua_pop (L, 1);
+			lua_rawgeti (L, -1, 1);
+			lua_replace (L, -2);
+		}
+
+		if (lua_type (L, -1) != LUA_TNUMBER)
+		{
+			luaL_error (L, "bad candidate #%d (number expected)", (int) i);
+		}
+
+		candidate->compression = (int) lua_tointeger (L, -1);
+		lua_pop (L, 1);
+	}
+
+	lua_getfield (L, index, "budget");
+
+	if (!lua_isnil (L, -1) && lua_type (L, -1) != LUA_TNUMBER)
+	{
+		luaL_error (L, "bad budget (number expected)");
+	}
+
+	*budget = lua_tonumber (L, -1);
+	lua_pop (L, 1);
+
+	return (size_t) count;
+}
+
+/**
+ * `SCompCompress (in, compression [, level [, out]])`
+ *
+ * The input can be a string or a buffer.  When the buffer `out` is
+ * provided, its contents are replaced by the result, and it is returned in
+ * place of a string.
+ *
+ * The `compression` can also be an array of candidates, each of which is a
+ * mask, or a table of the mask and level.  Every candidate is tried, and
+ * the smallest result is kept.  If the array has a `budget` field (e.g.
+ * 1.05), the fastest candidate within that factor of the smallest is kept
+ * instead.  The index of the candidate kept is returned as well.
+ */
+static int
+stormlib_compress (
+	lua_State *L)
+{
+	size_t in_size;
+	const char *in = check_bytes (L, 1, &in_size);
+	const bool many = lua_istable (L, 2);
+	const int compression = many ? 0 : (int) luaL_checkinteger (L, 2);
+	const int level = (int) luaL_optinteger (L, 3, 0);
+	struct buffer *out = test_buffer (L, 4);
+
+	/*
+	 * StormLib's compression accepts `int`.  It also 'fails' if the output
+	 * would otherwise exceed the input length, and returns the input.
+	 */
+	if (in_size > INT_MAX)
+	{
+		const char *message = lua_pushfstring (
+			L, "input length exceeded: %d", INT_MAX);
+		return luaL_argerror (L, 1, message);
+	}
+
+	struct comp_candidate candidates [STORMLIB_COMPRESSION_CANDIDATES];
+	double budget = 0;
+	const size_t count = many
+		? comp_candidates (L, 2, level, candidates, &budget)
+		: 0;
+
+	struct scratch *scratch = to_scratch (L);
+	int result = 1;
+
+	if (many)
+	{
+		int out_size = 0;
+		size_t chosen = 0;
+		char *data = comp_best (scratch, in, in_size,
+			candidates, count, budget, &out_size, &chosen);
+		char *output = data && out
+			? buffer_fill (out, (size_t) out_size)
+			: NULL;
+
+		if (data == NULL || (out && output == NULL))
+		{
+			result = to_error (L);
+		}
+		else
+		{
+			if (out)
+			{
+				memcpy (output, data, (size_t) out_size);
+				buffer_filled (out, (size_t) out_size);
+				lua_pushvalue (L, 4);
+			}
+			else
+			{
+				lua_pushlstring (L, data, (size_t) out_size);
+			}
+
+			lua_pushinteger (L, (lua_Integer) chosen + 1);
+			result = 2;
+		}
+	}
+	else if (!comp_run (L, scratch, out, out && lua_rawequal (L, 1, 4),
+			COMP_COMPRESS, in, in_size, (int) in_size, compression, level))
+	{
+		result = to_error (L);
+	}
+	else if (out)
+	{
+		lua_pushvalue (L, 4);
+	}
+
+	scratch_release (scratch);
+	return result;
+}
+
+static int
+decompress_helper (
+	lua_State *L,
+	const enum comp_mode mode)
+{
+	size_t in_size;
+	const char *in = check_bytes (L, 1, &in_size);
+	const int out_size = (int) luaL_checkinteger (L, 2);
+	struct buffer *out = test_buffer (L, 3);
+	luaL_argcheck (L, out_size >= 0, 2, "out_size must be non-negative");
+
+	if (in_size > INT_MAX)
+	{
+		const char *message = lua_pushfstring (
+			L, "input length exceeded: %d", INT_MAX);
+		return luaL_argerror (L, 1, message);
+	}
+
+	struct scratch *scratch = to_scratch (L);
+	int result = 1;
+
+	if (!comp_run (L, scratch, out, out && lua_rawequal (L, 1, 3), mode,
+			in, in_size, out_size, 0, 0))
+	{
+		result = to_error (L);
+	}
+	else if (out)
+	{
+		lua_pushvalue (L, 3);
+	}
+
+	scratch_release (scratch);
+	return result;
+}
+
+/**
+ * `SCompDecompress (in, out_size [, out])`
+ *
+ * As with `SCompCompress`, the input can be a string or a buffer, and the
+ * result can be written into the buffer `out`.
+ */
+static int
+stormlib_decompress (
+	lua_State *L)
+{
+	return decompress_helper (L, COMP_DECOMPRESS);
+}
+
+/**
+ * `SCompDecompress2 (in, out_size [, out])`
+ *
+ * As with `SCompDecompress`.
+ */
+static int
+stormlib_decompress2 (
+	lua_State *L)
+{
+	return decompress_helper (L, COMP_DECOMPRESS2);
+}
+
+/*
+ * The following are extensions, and are not part of StormLib.  They
+ * exist to support the Lua API, but are exposed in the Core API as they may
+ * be of use elsewhere.
+ */
+#define STORMLIB_BUFFER_METATABLE "StormLib Buffer"
+
+/*
+ * Files larger than this are moved out of memory and into a temporary file.
+ */
+#define STORMLIB_BUFFER_LIMIT (16 * 1024 * 1024)
+
+/*
+ * Size of the window used to read from a temporary file.
+ */
+#define STORMLIB_BUFFER_WINDOW 8192
+
+/*
+ * Number of sectors cached when reading directly from an archive.
+ */
+#define STORMLIB_BUFFER_SECTORS 4
+
+struct window
+{
+	char *data;
+	size_t offset;
+	size_t loaded;
+	size_t used;
+};
+
+/*
+ * A file, which mimics the behavior of the Lua I/O library.  There are
+ * four kinds:
+ *
+ * - In-memory, where the contents are held in `data`.
+ * - Mapped, where `data` points into memory that belongs to someone else
+ *   (i.e. a mapping of the archive).  These are read-only.
+ * - Spilled, where an in-memory buffer has exceeded its limit and its
+ *   contents have been moved into the temporary file `spill`.
+ * - Streamed, where the contents are read on demand from the StormLib file
+ *   handle `file`.  These are read-only.
+ *
+ * Spilled and streamed buffers read through a small cache of aligned
+ * windows, such that only the parts that are touched get loaded (or
+ * decompressed).
+ */
+struct buffer
+{
+	char *data;
+	size_t size;
+	size_t capacity;
+	size_t position;
+	size_t limit;
+	FILE *spill;
+	struct object *file;
+	struct window *windows;
+	size_t count;
+	size_t width;
+	size_t clock;
+	bool mapped;
+	bool failed;
+	bool closed;
+};
+
+static struct buffer *
+to_buffer (
+	lua_State *L,
+	const int index)
+{
+	struct buffer *buffer = luaL_checkudata (
+		L, index, STORMLIB_BUFFER_METATABLE);
+
+	if (buffer->closed)
+	{
+		luaL_error (L, "attempt to use a closed buffer");
+	}
+
+	if (buffer->file && is_closed (buffer->file))
+	{
+		luaL_error (L, "attempt to use a closed handle");
+	}
+
+	return buffer;
+}
+
+static struct buffer *
+test_buffer (
+	lua_State *L,
+	const int index)
+{
+	return lua_isnoneornil (L, index) ? NULL : to_buffer (L, index);
+}
+
+static bool
+buffer_reserve (
+	struct buffer *buffer,
+	const size_t size)
+{
+	if (size <= buffer->capacity)
+	{
+		return true;
+	}
+
+	size_t capacity = buffer->capacity > 0
+		? buffer->capacity
+		: LUAL_BUFFERSIZE;
+
+	while (capacity < size)
+	{
+		capacity = capacity * 2;
+	}
+
+	char *data = realloc (buffer->data, capacity);
+	if (data == NULL)
+	{
+		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+		return false;
+	}
+
+	buffer->data = data;
+	buffer->capacity = capacity;
+	return true;
+}
+
+/*
+ * Allocates `count` windows of `width` bytes each.  The windows share a
+ * single allocation.
+ */
+static bool
+buffer_windows (
+	struct buffer *buffer,
+	const size_t count,
+	const size_t width)
+{
+	struct window *windows = calloc (count, sizeof (*windows));
+	char *data = malloc (count * width);
+
+	if (windows == NULL || data == NULL)
+	{
+		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+		free (windows);
+		free (data);
+		return false;
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		windows [i].data = data + i * width;
+	}
+
+	buffer->windows = windows;
+	buffer->count = count;
+	buffer->width = width;
+	return true;
+}
+
+static void
+buffer_invalidate (
+	struct buffer *buffer)
+{
+	for (size_t i = 0; i < buffer->count; i++)
+	{
+		buffer->windows [i].loaded = 0;
+	}
+}
+
+static bool
+buffer_spill (
+	struct buffer *buffer)
+{
+	FILE *spill = tmpfile ();
+	if (spill == NULL)
+	{
+		SetLastError (errno);
+		return false;
+	}
+
+	if (fwrite (buffer->data, 1, buffer->size, spill) != buffer->size)
+	{
+		SetLastError (errno);
+		fclose (spill);
+		return false;
+	}
+
+	if (!buffer_windows (buffer, 1, STORMLIB_BUFFER_WINDOW))
+	{
+		fclose (spill);
+		return false;
+	}
+
+	/* The contents now live in the file. */
+	free (buffer->data);
+	buffer->data = NULL;
+	buffer->capacity = 0;
+	buffer->spill = spill;
+	return true;
+}
+
+static bool
+buffer_load (
+	struct buffer *buffer,
+	struct window *window,
+	const size_t offset)
+{
+	window->offset = offset;
+	window->loaded = 0;
+
+	if (buffer->spill)
+	{
+		if (fseek (buffer->spill, (long) offset, SEEK_SET) != 0)
+		{
+			SetLastError (errno);
+			return false;
+		}
+
+		window->loaded = fread (
+			window->data, 1, buffer->width, buffer->spill);
+
+		if (ferror (buffer->spill))
+		{
+			SetLastError (errno);
+			return false;
+		}
+
+		return true;
+	}
+
+	HANDLE file = buffer->file->handle;
+	LONG high = (LONG) ((ULONGLONG) offset >> 32);
+	DWORD loaded = 0;
+
+	if (SFileSetFilePointer (file, (LONG) offset, &high, FILE_BEGIN)
+		== SFILE_INVALID_POS)
+	{
+		return false;
+	}
+
+	if (!SFileReadFile (
+			file, window->data, (DWORD) buffer->width, &loaded, NULL)
+		&& GetLastError () != ERROR_HANDLE_EOF)
+	{
+		return false;
+	}
+
+	window->loaded = loaded;
+	return true;
+}
+
+/*
+ * Returns the window containing `position`, loading it if needed.  The
+ * least recently used window is replaced.
+ */
+static struct window *
+buffer_window (
+	struct buffer *buffer,
+	const size_t position)
+{
+	const size_t offset = position - position % buffer->width;
+	struct window *window = &buffer->windows [0];
+
+	for (size_t i = 0; i < buffer->count; i++)
+	{
+		struct window *current = &buffer->windows [i];
+
+		if (current->loaded > 0 && current->offset == offset)
+		{
+			current->used = ++buffer->clock;
+			return current;
+		}
+
+		if (current->used < window->used)
+		{
+			window = current;
+		}
+	}
+
+	if (!buffer_load (buffer, window, offset))
+	{
+		buffer->failed = true;
+		return NULL;
+	}
+
+	window->used = ++buffer->clock;
+	return window;
+}
+
+/*
+ * Returns the contiguous bytes available at the current position.  A count
+ * of zero indicates the end of the buffer (or an error).
+ */
+static const char *
+buffer_peek (
+	struct buffer *buffer,
+	size_t *available)
+{
+	*available = 0;
+
+	if (buffer->position >= buffer->size)
+	{
+		return NULL;
+	}
+
+	if (!buffer->windows)
+	{
+		*available = buffer->size - buffer->position;
+		return buffer->data + buffer->position;
+	}
+
+	const struct window *window = buffer_window (buffer, buffer->position);
+
+	if (window == NULL
+		|| buffer->position - window->offset >= window->loaded)
+	{
+		return NULL;
+	}
+
+	const size_t offset = buffer->position - window->offset;
+	*available = window->loaded - offset;
+	return window->data + offset;
+}
+
+static void
+buffer_skip (
+	struct buffer *buffer,
+	const size_t count)
+{
+	buffer->position = buffer->position + count;
+}
+
+static bool
+buffer_write (
+	struct buffer *buffer,
+	const char *bytes,
+	const size_t count)
+{
+	const size_t end = buffer->position + count;
+
+	if (buffer->file || buffer->mapped)
+	{
+		SetLastError (ERROR_INVALID_HANDLE);
+		return false;
+	}
+
+	/* As with a file, writing nothing past the end does not extend it. */
+	if (count == 0)
+	{
+		return true;
+	}
+
+	if (!buffer->spill && end > buffer->limit && !buffer_spill (buffer))
+	{
+		return false;
+	}
+
+	if (buffer->spill)
+	{
+		if (fseek (buffer->spill, (long) buffer->position, SEEK_SET) != 0
+			|| fwrite (bytes, 1, count, buffer->spill) != count)
+		{
+			SetLastError (errno);
+			return false;
+		}
+
+		buffer_invalidate (buffer);
+	}
+	else
+	{
+		if (!buffer_reserve (buffer, end))
+		{
+			return false;
+		}
+
+		/* Writing past the end leaves a gap, which is zero-filled. */
+		if (buffer->position > buffer->size)
+		{
+			memset (buffer->data + buffer->size, 0,
+				buffer->position - buffer->size);
+		}
+
+		memcpy (buffer->data + buffer->position, bytes, count);
+	}
+
+	buffer->position = end;
+
+	if (end > buffer->size)
+	{
+		buffer->size = end;
+	}
+
+	return true;
+}
+
+/*
+ * Discards the contents of `buffer`, and returns room for `capacity` bytes
+ * to be written in their place.  Once written, `buffer_filled ()` sets the
+ * new size.  Only in-memory buffers can be filled.
+ */
+static char *
+buffer_fill (
+	struct buffer *buffer,
+	const size_t capacity)
+{
+	if (buffer->spill || buffer->file || buffer->mapped)
+	{
+		SetLastError (ERROR_INVALID_HANDLE);
+		return NULL;
+	}
+
+	if (!buffer_reserve (buffer, capacity > 0 ? capacity : 1))
+	{
+		return NULL;
+	}
+
+	buffer->size = 0;
+	buffer->position = 0;
+	return buffer->data;
+}
+
+static void
+buffer_filled (
+	struct buffer *buffer,
+	const size_t size)
+{
+	buffer->size = size;
+}
+
+/*
+ * Returns the bytes of the string or buffer at `index`, or `NULL` when it
+ * is neither (or is a buffer whose contents are not in memory).
+ */
+static const char *
+test_bytes (
+	lua_State *L,
+	const int index,
+	size_t *size)
+{
+	if (lua_type (L, index) == LUA_TSTRING)
+	{
+		return lua_tolstring (L, index, size);
+	}
+
+	const struct buffer *buffer = luaL_testudata (
+		L, index, STORMLIB_BUFFER_METATABLE);
+
+	if (buffer == NULL || buffer->closed || buffer->windows)
+	{
+		return NULL;
+	}
+
+	*size = buffer->size;
+	return buffer->data ? buffer->data : "";
+}
+
+/*
+ * Returns the bytes of the string or buffer at `index`.  Buffers must have
+ * their contents in memory.
+ */
+static const char *
+check_bytes (
+	lua_State *L,
+	const int index,
+	size_t *size)
+{
+	if (lua_type (L, index) == LUA_TSTRING)
+	{
+		return lua_tolstring (L, index, size);
+	}
+
+	const struct buffer *buffer = to_buffer (L, index);
+
+	if (buffer->windows)
+	{
+		luaL_argerror (L, index, "buffer is not in memory");
+	}
+
+	*size = buffer->size;
+	return buffer->data ? buffer->data : "";
+}
+
+static bool
+buffer_free (
+	lua_State *L,
+	struct buffer *buffer)
+{
+	bool status = true;
+
+	if (buffer->spill)
+	{
+		status = fclose (buffer->spill) == 0;
+	}
+
+	if (buffer->file)
+	{
+		if (!is_closed (buffer->file))
+		{
+			status = object_finalize (L, buffer->file);
+		}
+
+		lua_pushnil (L);
+		lua_rawsetp (L, LUA_REGISTRYINDEX, buffer);
+	}
+
+	if (buffer->windows)
+	{
+		free (buffer->windows [0].data);
+		free (buffer->windows);
+	}
+
+	if (!buffer->mapped)
+	{
+		free (buffer->data);
+	}
+
+	buffer->data = NULL;
+	buffer->spill = NULL;
+	buffer->file = NULL;
+	buffer->windows = NULL;
+	buffer->size = 0;
+	buffer->capacity = 0;
+	buffer->position = 0;
+	buffer->count = 0;
+	buffer->closed = true;
+	return status;
+}
+
+/*
+ * The following reading functions follow the implementation found in the
+ * Lua I/O library, save that they operate on the buffer.
+ */
+static bool
+buffer_test_eof (
+	lua_State *L,
+	struct buffer *buffer)
+{
+	size_t available;
+	buffer_peek (buffer, &available);
+	lua_pushliteral (L, "");
+	return available > 0;
+}
+
+static bool
+buffer_read_line (
+	lua_State *L,
+	struct buffer *buffer,
+	const bool chop)
+{
+	luaL_Buffer result;
+	luaL_buffinit (L, &result);
+	bool found = false;
+	bool read = false;
+	size_t available;
+	const char *bytes;
+
+	while (!found && (bytes = buffer_peek (buffer, &available)))
+	{
+		const char *newline = memchr (bytes, '\n', available);
+		size_t count = available;
+
+		if (newline)
+		{
+			found = true;
+			count = (size_t) (newline - bytes);
+		}
+
+		luaL_addlstring (&result, bytes, count);
+		buffer_skip (buffer, count + (found ? 1 : 0));
+		read = true;
+	}
+
+	if (found && !chop)
+	{
+		luaL_addchar (&result, '\n');
+	}
+
+	luaL_pushresult (&result);
+	return read;
+}
+
+static bool
+buffer_read_chars (
+	lua_State *L,
+	struct buffer *buffer,
+	size_t count)
+{
+	luaL_Buffer result;
+	luaL_buffinit (L, &result);
+	bool read = false;
+	size_t available;
+	const char *bytes;
+
+	while (count > 0 && (bytes = buffer_peek (buffer, &available)))
+	{
+		const size_t size = available < count ? available : count;
+		luaL_addlstring (&result, bytes, size);
+		buffer_skip (buffer, size);
+		count = count - size;
+		read = true;
+	}
+
+	luaL_pushresult (&result);
+	return read;
+}
+
+static void
+buffer_read_all (
+	lua_State *L,
+	struct buffer *buffer)
+{
+	buffer_read_chars (L, buffer, SIZE_MAX);
+}
+
+#define STORMLIB_NUMBER_MAX 200
+
+struct number_reader
+{
+	struct buffer *buffer;
+	int current;
+	int count;
+	char text [STORMLIB_NUMBER_MAX + 1];
+};
+
+static int
+number_reader_get (
+	struct buffer *buffer)
+{
+	size_t available;
+	const char *bytes = buffer_peek (buffer, &available);
+	return bytes ? (unsigned char) bytes [0] : EOF;
+}
+
+static bool
+number_reader_next (
+	struct number_reader *reader)
+{
+	if (reader->count >= STORMLIB_NUMBER_MAX)
+	{
+		reader->text [0] = '\0';
+		return false;
+	}
+
+	reader->text [reader->count++] = (char) reader->current;
+	buffer_skip (reader->buffer, 1);
+	reader->current = number_reader_get (reader->buffer);
+	return true;
+}
+
+static bool
+number_reader_test (
+	struct number_reader *reader,
+	const char *set)
+{
+	if (reader->current == set [0] || reader->current == set [1])
+	{
+		return number_reader_next (reader);
+	}
+
+	return false;
+}
+
+static int
+number_reader_digits (
+	struct number_reader *reader,
+	const bool hex)
+{
+	int count = 0;
+
+	while ((hex ? isxdigit (reader->current) : isdigit (reader->current))
+		&& number_reader_next (reader))
+	{
+		count++;
+	}
+
+	return count;
+}
+
+static bool
+buffer_read_number (
+	lua_State *L,
+	struct buffer *buffer)
+{
+	struct number_reader reader = { 0 };
+	reader.buffer = buffer;
+	reader.current = number_reader_get (buffer);
+
+	while (isspace (reader.current))
+	{
+		buffer_skip (buffer, 1);
+		reader.current = number_reader_get (buffer);
+	}
+
+	int count = 0;
+	bool hex = false;
+	number_reader_test (&reader, "-+");
+
+	if (number_reader_test (&reader, "00"))
+	{
+		if (number_reader_test (&reader, "xX"))
+		{
+			hex = true;
+		}
+		else
+		{
+			count = 1;
+		}
+	}
+
+	count += number_reader_digits (&reader, hex);
+
+	if (number_reader_test (&reader, ".."))
+	{
+		count += number_reader_digits (&reader, hex);
+	}
+
+	if (count > 0 && number_reader_test (&reader, hex ? "pP" : "eE"))
+	{
+		number_reader_test (&reader, "-+");
+		number_reader_digits (&reader, false);
+	}
+
+	reader.text [reader.count] = '\0';
+
+	if (lua_stringtonumber (L, reader.text))
+	{
+		return true;
+	}
+
+	lua_pushnil (L);
+	return false;
+}
+
+static int
+buffer_read_helper (
+	lua_State *L,
+	struct buffer *buffer,
+	const int first)
+{
+	const int formats = lua_gettop (L) - first + 1;
+	bool success = true;
+	int index = first;
+
+	if (formats <= 0)
+	{
+		success = buffer_read_line (L, buffer, true);
+		index = first + 1;
+	}
+	else
+	{
+		luaL_checkstack (L, formats + LUA_MINSTACK, "too many arguments");
+
+		for (; index < first + formats && success; index++)
+		{
+			if (lua_type (L, index) == LUA_TNUMBER)
+			{
+				const size_t count = (size_t) luaL_checkinteger (L, index);
+				success = count == 0
+					? buffer_test_eof (L, buffer)
+					: buffer_read_chars (L, buffer, count);
+				continue;
+			}
+
+			const char *format = luaL_checkstring (L, index);
+
+			if (*format == '*')
+			{
+				format++;
+			}
+
+			switch (*format)
+			{
+				case 'n':
+				{
+					success = buffer_read_number (L, buffer);
+					break;
+				}
+
+				case 'l':
+				{
+					success = buffer_read_line (L, buffer, true);
+					break;
+				}
+
+				case 'L':
+				{
+					success = buffer_read_line (L, buffer, false);
+					break;
+				}
+
+				case 'a':
+				{
+					buffer_read_all (L, buffer);
+					break;
+				}
+
+				default:
+				{
+					return luaL_argerror (L, index, "invalid format");
+				}
+			}
+		}
+	}
+
+	if (buffer->failed)
+	{
+		buffer->failed = false;
+		return to_error (L);
+	}
+
+	if (!success)
+	{
+		lua_pop (L, 1);
+		lua_pushnil (L);
+	}
+
+	return index - first;
+}
+
+/**
+ * `buffer:read (...)`
+ */
+static int
+buffer_read (
+	lua_State *L)
+{
+	struct buffer *buffer = to_buffer (L, 1);
+	return buffer_read_helper (L, buffer, 2);
+}
+
+static int
+buffer_lines_iterator (
+	lua_State *L)
+{
+	struct buffer *buffer = lua_touserdata (L, lua_upvalueindex (1));
+	const int formats = (int) lua_tointeger (L, lua_upvalueindex (2));
+
+	if (buffer->closed || (buffer->file && is_closed (buffer->file)))
+	{
+		return luaL_error (L, "file is already closed");
+	}
+
+	lua_settop (L, 0);
+	luaL_checkstack (L, formats, "too many arguments");
+
+	for (int i = 1; i <= formats; i++)
+	{
+		lua_pushvalue (L, lua_upvalueindex (2 + i));
+	}
+
+	return buffer_read_helper (L, buffer, 1);
+}
+
+/*
+ * Expects the value at index 1 to be a userdata that begins with a `struct
+ * buffer`.
+ */
+static int
+buffer_lines_helper (
+	lua_State *L)
+{
+	const int formats = lua_gettop (L) - 1;
+	luaL_argcheck (L, formats <= 250, 252, "too many arguments");
+
+	lua_pushvalue (L, 1);
+	lua_pushinteger (L, formats);
+	lua_insert (L, 2);
+	lua_insert (L, 2);
+	lua_pushcclosure (L, buffer_lines_iterator, formats + 2);
+	return 1;
+}
+
+/**
+ * `buffer:lines (...)`
+ */
+static int
+buffer_lines (
+	lua_State *L)
+{
+	to_buffer (L, 1);
+	return buffer_lines_helper (L);
+}
+
+static int
+buffer_write_helper (
+	lua_State *L,
+	struct buffer *buffer)
+{
+	const int count = lua_gettop (L);
+
+	for (int i = 2; i <= count; i++)
+	{
+		size_t size;
+		const char *bytes = luaL_checklstring (L, i, &size);
+
+		if (!buffer_write (buffer, bytes, size))
+		{
+			return to_error (L);
+		}
+	}
+
+	lua_settop (L, 1);
+	return 1;
+}
+
+/**
+ * `buffer:write (...)`
+ */
+static int
+buffer_write_many (
+	lua_State *L)
+{
+	struct buffer *buffer = to_buffer (L, 1);
+	return buffer_write_helper (L, buffer);
+}
+
+static int
+buffer_seek_helper (
+	lua_State *L,
+	struct buffer *buffer)
+{
+	static const char *const options [] = { "set", "cur", "end", NULL };
+
+	const int whence = luaL_checkoption (L, 2, "cur", options);
+	const lua_Integer offset = luaL_optinteger (L, 3, 0);
+	lua_Integer base = 0;
+
+	switch (whence)
+	{
+		case 1:
+		{
+			base = (lua_Integer) buffer->position;
+			break;
+		}
+
+		case 2:
+		{
+			base = (lua_Integer) buffer->size;
+			break;
+		}
+	}
+
+	if (offset < -base)
+	{
+		SetLastError (ERROR_INVALID_PARAMETER);
+		return to_error (L);
+	}
+
+	buffer->position = (size_t) (base + offset);
+	lua_pushinteger (L, (lua_Integer) buffer->position);
+	return 1;
+}
+
+/**
+ * `buffer:seek ([whence [, offset]])`
+ */
+static int
+buffer_seek (
+	lua_State *L)
+{
+	struct buffer *buffer = to_buffer (L, 1);
+	return buffer_seek_helper (L, buffer);
+}
+
+/**
+ * `buffer:flush ()`
+ */
+static int
+buffer_flush (
+	lua_State *L)
+{
+	to_buffer (L, 1);
+	lua_pushboolean (L, true);
+	return 1;
+}
+
+/**
+ * `buffer:setvbuf (mode [, size])`
+ *
+ * Accepted for compatibility with the Lua I/O library.  It does nothing.
+ */
+static int
+buffer_setvbuf (
+	lua_State *L)
+{
+	static const char *const modes [] = { "no", "full", "line", NULL };
+
+	to_buffer (L, 1);
+	luaL_checkoption (L, 2, NULL, modes);
+	lua_pushboolean (L, true);
+	return 1;
+}
+
+/**
+ * `buffer:close ()`
+ */
+static int
+buffer_close (
+	lua_State *L)
+{
+	struct buffer *buffer = to_buffer (L, 1);
+
+	return to_result (
+		L, buffer_free (L, buffer));
+}
+
+static int
+buffer_length (
+	lua_State *L)
+{
+	const struct buffer *buffer = to_buffer (L, 1);
+	lua_pushinteger (L, (lua_Integer) buffer->size);
+	return 1;
+}
+
+/*
+ * Converts the Lua string indices `first` and `last` (i.e. one-based, with
+ * negative indices counting from the end) into a range, in the same manner
+ * as `string.sub ()`.
+ */
+static void
+buffer_span (
+	const struct buffer *buffer,
+	lua_Integer first,
+	lua_Integer last,
+	size_t *offset,
+	size_t *count)
+{
+	const lua_Integer size = (lua_Integer) buffer->size;
+
+	if (first < 0)
+	{
+		first = -first > size ? 0 : size + first + 1;
+	}
+
+	if (last < 0)
+	{
+		last = -last > size ? 0 : size + last + 1;
+	}
+
+	first = first < 1 ? 1 : first;
+	last = last > size ? size : last;
+
+	*offset = (size_t) first - 1;
+	*count = first <= last ? (size_t) (last - first + 1) : 0;
+}
+
+/*
+ * Pushes `count` bytes, starting at `offset`, as a string.  The position
+ * of the buffer is left untouched.
+ */
+static bool
+buffer_range (
+	lua_State *L,
+	struct buffer *buffer,
+	const size_t offset,
+	const size_t count)
+{
+	const size_t position = buffer->position;
+
+	if (!buffer->windows)
+	{
+		lua_pushlstring (L, buffer->data + offset, count);
+		return true;
+	}
+
+	buffer->position = offset;
+	buffer_read_chars (L, buffer, count);
+	buffer->position = position;
+
+	if (buffer->failed)
+	{
+		buffer->failed = false;
+		lua_pop (L, 1);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * `buffer:sub ([i [, j]])`
+ *
+ * Behaves as `string.sub ()`, without moving the position of the buffer.
+ */
+static int
+buffer_sub (
+	lua_State *L)
+{
+	struct buffer *buffer = to_buffer (L, 1);
+	size_t offset;
+	size_t count;
+
+	buffer_span (buffer, luaL_optinteger (L, 2, 1),
+		luaL_optinteger (L, 3, -1), &offset, &count);
+
+	if (!buffer_range (L, buffer, offset, count))
+	{
+		return to_error (L);
+	}
+
+	return 1;
+}
+
+/**
+ * `buffer:byte ([i [, j]])`
+ *
+ * Behaves as `string.byte ()`, without moving the position of the buffer.
+ */
+static int
+buffer_byte (
+	lua_State *L)
+{
+	struct buffer *buffer = to_buffer (L, 1);
+	const lua_Integer first = luaL_optinteger (L, 2, 1);
+	size_t offset;
+	size_t count;
+
+	buffer_span (buffer, first,
+		luaL_optinteger (L, 3, first), &offset, &count);
+
+	if (count >= INT_MAX)
+	{
+		return luaL_error (L, "string slice too long");
+	}
+
+	luaL_checkstack (L, (int) count + 1, "string slice too long");
+
+	if (!buffer_range (L, buffer, offset, count))
+	{
+		return to_error (L);
+	}
+
+	const unsigned char *bytes = (const unsigned char *) lua_tostring (
+		L, -1);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		lua_pushinteger (L, bytes [i]);
+	}
+
+	lua_remove (L, -(int) count - 1);
+	return (int) count;
+}
+
+/**
+ * `buffer:find (text [, init])`
+ *
+ * Behaves as `string.find ()` with `plain` set, without moving the
+ * position of the buffer.  The contents must be in memory.
+ */
+static int
+buffer_find (
+	lua_State *L)
+{
+	const struct buffer *buffer = to_buffer (L, 1);
+	size_t length;
+	const char *text = luaL_checklstring (L, 2, &length);
+	size_t offset;
+	size_t count;
+
+	if (buffer->windows)
+	{
+		SetLastError (ERROR_NOT_SUPPORTED);
+		return to_error (L);
+	}
+
+	const lua_Integer init = luaL_optinteger (L, 3, 1);
+
+	if (init > (lua_Integer) buffer->size + 1)
+	{
+		lua_pushnil (L);
+		return 1;
+	}
+
+	buffer_span (buffer, init, -1, &offset, &count);
+
+	const char *start = buffer->data + offset;
+	const char *end = start + count;
+
+	while (length <= (size_t) (end - start))
+	{
+		if (length == 0 || memcmp (start, text, length) == 0)
+		{
+			offset = (size_t) (start - buffer->data);
+			lua_pushinteger (L, (lua_Integer) offset + 1);
+			lua_pushinteger (L, (lua_Integer) (offset + length));
+			return 2;
+		}
+
+		start = memchr (start + 1, *text, (size_t) (end - start) - 1);
+
+		if (start == NULL)
+		{
+			break;
+		}
+	}
+
+	lua_pushnil (L);
+	return 1;
+}
+
+/**
+ * `buffer:tostring ()`
+ *
+ * Returns the contents as a string, without moving the position of the
+ * buffer.
+ */
+static int
+buffer_contents (
+	lua_State *L)
+{
+	struct buffer *buffer = to_buffer (L, 1);
+
+	if (!buffer_range (L, buffer, 0, buffer->size))
+	{
+		return to_error (L);
+	}
+
+	return 1;
+}
+
+/**
+ * `buffer:pointer ()`
+ *
+ * Returns a light userdata pointing at the contents, and their size (e.g.
+ * for `ffi.cast ()` under LuaJIT).  The contents must be in memory.  The
+ * pointer is only valid until the buffer is next written, filled, or
+ * closed.
+ */
+static int
+buffer_pointer (
+	lua_State *L)
+{
+	const struct buffer *buffer = to_buffer (L, 1);
+
+	if (buffer->windows)
+	{
+		SetLastError (ERROR_NOT_SUPPORTED);
+		return to_error (L);
+	}
+
+	lua_pushlightuserdata (L, buffer->data);
+	lua_pushinteger (L, (lua_Integer) buffer->size);
+	return 2;
+}
+
+static int
+buffer_garbage_collect (
+	lua_State *L)
+{
+	struct buffer *buffer = luaL_checkudata (
+		L, 1, STORMLIB_BUFFER_METATABLE);
+
+	if (!buffer->closed)
+	{
+		buffer_free (L, buffer);
+	}
+
+	return 0;
+}
+
+static int
+buffer_to_string (
+	lua_State *L)
+{
+	const struct buffer *buffer = luaL_checkudata (
+		L, 1, STORMLIB_BUFFER_METATABLE);
+	const char *text = !buffer->closed ? "%s (%p)" : "%s (Closed)";
+	lua_pushfstring (L, text, STORMLIB_BUFFER_METATABLE, buffer);
+	return 1;
+}
+
+static const luaL_Reg
+buffer_methods [] =
+{
+	{ "__gc", buffer_garbage_collect },
+	{ "__len", buffer_length },
+	{ "__tostring", buffer_to_string },
+	{ "byte", buffer_byte },
+	{ "close", buffer_close },
+	{ "find", buffer_find },
+	{ "flush", buffer_flush },
+	{ "lines", buffer_lines },
+	{ "pointer", buffer_pointer },
+	{ "read", buffer_read },
+	{ "seek", buffer_seek },
+	{ "setvbuf", buffer_setvbuf },
+	{ "sub", buffer_sub },
+	{ "tostring", buffer_contents },
+	{ "write", buffer_write_many },
+	{ NULL, NULL }
+};
+
+static struct buffer *
+buffer_initialize (
+	lua_State *L)
+{
+	struct buffer *buffer = lua_newuserdata (L, sizeof (*buffer));
+	memset (buffer, 0, sizeof (*buffer));
+
+	if (luaL_newmetatable (L, STORMLIB_BUFFER_METATABLE))
+	{
+		luaL_setfuncs (L, buffer_methods, 0);
+		lua_pushvalue (L, -1);
+		lua_setfield (L, -2, "__index");
+	}
+
+	lua_setmetatable (L, -2);
+	return buffer;
+}
+
+/**
+ * `SBufferCreate ([contents [, limit]])`
+ *
+ * Creates an in-memory file, which supports the same methods as a file
+ * handle from the Lua I/O library.  The buffer is moved to a temporary file
+ * once its size exceeds `limit` bytes.
+ */
+static int
+buffer_new (
+	lua_State *L)
+{
+	size_t size = 0;
+	const char *contents = luaL_optlstring (L, 1, NULL, &size);
+	const lua_Integer limit = luaL_optinteger (
+		L, 2, STORMLIB_BUFFER_LIMIT);
+	luaL_argcheck (L, limit >= 0, 2, "limit must be non-negative");
+
+	struct buffer *buffer = buffer_initialize (L);
+	buffer->limit = (size_t) limit;
+
+	if (contents && !buffer_write (buffer, contents, size))
+	{
+		buffer_free (L, buffer);
+		return to_error (L);
+	}
+
+	buffer->position = 0;
+	return 1;
+}
+
+/*
+ * Prepares `buffer` to stream the file `name` from `archive`.  The StormLib
+ * file handle is anchored in the registry, keyed by the buffer.  On
+ * failure, the buffer must still be freed.
+ */
+static bool
+buffer_stream (
+	lua_State *L,
+	struct buffer *buffer,
+	HANDLE archive,
+	const char *name,
+	const DWORD scope,
+	const size_t count)
+{
+	DWORD width = 0;
+	HANDLE reader = NULL;
+
+	if (!SFileGetFileInfo (
+			archive, SFileMpqSectorSize, &width, sizeof (width), NULL)
+		|| !SFileOpenFileEx (archive, name, scope, &reader))
+	{
+		return false;
+	}
+
+	object_initialize (L, reader, SFileCloseFile, archive);
+	buffer->file = to_object (L, -1);
+	buffer->size = SFileGetFileSize (reader, NULL);
+	lua_rawsetp (L, LUA_REGISTRYINDEX, buffer);
+
+	return buffer->size != SFILE_INVALID_SIZE
+		&& buffer_windows (buffer, count,
+			width > 0 ? width : STORMLIB_BUFFER_WINDOW);
+}
+
+/**
+ * `SBufferOpenFile (archive, name, scope [, count])`
+ *
+ * Opens a file for reading, in the same manner as `SFileOpenFileEx`.
+ * Unlike `SBufferCreate`, the contents are not loaded up front.  Only the
+ * sectors that are touched get read (and decompressed), with up to `count`
+ * of them cached.  The resulting buffer is read-only.
+ */
+static int
+buffer_open (
+	lua_State *L)
+{
+	HANDLE archive = to_archive (L);
+	const char *name = luaL_checkstring (L, 2);
+	const DWORD scope = luaL_checkinteger (L, 3);
+	const lua_Integer count = luaL_optinteger (
+		L, 4, STORMLIB_BUFFER_SECTORS);
+	luaL_argcheck (L, count > 0, 4, "count must be positive");
+	lua_settop (L, 4);
+
+	struct buffer *buffer = buffer_initialize (L);
+
+	if (!buffer_stream (L, buffer, archive, name, scope, (size_t) count))
+	{
+		const DWORD error = GetLastError ();
+		buffer_free (L, buffer);
+		SetLastError (error);
+		return to_error (L);
+	}
+
+	return 1;
+}
+
+#if defined (_WIN32)
+/**
+ * `SFileOpenArchiveFromMemory (data, flags)`
+ *
+ * Not supported on Windows.
+ */
+static int
+archive_open_memory (
+	lua_State *L)
+{
+	SetLastError (ERROR_NOT_SUPPORTED);
+	return to_error (L);
+}
+#else
+/*
+ * StormLib only opens archives by path.  To open one held in memory, its
+ * contents are written to an anonymous file, which is then given to
+ * StormLib by path.  On Linux, the file lives purely in memory, and is
+ * reached through `/proc`.  Elsewhere (or on kernels lacking
+ * `memfd_create ()`), it is a temporary file that is unlinked once
+ * opened.
+ */
+struct memory_file
+{
+	int descriptor;
+	bool linked;
+	char path [4096];
+};
+
+static bool
+memory_open (
+	struct memory_file *file)
+{
+#if defined (__linux__)
+	file->descriptor = memfd_create ("stormlib", MFD_CLOEXEC);
+
+	if (file->descriptor != -1)
+	{
+		snprintf (file->path, sizeof (file->path),
+			"/proc/self/fd/%d", file->descriptor);
+		file->linked = false;
+		return true;
+	}
+#endif
+
+	const char *directory = getenv ("TMPDIR");
+
+	if (directory == NULL || *directory == '\0')
+	{
+		directory = "/tmp";
+	}
+
+	const int length = snprintf (file->path, sizeof (file->path),
+		"%s/stormlib-XXXXXX", directory);
+
+	if (length < 0 || (size_t) length >= sizeof (file->path))
+	{
+		SetLastError (ENAMETOOLONG);
+		return false;
+	}
+
+	file->descriptor = mkstemp (file->path);
+
+	if (file->descriptor == -1)
+	{
+		SetLastError (errno);
+		return false;
+	}
+
+	file->linked = true;
+	return true;
+}
+
+static bool
+memory_write (
+	struct memory_file *file,
+	const char *data,
+	size_t size)
+{
+	while (size > 0)
+	{
+		const ssize_t written = write (file->descriptor, data, size);
+
+		if (written == -1 && errno != EINTR)
+		{
+			SetLastError (errno);
+			return false;
+		}
+
+		if (written > 0)
+		{
+			data = data + written;
+			size = size - (size_t) written;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Writes the whole of `buffer`, whatever its kind, leaving its position
+ * untouched.
+ */
+static bool
+memory_write_buffer (
+	struct memory_file *file,
+	struct buffer *buffer)
+{
+	const size_t position = buffer->position;
+	const char *data = NULL;
+	size_t available = 0;
+	bool status = true;
+
+	buffer->position = 0;
+
+	while (status && (data = buffer_peek (buffer, &available)) != NULL)
+	{
+		status = memory_write (file, data, available);
+		buffer_skip (buffer, available);
+	}
+
+	status = status && buffer->position >= buffer->size;
+	buffer->position = position;
+	return status;
+}
+
+/*
+ * Once StormLib has opened the file, our descriptor (and name) are no
+ * longer needed.  The contents are released when StormLib closes it.
+ */
+static void
+memory_close (
+	struct memory_file *file)
+{
+	close (file->descriptor);
+
+	if (file->linked)
+	{
+		unlink (file->path);
+	}
+}
+
+/**
+ * `SFileOpenArchiveFromMemory (data, flags)`
+ *
+ * Opens an archive held in `data`, which is either a string or a buffer
+ * (e.g. from `SBufferCreate`), in the same manner as `SFileOpenArchive`.
+ * The contents are copied, such that `data` can be discarded.  Changes
+ * made to the archive are lost once it is closed.
+ */
+static int
+archive_open_memory (
+	lua_State *L)
+{
+	struct buffer *buffer = lua_type (L, 1) == LUA_TSTRING
+		? NULL
+		: to_buffer (L, 1);
+	const DWORD flags = luaL_checkinteger (L, 2);
+	struct memory_file file;
+	HANDLE archive = NULL;
+	bool status = false;
+
+	if (!memory_open (&file))
+	{
+		return to_error (L);
+	}
+
+	if (buffer)
+	{
+		status = memory_write_buffer (&file, buffer);
+	}
+	else
+	{
+		size_t size = 0;
+		const char *data = lua_tolstring (L, 1, &size);
+		status = memory_write (&file, data, size);
+	}
+
+	status = status && SFileOpenArchive (file.path, 0, flags, &archive);
+
+	const DWORD error = GetLastError ();
+	memory_close (&file);
+
+	if (!status)
+	{
+		SetLastError (error);
+		return to_error (L);
+	}
+
+	return object_initialize (L, archive, SFileCloseArchive, NULL);
+}
+#endif
+
+/*
+ * Columns produced by `SFileListAll ()`.  These match the fields of
+ * `SFILE_FIND_DATA`, and are kept in the same order as `list_push ()`.
+ */
+static const char *const
+list_columns [] =
+{
+	"cFileName",
+	"szPlainName",
+	"dwHashIndex",
+	"dwBlockIndex",
+	"dwFileSize",
+	"dwFileFlags",
+	"dwCompSize",
+	"dwFileTimeLo",
+	"dwFileTimeHi",
+	"lcLocale",
+	NULL
+};
+
+#define STORMLIB_LIST_COLUMNS \
+	(sizeof (list_columns) / sizeof (*list_columns) - 1)
+
+/*
+ * Appends `data` as row `row` of the columns starting at index `first`.
+ */
+static void
+list_push (
+	lua_State *L,
+	const int first,
+	const int row,
+	const SFILE_FIND_DATA *data)
+{
+	lua_pushstring (L, data->cFileName);
+	lua_rawseti (L, first, row);
+	lua_pushstring (L, data->szPlainName);
+	lua_rawseti (L, first + 1, row);
+	lua_pushinteger (L, data->dwHashIndex);
+	lua_rawseti (L, first + 2, row);
+	lua_pushinteger (L, data->dwBlockIndex);
+	lua_rawseti (L, first + 3, row);
+	lua_pushinteger (L, data->dwFileSize);
+	lua_rawseti (L, first + 4, row);
+	lua_pushinteger (L, data->dwFileFlags);
+	lua_rawseti (L, first + 5, row);
+	lua_pushinteger (L, data->dwCompSize);
+	lua_rawseti (L, first + 6, row);
+	lua_pushinteger (L, data->dwFileTimeLo);
+	lua_rawseti (L, first + 7, row);
+	lua_pushinteger (L, data->dwFileTimeHi);
+	lua_rawseti (L, first + 8, row);
+	lua_pushinteger (L, data->lcLocale);
+	lua_rawseti (L, first + 9, row);
+}
+
+/**
+ * `SFileListAll (archive [, mask [, listfile]])`
+ *
+ * Enumerates the archive in a single call, rather than one entry at a time
+ * with `SFileFindNextFile`.  Returns a table with the same fields as the
+ * data of `SFileFindFirstFile`, except that each field is an array indexed
+ * by entry.  The mask defaults to `'*'`.  Finding no files is not an error.
+ */
+static int
+archive_list_all (
+	lua_State *L)
+{
+	HANDLE archive = to_archive (L);
+	const char *mask = luaL_optstring (L, 2, "*");
+	const char *listfile = luaL_optstring (L, 3, NULL);
+	lua_settop (L, 3);
+
+	/* The number of files is only a hint to size the columns. */
+	DWORD hint = 0;
+	SFileGetFileInfo (archive, SFileMpqNumberOfFiles,
+		&hint, sizeof (hint), NULL);
+
+	luaL_checkstack (L, STORMLIB_LIST_COLUMNS + 2, "too many columns");
+	const int first = lua_gettop (L) + 1;
+
+	for (size_t i = 0; i < STORMLIB_LIST_COLUMNS; i++)
+	{
+		lua_createtable (L, (int) (hint < INT_MAX ? hint : 0), 0);
+	}
+
+	SFILE_FIND_DATA data;
+	HANDLE finder = SFileFindFirstFile (archive, mask, &data, listfile);
+	DWORD error = ERROR_NO_MORE_FILES;
+
+	if (finder == NULL)
+	{
+		error = GetLastError ();
+	}
+	else
+	{
+		int row = 0;
+
+		do
+		{
+			list_push (L, first, ++row, &data);
+		}
+		while (SFileFindNextFile (finder, &data));
+
+		error = GetLastError ();
+		SFileFindClose (finder);
+	}
+
+	if (error != ERROR_NO_MORE_FILES)
+	{
+		SetLastError (error);
+		return to_error (L);
+	}
+
+	lua_createtable (L, 0, STORMLIB_LIST_COLUMNS);
+
+	for (size_t i = 0; i < STORMLIB_LIST_COLUMNS; i++)
+	{
+		lua_pushvalue (L, first + (int) i);
+		lua_setfield (L, -2, list_columns [i]);
+	}
+
+	return 1;
+}
+
+/**
+ * `SFileListAttributes (archive [, mask])`
+ *
+ * Lists the attributes held for every matching file, as loaded from the
+ * `(attributes)` file, without reading any contents.  Returns a table of
+ * arrays, as with `SFileListAll ()`: `cFileName`, `dwCrc32`, `md5` (a
+ * string of 16 bytes), and `FileTime`.  Attributes that the archive does
+ * not hold (see `SFileGetAttributes ()`) are zero.
+ */
+static int
+archive_list_attributes (
+	lua_State *L)
+{
+	HANDLE archive = to_archive (L);
+	const char *mask = luaL_optstring (L, 2, "*");
+	const TMPQArchive *mpq = archive;
+	lua_settop (L, 2);
+
+	const int first = lua_gettop (L) + 1;
+
+	for (int i = 0; i < 4; i++)
+	{
+		lua_newtable (L);
+	}
+
+	SFILE_FIND_DATA data;
+	HANDLE finder = SFileFindFirstFile (archive, mask, &data, NULL);
+	DWORD error = ERROR_NO_MORE_FILES;
+
+	if (finder == NULL)
+	{
+		error = GetLastError ();
+	}
+	else
+	{
+		int row = 0;
+
+		do
+		{
+			if (data.dwBlockIndex >= mpq->dwFileTableSize)
+			{
+				continue;
+			}
+
+			const TFileEntry *entry = &mpq->pFileTable [data.dwBlockIndex];
+			row++;
+
+			lua_pushstring (L, data.cFileName);
+			lua_rawseti (L, first, row);
+			lua_pushinteger (L, entry->dwCrc32);
+			lua_rawseti (L, first + 1, row);
+			lua_pushlstring (L, (const char *) entry->md5, MD5_DIGEST_SIZE);
+			lua_rawseti (L, first + 2, row);
+			lua_pushinteger (L, (lua_Integer) entry->FileTime);
+			lua_rawseti (L, first + 3, row);
+		}
+		while (SFileFindNextFile (finder, &data));
+
+		error = GetLastError ();
+		SFileFindClose (finder);
+	}
+
+	if (error != ERROR_NO_MORE_FILES)
+	{
+		SetLastError (error);
+		return to_error (L);
+	}
+
+	lua_createtable (L, 0, 4);
+	lua_pushvalue (L, first);
+	lua_setfield (L, -2, "cFileName");
+	lua_pushvalue (L, first + 1);
+	lua_setfield (L, -2, "dwCrc32");
+	lua_pushvalue (L, first + 2);
+	lua_setfield (L, -2, "md5");
+	lua_pushvalue (L, first + 3);
+	lua_setfield (L, -2, "FileTime");
+	return 1;
+}
+
+/*
+ * Reads each file named in the array at `index` into a new table, such
+ * that the contents share the index of the name.  Files that do not exist
+ * are left as `nil`.  On any other error, `false` is returned and the
+ * stack is left as is.
+ */
+static bool
+read_many (
+	lua_State *L,
+	HANDLE archive,
+	const int index,
+	const DWORD scope)
+{
+	const lua_Integer count = luaL_len (L, index);
+	lua_createtable (L, (int) (count < INT_MAX ? count : 0), 0);
+
+	for (lua_Integer i = 1; i <= count; i++)
+	{
+		lua_rawgeti (L, index, i);
+		const char *name = lua_tostring (L, -1);
+
+		if (name == NULL)
+		{
+			luaL_argerror (L, index, lua_pushfstring (
+				L, "string expected at index %d", (int) i));
+		}
+
+		HANDLE reader = NULL;
+
+		if (!SFileOpenFileEx (archive, name, scope, &reader))
+		{
+			if (GetLastError () != ERROR_FILE_NOT_FOUND)
+			{
+				return false;
+			}
+
+			lua_pop (L, 1);
+			continue;
+		}
+
+		const DWORD size = SFileGetFileSize (reader, NULL);
+		DWORD read = 0;
+
+		if (size == SFILE_INVALID_SIZE)
+		{
+			const DWORD error = GetLastError ();
+			SFileCloseFile (reader);
+			SetLastError (error);
+			return false;
+		}
+
+		luaL_Buffer buffer;
+		char *bytes = luaL_buffinitsize (L, &buffer, size);
+
+		if (!SFileReadFile (reader, bytes, size, &read, NULL)
+			&& GetLastError () != ERROR_HANDLE_EOF)
+		{
+			const DWORD error = GetLastError ();
+			SFileCloseFile (reader);
+			SetLastError (error);
+			return false;
+		}
+
+		SFileCloseFile (reader);
+		luaL_pushresultsize (&buffer, read);
+		lua_rawseti (L, -3, i);
+		lua_pop (L, 1);
+	}
+
+	return true;
+}
+
+/**
+ * `SFileReadMany (archive, names [, scope])`
+ *
+ * Reads the contents of every file in the array `names`, returning them in
+ * a table with matching indices.  Missing files are `nil`, rather than an
+ * error.  The scope defaults to `SFILE_OPEN_FROM_MPQ`.
+ */
+static int
+archive_read_many (
+	lua_State *L)
+{
+	HANDLE archive = to_archive (L);
+	luaL_checktype (L, 2, LUA_TTABLE);
+	const DWORD scope = (DWORD) luaL_optinteger (
+		L, 3, SFILE_OPEN_FROM_MPQ);
+	lua_settop (L, 3);
+
+	if (!read_many (L, archive, 2, scope))
+	{
+		return to_error (L);
+	}
+
+	return 1;
+}
+
+/*
+ * Compresses (or decompresses) each string (or buffer) in the array at
+ * index 1, producing an array of the results with matching indices.  When
+ * decompressing, the output sizes are taken from the array at index 2.
+ * Every entry is checked before any work is done.
+ */
+static bool
+comp_many (
+	lua_State *L,
+	const enum comp_mode mode,
+	const int compression,
+	const int level)
+{
+	const lua_Integer count = luaL_len (L, 1);
+
+	for (lua_Integer i = 1; i <= count; i++)
+	{
+		size_t size = 0;
+		lua_rawgeti (L, 1, i);
+
+		if (test_bytes (L, -1, &size) == NULL || size > INT_MAX)
+		{
+			luaL_error (L, "bad entry #%d in inputs "
+				"(string or buffer of at most %d bytes expected)",
+				(int) i, INT_MAX);
+		}
+
+		if (mode != COMP_COMPRESS)
+		{
+			lua_rawgeti (L, 2, i);
+
+			if (lua_type (L, -1) != LUA_TNUMBER
+				|| lua_tointeger (L, -1) < 0
+				|| lua_tointeger (L, -1) > INT_MAX)
+			{
+				luaL_error (L, "bad entry #%d in sizes", (int) i);
+			}
+
+			lua_pop (L, 1);
+		}
+
+		lua_pop (L, 1);
+	}
+
+	lua_createtable (L, (int) (count < INT_MAX ? count : 0), 0);
+	const int results = lua_gettop (L);
+	struct scratch *scratch = to_scratch (L);
+	bool status = true;
+
+	for (lua_Integer i = 1; status && i <= count; i++)
+	{
+		size_t in_size = 0;
+		lua_rawgeti (L, 1, i);
+		const char *in = test_bytes (L, -1, &in_size);
+		int out_size = (int) in_size;
+
+		if (mode != COMP_COMPRESS)
+		{
+			lua_rawgeti (L, 2, i);
+			out_size = (int) lua_tointeger (L, -1);
+			lua_pop (L, 1);
+		}
+
+		status = comp_run (L, scratch, NULL, false, mode,
+			in, in_size, out_size, compression, level);
+
+		if (status)
+		{
+			lua_rawseti (L, results, i);
+		}
+
+		lua_pop (L, 1);
+	}
+
+	const DWORD error = GetLastError ();
+	scratch_release (scratch);
+	SetLastError (error);
+	return status;
+}
+
+/**
+ * `SCompCompressMany (inputs, compression [, level])`
+ *
+ * Compresses each string (or buffer) in the array `inputs`, in the same
+ * manner as `SCompCompress`.  Returns an array of the results, with
+ * matching indices.
+ */
+static int
+stormlib_compress_many (
+	lua_State *L)
+{
+	luaL_checktype (L, 1, LUA_TTABLE);
+	const int compression = (int) luaL_checkinteger (L, 2);
+	const int level = (int) luaL_optinteger (L, 3, 0);
+	lua_settop (L, 3);
+
+	if (!comp_many (L, COMP_COMPRESS, compression, level))
+	{
+		return to_error (L);
+	}
+
+	return 1;
+}
+
+/**
+ * `SCompDecompressMany (inputs, sizes)`
+ *
+ * Decompresses each string (or buffer) in the array `inputs`, in the same
+ * manner as `SCompDecompress`, with the output size taken from `sizes` at
+ * the same index.  Returns an array of the results, with matching indices.
+ */
+static int
+stormlib_decompress_many (
+	lua_State *L)
+{
+	luaL_checktype (L, 1, LUA_TTABLE);
+	luaL_checktype (L, 2, LUA_TTABLE);
+	lua_settop (L, 2);
+
+	if (!comp_many (L, COMP_DECOMPRESS, 0, 0))
+	{
+		return to_error (L);
+	}
+
+	return 1;
+}
+
+/*
+ * A minimal abstraction over threads and locks, providing only what the
+ * jobs below need.
+ */
+#if defined (_WIN32)
+typedef HANDLE thread_handle;
+typedef CRITICAL_SECTION thread_lock;
+#else
+typedef pthread_t thread_handle;
+typedef pthread_mutex_t thread_lock;
+#endif
+
+struct job_worker;
+
+static void
+job_main (
+	struct job_worker *worker);
+
+#if defined (_WIN32)
+static DWORD WINAPI
+thread_main (
+	LPVOID argument)
+{
+	job_main (argument);
+	return 0;
+}
+
+static bool
+thread_start (
+	thread_handle *thread,
+	struct job_worker *worker)
+{
+	*thread = CreateThread (NULL, 0, thread_main, worker, 0, NULL);
+	return *thread != NULL;
+}
+
+static void
+thread_join (
+	thread_handle thread)
+{
+	WaitForSingleObject (thread, INFINITE);
+	CloseHandle (thread);
+}
+
+static size_t
+thread_count (void)
+{
+	SYSTEM_INFO info;
+	GetSystemInfo (&info);
+	return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+}
+
+static void
+lock_initialize (
+	thread_lock *lock)
+{
+	InitializeCriticalSection (lock);
+}
+
+static void
+lock_destroy (
+	thread_lock *lock)
+{
+	DeleteCriticalSection (lock);
+}
+
+static void
+lock_acquire (
+	thread_lock *lock)
+{
+	EnterCriticalSection (lock);
+}
+
+static void
+lock_release (
+	thread_lock *lock)
+{
+	LeaveCriticalSection (lock);
+}
+#else
+static void *
+thread_main (
+	void *argument)
+{
+	job_main (argument);
+	return NULL;
+}
+
+static bool
+thread_start (
+	thread_handle *thread,
+	struct job_worker *worker)
+{
+	return pthread_create (thread, NULL, thread_main, worker) == 0;
+}
+
+static void
+thread_join (
+	thread_handle thread)
+{
+	pthread_join (thread, NULL);
+}
+
+static size_t
+thread_count (void)
+{
+	const long count = sysconf (_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (size_t) count : 1;
+}
+
+static void
+lock_initialize (
+	thread_lock *lock)
+{
+	pthread_mutex_init (lock, NULL);
+}
+
+static void
+lock_destroy (
+	thread_lock *lock)
+{
+	pthread_mutex_destroy (lock);
+}
+
+static void
+lock_acquire (
+	thread_lock *lock)
+{
+	pthread_mutex_lock (lock);
+}
+
+static void
+lock_release (
+	thread_lock *lock)
+{
+	pthread_mutex_unlock (lock);
+}
+#endif
+
+/*
+ * A job runs `total` items of work across a pool of worker threads.  Items
+ * are handed out in order, such that each worker sees increasing indices.
+ * Workers never touch the Lua state.  Progress is observed by polling.
+ */
+#define STORMLIB_JOB_METATABLE "StormLib Job"
+
+/*
+ * Each function returns an error code, or `ERROR_SUCCESS`.  Both `start`
+ * and `stop` are optional, and are called once per worker.  The optional
+ * `finish` is called once, by the last worker to stop, before the job is
+ * seen as finished.  The `free` function releases the context, after all
+ * workers have finished.
+ */
+struct job_type
+{
+	DWORD (*start) (struct job *job, size_t worker);
+	DWORD (*run) (struct job *job, size_t worker, size_t item);
+	void (*stop) (struct job *job, size_t worker);
+	DWORD (*finish) (struct job *job);
+	void (*free) (void *context);
+};
+
+struct job_worker
+{
+	struct job *job;
+	size_t index;
+	thread_handle thread;
+};
+
+struct job
+{
+	const struct job_type *type;
+	void *context;
+	struct job_worker *workers;
+	size_t count;
+	thread_lock lock;
+	size_t next;
+	size_t total;
+	size_t done;
+	size_t running;
+	size_t stopping;
+	ULONGLONG progress;
+	ULONGLONG extent;
+	struct object *object;
+	DWORD error;
+	bool cancelled;
+	bool joined;
+};
+
+/*
+ * Records the first error.  StormLib does not promise a per-thread error
+ * code, so a missing one is replaced with a generic error.
+ */
+static void
+job_fail (
+	struct job *job,
+	DWORD error)
+{
+	if (error == ERROR_SUCCESS)
+	{
+		error = ERROR_CAN_NOT_COMPLETE;
+	}
+
+	lock_acquire (&job->lock);
+
+	if (job->error == ERROR_SUCCESS)
+	{
+		job->error = error;
+	}
+
+	lock_release (&job->lock);
+}
+
+static bool
+job_next (
+	struct job *job,
+	size_t *item)
+{
+	lock_acquire (&job->lock);
+	const bool status = !job->cancelled
+		&& job->error == ERROR_SUCCESS
+		&& job->next < job->total;
+
+	if (status)
+	{
+		*item = job->next++;
+	}
+
+	lock_release (&job->lock);
+	return status;
+}
+
+static void
+job_main (
+	struct job_worker *worker)
+{
+	struct job *job = worker->job;
+	const struct job_type *type = job->type;
+	DWORD error = ERROR_SUCCESS;
+	size_t item = 0;
+
+	if (type->start)
+	{
+		error = type->start (job, worker->index);
+	}
+
+	while (error == ERROR_SUCCESS && job_next (job, &item))
+	{
+		error = type->run (job, worker->index, item);
+
+		if (error == ERROR_SUCCESS)
+		{
+			lock_acquire (&job->lock);
+			job->done++;
+			lock_release (&job->lock);
+		}
+	}
+
+	if (error != ERROR_SUCCESS)
+	{
+		job_fail (job, error);
+	}
+
+	if (type->stop)
+	{
+		type->stop (job, worker->index);
+	}
+
+	lock_acquire (&job->lock);
+	const bool last = --job->stopping == 0;
+	lock_release (&job->lock);
+
+	if (last && type->finish)
+	{
+		error = type->finish (job);
+
+		if (error != ERROR_SUCCESS)
+		{
+			job_fail (job, error);
+		}
+	}
+
+	lock_acquire (&job->lock);
+	job->running--;
+	lock_release (&job->lock);
+}
+
+/*
+ * Records progress for jobs that measure it in something other than items
+ * (e.g. bytes).  Once reported, it is what `job:poll ()` returns.
+ */
+static void
+job_progress (
+	struct job *job,
+	const ULONGLONG progress,
+	const ULONGLONG extent)
+{
+	lock_acquire (&job->lock);
+	job->progress = progress;
+	job->extent = extent;
+	lock_release (&job->lock);
+}
+
+static bool
+job_is_running (
+	struct job *job)
+{
+	lock_acquire (&job->lock);
+	const bool running = job->running > 0;
+	lock_release (&job->lock);
+	return running;
+}
+
+static void
+job_cancel (
+	struct job *job)
+{
+	lock_acquire (&job->lock);
+	job->cancelled = true;
+	lock_release (&job->lock);
+}
+
+/*
+ * Waits for all workers to finish, and then releases the context.
+ */
+static void
+job_join (
+	struct job *job)
+{
+	if (job->joined)
+	{
+		return;
+	}
+
+	for (size_t i = 0; i < job->count; i++)
+	{
+		thread_join (job->workers [i].thread);
+	}
+
+	if (job->type->free)
+	{
+		job->type->free (job->context);
+	}
+
+	free (job->workers);
+	job->workers = NULL;
+	job->context = NULL;
+	job->joined = true;
+
+	/* Another job may have taken the object since. */
+	if (job->object && job->object->job == job)
+	{
+		job->object->job = NULL;
+	}
+}
+
+static struct job *
+to_job (
+	lua_State *L,
+	const int index)
+{
+	return luaL_checkudata (L, index, STORMLIB_JOB_METATABLE);
+}
+
+/**
+ * `job:poll ()`
+ *
+ * Returns the number of items done, the total number of items, and whether
+ * the job has finished.  Jobs that report their own progress (e.g. in
+ * bytes) return that instead.
+ */
+static int
+job_poll (
+	lua_State *L)
+{
+	struct job *job = to_job (L, 1);
+
+	lock_acquire (&job->lock);
+	const bool measured = job->extent > 0;
+	const ULONGLONG done = measured ? job->progress : job->done;
+	const ULONGLONG total = measured ? job->extent : job->total;
+	const size_t running = job->running;
+	lock_release (&job->lock);
+
+	lua_pushinteger (L, (lua_Integer) done);
+	lua_pushinteger (L, (lua_Integer) total);
+	lua_pushboolean (L, running == 0);
+	return 3;
+}
+
+/**
+ * `job:wait ()`
+ *
+ * Blocks until the job has finished.  A cancelled job is an error.
+ */
+static int
+job_wait (
+	lua_State *L)
+{
+	struct job *job = to_job (L, 1);
+	job_join (job);
+
+	if (job->error != ERROR_SUCCESS)
+	{
+		SetLastError (job->error);
+		return to_error (L);
+	}
+
+	if (job->cancelled && job->done < job->total)
+	{
+		SetLastError (ERROR_CAN_NOT_COMPLETE);
+		return to_error (L);
+	}
+
+	return to_result (L, true);
+}
+
+/**
+ * `job:cancel ()`
+ *
+ * Requests that the job stop.  Items in progress are allowed to finish.
+ */
+static int
+job_cancel_request (
+	lua_State *L)
+{
+	struct job *job = to_job (L, 1);
+	job_cancel (job);
+	return to_result (L, true);
+}
+
+static int
+job_garbage_collect (
+	lua_State *L)
+{
+	struct job *job = to_job (L, 1);
+
+	if (job->type)
+	{
+		job_cancel (job);
+		job_join (job);
+		lock_destroy (&job->lock);
+		job->type = NULL;
+	}
+
+	/* Anything the job kept alive for its workers. */
+	lua_pushnil (L);
+	lua_rawsetp (L, LUA_REGISTRYINDEX, job);
+
+	return 0;
+}
+
+static int
+job_to_string (
+	lua_State *L)
+{
+	const struct job *job = to_job (L, 1);
+	lua_pushfstring (L, "%s (%p)", STORMLIB_JOB_METATABLE, job);
+	return 1;
+}
+
+static const luaL_Reg
+job_methods [] =
+{
+	{ "__gc", job_garbage_collect },
+	{ "__tostring", job_to_string },
+	{ "cancel", job_cancel_request },
+	{ "poll", job_poll },
+	{ "wait", job_wait },
+	{ NULL, NULL }
+};
+
+/*
+ * Pushes a job that has yet to be started.  From here on, the job owns
+ * `context`, and it is released by `job_join ()` (or garbage collection).
+ */
+static struct job *
+job_initialize (
+	lua_State *L,
+	const struct job_type *type,
+	void *context)
+{
+	struct job *job = lua_newuserdata (L, sizeof (*job));
+	memset (job, 0, sizeof (*job));
+	job->type = type;
+	job->context = context;
+	lock_initialize (&job->lock);
+
+	if (luaL_newmetatable (L, STORMLIB_JOB_METATABLE))
+	{
+		luaL_setfuncs (L, job_methods, 0);
+		lua_pushvalue (L, -1);
+		lua_setfield (L, -2, "__index");
+	}
+
+	lua_setmetatable (L, -2);
+	return job;
+}
+
+/*
+ * Marks `object` as busy for as long as `job` runs (see `to_handle_at ()`).
+ * The mark is removed once the job is joined.
+ */
+static void
+job_attach (
+	struct job *job,
+	struct object *object)
+{
+	job->object = object;
+	object->job = job;
+}
+
+/*
+ * Starts `count` workers on `total` items.  A job without items finishes
+ * immediately, on this thread.  On failure, any started workers are
+ * cancelled and joined.
+ */
+static bool
+job_start (
+	struct job *job,
+	const size_t total,
+	size_t count)
+{
+	job->total = total;
+
+	if (count > total)
+	{
+		count = total;
+	}
+
+	if (count == 0)
+	{
+		job->error = job->type->finish
+			? job->type->finish (job)
+			: ERROR_SUCCESS;
+
+		SetLastError (job->error);
+		return job->error == ERROR_SUCCESS;
+	}
+
+	job->workers = calloc (count, sizeof (*job->workers));
+
+	if (job->workers == NULL)
+	{
+		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+		return false;
+	}
+
+	job->running = count;
+	job->stopping = count;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		struct job_worker *worker = &job->workers [i];
+		worker->job = job;
+		worker->index = i;
+
+		if (!thread_start (&worker->thread, worker))
+		{
+			lock_acquire (&job->lock);
+			job->cancelled = true;
+			job->running = job->running - (count - i);
+			job->stopping = job->stopping - (count - i);
+			lock_release (&job->lock);
+
+			job->count = i;
+			job_join (job);
+			SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+			return false;
+		}
+
+		job->count = i + 1;
+	}
+
+	return true;
+}
+
+/*
+ * Extraction to a directory.  Each worker opens its own handle on the
+ * archive, as StormLib handles are not safe to share across threads.
+ */
+struct extract_entry
+{
+	char *name;
+	ULONGLONG offset;
+};
+
+struct extract
+{
+	char *path;
+	char *directory;
+	struct extract_entry *entries;
+	size_t count;
+	size_t capacity;
+	HANDLE *archives;
+};
+
+static void
+extract_free (
+	void *context)
+{
+	struct extract *extract = context;
+
+	for (size_t i = 0; i < extract->count; i++)
+	{
+		free (extract->entries [i].name);
+	}
+
+	free (extract->entries);
+	free (extract->archives);
+	free (extract->directory);
+	free (extract->path);
+	free (extract);
+}
+
+static DWORD
+extract_start (
+	struct job *job,
+	const size_t worker)
+{
+	struct extract *extract = job->context;
+
+	if (!SFileOpenArchive (extract->path, 0, STREAM_FLAG_READ_ONLY,
+			&extract->archives [worker]))
+	{
+		return GetLastError ();
+	}
+
+	return ERROR_SUCCESS;
+}
+
+static void
+extract_stop (
+	struct job *job,
+	const size_t worker)
+{
+	struct extract *extract = job->context;
+
+	if (extract->archives [worker])
+	{
+		SFileCloseArchive (extract->archives [worker]);
+		extract->archives [worker] = NULL;
+	}
+}
+
+/*
+ * Names within an archive use backslashes, and could try to escape the
+ * directory.  Such names are refused.
+ */
+static bool
+extract_is_safe (
+	const char *name)
+{
+	if (*name == '\0' || strchr ("\\/", *name) || strchr (name, ':'))
+	{
+		return false;
+	}
+
+	for (const char *part = name; part; )
+	{
+		const size_t length = strcspn (part, "\\/");
+
+		if (length == 2 && part [0] == '.' && part [1] == '.')
+		{
+			return false;
+		}
+
+		part = part [length] != '\0' ? part + length + 1 : NULL;
+	}
+
+	return true;
+}
+
+/*
+ * Creates each parent directory of `path`.  Failures are ignored, as the
+ * directory may already exist (or be created by another worker).  Any real
+ * problem surfaces when the file is created.
+ */
+static void
+extract_directories (
+	char *path)
+{
+	for (char *slash = strchr (path + 1, '/'); slash;
+		slash = strchr (slash + 1, '/'))
+	{
+		*slash = '\0';
+#if defined (_WIN32)
+		CreateDirectoryA (path, NULL);
+#else
+		mkdir (path, 0777);
+#endif
+		*slash = '/';
+	}
+}
+
+static DWORD
+extract_run (
+	struct job *job,
+	const size_t worker,
+	const size_t item)
+{
+	struct extract *extract = job->context;
+	const char *name = extract->entries [item].name;
+
+	if (!extract_is_safe (name))
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	const size_t directory = strlen (extract->directory);
+	const size_t length = strlen (name);
+	char *path = malloc (directory + length + 2);
+
+	if (path == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	memcpy (path, extract->directory, directory);
+	path [directory] = '/';
+	memcpy (path + directory + 1, name, length + 1);
+
+	for (char *c = path + directory + 1; *c; c++)
+	{
+		if (*c == '\\')
+		{
+			*c = '/';
+		}
+	}
+
+	extract_directories (path);
+	DWORD error = ERROR_SUCCESS;
+
+	if (!SFileExtractFile (extract->archives [worker], name, path,
+			SFILE_OPEN_FROM_MPQ))
+	{
+		error = GetLastError ();
+	}
+
+	free (path);
+	return error;
+}
+
+static const struct job_type
+extract_type =
+{
+	extract_start,
+	extract_run,
+	extract_stop,
+	NULL,
+	extract_free
+};
+
+static char *
+copy_string (
+	const char *text)
+{
+	const size_t length = strlen (text);
+	char *copy = malloc (length + 1);
+
+	if (copy)
+	{
+		memcpy (copy, text, length + 1);
+	}
+
+	return copy;
+}
+
+static bool
+extract_add (
+	struct extract *extract,
+	HANDLE archive,
+	const char *name)
+{
+	if (extract->count == extract->capacity)
+	{
+		const size_t capacity = extract->capacity > 0
+			? extract->capacity * 2
+			: 64;
+		struct extract_entry *entries = realloc (
+			extract->entries, capacity * sizeof (*entries));
+
+		if (entries == NULL)
+		{
+			SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+			return false;
+		}
+
+		extract->entries = entries;
+		extract->capacity = capacity;
+	}
+
+	struct extract_entry *entry = &extract->entries [extract->count];
+	HANDLE reader = NULL;
+	entry->offset = 0;
+
+	if (!SFileOpenFileEx (archive, name, SFILE_OPEN_FROM_MPQ, &reader))
+	{
+		return false;
+	}
+
+	SFileGetFileInfo (reader, SFileInfoByteOffset,
+		&entry->offset, sizeof (entry->offset), NULL);
+	SFileCloseFile (reader);
+	entry->name = copy_string (name);
+
+	if (entry->name == NULL)
+	{
+		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+		return false;
+	}
+
+	extract->count++;
+	return true;
+}
+
+static int
+extract_compare (
+	const void *a,
+	const void *b)
+{
+	const ULONGLONG x = ((const struct extract_entry *) a)->offset;
+	const ULONGLONG y = ((const struct extract_entry *) b)->offset;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Collects the files to extract.  A string filter is used as the mask.  A
+ * function filter is called with each name, on this thread, and the file
+ * is kept if it returns a true value.
+ */
+static bool
+extract_collect (
+	lua_State *L,
+	HANDLE archive,
+	struct extract *extract,
+	const int filter)
+{
+	const char *mask = lua_type (L, filter) == LUA_TSTRING
+		? lua_tostring (L, filter)
+		: "*";
+	const bool call = lua_isfunction (L, filter);
+	SFILE_FIND_DATA data;
+	HANDLE finder = SFileFindFirstFile (archive, mask, &data, NULL);
+
+	if (finder == NULL)
+	{
+		return GetLastError () == ERROR_NO_MORE_FILES;
+	}
+
+	/* Anchored as an object, should the filter raise an error. */
+	object_initialize (L, finder, SFileFindClose, archive);
+	struct object *object = to_object (L, -1);
+	bool status = true;
+
+	do
+	{
+		bool keep = true;
+
+		if (call)
+		{
+			lua_pushvalue (L, filter);
+			lua_pushstring (L, data.cFileName);
+			lua_call (L, 1, 1);
+			keep = lua_toboolean (L, -1);
+			lua_pop (L, 1);
+		}
+
+		if (keep && !extract_add (extract, archive, data.cFileName))
+		{
+			status = false;
+		}
+	}
+	while (status && SFileFindNextFile (object->handle, &data));
+
+	const DWORD error = GetLastError ();
+	object_finalize (L, object);
+	lua_pop (L, 1);
+
+	if (status && error != ERROR_NO_MORE_FILES)
+	{
+		status = false;
+	}
+
+	SetLastError (error);
+	return status;
+}
+
+/*
+ * Pushes a started extraction job for `archive`.  Arguments begin at
+ * `first`: the directory, an optional filter, and an optional number of
+ * threads.  Returns `false` on failure, with the error set.
+ */
+static bool
+extract_all (
+	lua_State *L,
+	HANDLE archive,
+	const int first)
+{
+	const char *directory = luaL_checkstring (L, first);
+	const int filter = first + 1;
+	const lua_Integer threads = luaL_optinteger (L, first + 2, 0);
+
+	if (!lua_isnoneornil (L, filter)
+		&& !lua_isstring (L, filter)
+		&& !lua_isfunction (L, filter))
+	{
+		luaL_argerror (L, filter, "string or function expected");
+	}
+
+	luaL_argcheck (L, threads >= 0, first + 2,
+		"threads must be non-negative");
+
+	struct extract *extract = calloc (1, sizeof (*extract));
+
+	if (extract == NULL)
+	{
+		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+		return false;
+	}
+
+	struct job *job = job_initialize (L, &extract_type, extract);
+	const size_t count = threads > 0 ? (size_t) threads : thread_count ();
+	DWORD size = 0;
+
+	SFileGetFileInfo (archive, SFileMpqFileName, NULL, 0, &size);
+	extract->path = size > 0 ? malloc (size) : NULL;
+	extract->directory = copy_string (directory);
+	extract->archives = calloc (count, sizeof (*extract->archives));
+
+	if (extract->path == NULL
+		|| extract->directory == NULL
+		|| extract->archives == NULL)
+	{
+		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+		return false;
+	}
+
+	/* Workers read what is on disk, which must match what is collected. */
+	if (!SFileFlushArchive (archive)
+		|| !SFileGetFileInfo (archive, SFileMpqFileName,
+			extract->path, size, NULL)
+		|| !extract_collect (L, archive, extract, filter))
+	{
+		return false;
+	}
+
+	/* Reading in order of position keeps each worker moving forward. */
+	qsort (extract->entries, extract->count,
+		sizeof (*extract->entries), extract_compare);
+
+	return job_start (job, extract->count, count);
+}
+
+/**
+ * `SFileExtractAll (archive, directory [, filter [, threads]])`
+ *
+ * Extracts files into `directory`, spread across `threads` workers (by
+ * default, one per processor).  The filter is either a mask, or a function
+ * that is called with each name and returns whether to extract it.  Each
+ * worker opens the archive anew, so it is what is on disk that gets
+ * extracted.  Returns a job, which can be polled, waited upon, or
+ * cancelled.
+ */
+static int
+archive_extract_all (
+	lua_State *L)
+{
+	HANDLE archive = to_archive (L);
+	lua_settop (L, 4);
+
+	if (!extract_all (L, archive, 2))
+	{
+		return to_error (L);
+	}
+
+	return 1;
+}
+
+/*
+ * CRC-32, as used by zlib.  The table is filled when the module is loaded.
+ */
+static uint32_t crc32_table [256];
+
+static void
+crc32_initialize (void)
+{
+	for (uint32_t i = 0; i < 256; i++)
+	{
+		uint32_t crc = i;
+
+		for (int bit = 0; bit < 8; bit++)
+		{
+			crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+		}
+
+		crc32_table [i] = crc;
+	}
+}
+
+static uint32_t
+crc32_update (
+	uint32_t crc,
+	const void *data,
+	const size_t size)
+{
+	const unsigned char *bytes = data;
+	crc = ~crc;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		crc = crc32_table [(crc ^ bytes [i]) & 0xFF] ^ (crc >> 8);
+	}
+
+	return ~crc;
+}
+
+/*
+ * Building from a manifest.  Workers load and compress each file, one
+ * sector at a time, with `SCompCompress ()`.  Only the writing of the
+ * resulting blocks is serialized, and happens in manifest order so that
+ * the layout of the archive does not depend upon timing.
+ */
+struct build_entry
+{
+	char *name;
+	char *path;
+	const char *contents;
+	size_t size;
+	DWORD compression;
+	LCID locale;
+	ULONGLONG time;
+	DWORD flags;
+	DWORD crc;
+	DWORD index;
+	char *block;
+	size_t length;
+	bool compressed;
+	bool raw;
+	bool verify;
+	bool unchanged;
+	bool ready;
+};
+
+struct build
+{
+	HANDLE archive;
+	DWORD sector;
+	struct build_entry *entries;
+	size_t count;
+	size_t written;
+	thread_lock lock;
+};
+
+static void
+build_free (
+	void *context)
+{
+	struct build *build = context;
+
+	for (size_t i = 0; i < build->count; i++)
+	{
+		struct build_entry *entry = &build->entries [i];
+		free (entry->name);
+		free (entry->path);
+		free (entry->block);
+	}
+
+	lock_destroy (&build->lock);
+	free (build->entries);
+	free (build);
+}
+
+static DWORD
+build_load (
+	struct build_entry *entry,
+	char **data)
+{
+	FILE *file = fopen (entry->path, "rb");
+	long size = -1;
+
+	if (file == NULL)
+	{
+		return (DWORD) errno;
+	}
+
+	if (fseek (file, 0, SEEK_END) == 0)
+	{
+		size = ftell (file);
+	}
+
+	if (size < 0 || fseek (file, 0, SEEK_SET) != 0)
+	{
+		const int error = errno;
+		fclose (file);
+		return (DWORD) error;
+	}
+
+	*data = malloc (size > 0 ? (size_t) size : 1);
+
+	if (*data == NULL)
+	{
+		fclose (file);
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	entry->size = fread (*data, 1, (size_t) size, file);
+	const bool failed = ferror (file) != 0;
+	const int error = errno;
+	fclose (file);
+	return failed ? (DWORD) error : ERROR_SUCCESS;
+}
+
+/*
+ * Produces the block as StormLib would store it: a sector offset table,
+ * followed by each sector.  `SCompCompress ()` leaves a sector as is when
+ * compression does not make it smaller, and so does StormLib on reading.
+ */
+static DWORD
+build_compress (
+	const struct build *build,
+	struct build_entry *entry,
+	const char *data)
+{
+	const size_t width = build->sector;
+	const size_t sectors = (entry->size + width - 1) / width;
+	const size_t table = (sectors + 1) * 4;
+
+	if (entry->size > UINT32_MAX - table)
+	{
+		return ERROR_NOT_SUPPORTED;
+	}
+
+	unsigned char *block = malloc (table + entry->size);
+
+	if (block == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	size_t offset = table;
+
+	for (size_t i = 0; i <= sectors; i++)
+	{
+		block [i * 4 + 0] = (unsigned char) (offset);
+		block [i * 4 + 1] = (unsigned char) (offset >> 8);
+		block [i * 4 + 2] = (unsigned char) (offset >> 16);
+		block [i * 4 + 3] = (unsigned char) (offset >> 24);
+
+		if (i == sectors)
+		{
+			break;
+		}
+
+		const size_t start = i * width;
+		const size_t count = entry->size - start < width
+			? entry->size - start
+			: width;
+		int length = (int) count;
+
+		if (!SCompCompress (block + offset, &length,
+				(void *) (data + start), (int) count,
+				entry->compression, 0, -1))
+		{
+			free (block);
+			return ERROR_CAN_NOT_COMPLETE;
+		}
+
+		offset = offset + (size_t) length;
+	}
+
+	entry->block = (char *) block;
+	entry->length = offset;
+	entry->compressed = true;
+	return ERROR_SUCCESS;
+}
+
+/*
+ * The flags of a file that StormLib honors when creating it.
+ */
+#define STORMLIB_FILE_FLAGS (MPQ_FILE_IMPLODE | MPQ_FILE_COMPRESS \
+	| MPQ_FILE_ENCRYPTED | MPQ_FILE_FIX_KEY | MPQ_FILE_SINGLE_UNIT \
+	| MPQ_FILE_SECTOR_CRC)
+
+/*
+ * Adds the prepared block of `entry` to the archive.  StormLib is given
+ * the block as an uncompressed file, after which the file entry is amended
+ * to describe it as compressed (or, for a `raw` block, with its original
+ * `flags`).  The attributes (e.g. CRC32 and MD5) are then brought up to
+ * date, as StormLib computed them from the block.
+ *
+ * Otherwise, an entry with `flags` is left for StormLib to compress (and
+ * encrypt) as it is written.
+ */
+static DWORD
+build_write (
+	const struct build *build,
+	const struct build_entry *entry)
+{
+	const char *data = entry->block ? entry->block : entry->contents;
+	const size_t length = entry->block ? entry->length : entry->size;
+	const DWORD flags = entry->raw || entry->compressed
+		? 0
+		: entry->flags & STORMLIB_FILE_FLAGS;
+	const DWORD compression = flags & MPQ_FILE_COMPRESS_MASK
+		? entry->compression
+		: 0;
+	HANDLE writer = NULL;
+
+	if (!SFileCreateFile (build->archive, entry->name, entry->time,
+			(DWORD) length, entry->locale,
+			flags | MPQ_FILE_REPLACEEXISTING, &writer))
+	{
+		return GetLastError ();
+	}
+
+	TFileEntry *file = ((TMPQFile *) writer)->pFileEntry;
+
+	if (length > 0
+		&& !SFileWriteFile (writer, data, (DWORD) length, compression))
+	{
+		const DWORD error = GetLastError ();
+		SFileFinishFile (writer);
+		return error;
+	}
+
+	if (!SFileFinishFile (writer))
+	{
+		return GetLastError ();
+	}
+
+	if (entry->raw)
+	{
+		file->dwFileSize = (DWORD) entry->size;
+		file->dwFlags = entry->flags;
+	}
+	else if (entry->compressed)
+	{
+		file->dwFileSize = (DWORD) entry->size;
+		file->dwFlags = file->dwFlags | MPQ_FILE_COMPRESS;
+	}
+
+	/* Otherwise, the attributes would describe the block as written. */
+	if ((entry->raw || entry->compressed)
+		&& !SFileUpdateFileAttributes (build->archive, entry->name))
+	{
+		return GetLastError ();
+	}
+
+	return ERROR_SUCCESS;
+}
+
+/*
+ * Brings the time of an unchanged file (at `index` within the file table)
+ * up to date, such that the next sync finds it matching without reading
+ * it.  The attributes are then saved with the archive, as they would be
+ * had the file been written.
+ */
+static void
+build_touch (
+	struct build *build,
+	const struct build_entry *entry)
+{
+	TMPQArchive *mpq = build->archive;
+	TFileEntry *file = &mpq->pFileTable [entry->index];
+
+	if (mpq->dwAttrFlags & MPQ_ATTRIBUTE_FILETIME
+		&& file->FileTime != entry->time)
+	{
+		file->FileTime = entry->time;
+		mpq->dwFlags |= MPQ_FLAG_CHANGED | MPQ_FLAG_ATTRIBUTES_NEW;
+	}
+}
+
+/*
+ * Marks `item` as ready, and writes every ready entry that is next in
+ * line.  Whichever worker completes the next entry does the writing.
+ */
+static DWORD
+build_commit (
+	struct build *build,
+	const size_t item)
+{
+	DWORD error = ERROR_SUCCESS;
+	lock_acquire (&build->lock);
+	build->entries [item].ready = true;
+
+	while (error == ERROR_SUCCESS
+		&& build->written < build->count
+		&& build->entries [build->written].ready)
+	{
+		struct build_entry *entry = &build->entries [build->written];
+
+		if (!entry->unchanged)
+		{
+			error = build_write (build, entry);
+		}
+		else
+		{
+			build_touch (build, entry);
+		}
+
+		free (entry->block);
+		entry->block = NULL;
+		build->written++;
+	}
+
+	lock_release (&build->lock);
+	return error;
+}
+
+static DWORD
+build_run (
+	struct job *job,
+	const size_t worker,
+	const size_t item)
+{
+	struct build *build = job->context;
+	struct build_entry *entry = &build->entries [item];
+	char *data = NULL;
+	DWORD error = ERROR_SUCCESS;
+	(void) worker;
+
+	if (entry->path)
+	{
+		error = build_load (entry, &data);
+	}
+
+	/* A file whose CRC32 matches (see `sync_all ()`) is left as is. */
+	if (error == ERROR_SUCCESS
+		&& entry->verify
+		&& crc32_update (0, data, entry->size) == entry->crc)
+	{
+		entry->unchanged = true;
+	}
+	else if (error == ERROR_SUCCESS
+		&& entry->compression != 0
+		&& entry->size > 0)
+	{
+		error = build_compress (
+			build, entry, entry->path ? data : entry->contents);
+	}
+	else if (error == ERROR_SUCCESS && data)
+	{
+		/* Loaded data that is stored as is must live until written. */
+		entry->block = data;
+		entry->length = entry->size;
+		data = NULL;
+	}
+
+	free (data);
+
+	/* Once committed, the entry belongs to whichever worker writes it. */
+	if (error == ERROR_SUCCESS)
+	{
+		error = build_commit (build, item);
+	}
+
+	return error;
+}
+
+static const struct job_type
+build_type =
+{
+	NULL,
+	build_run,
+	NULL,
+	NULL,
+	build_free
+};
+
+/*
+ * Reads entry `i` of the manifest at `index`.  Any contents are kept alive
+ * by the table at `anchor`.
+ */
+static void
+build_entry_load (
+	lua_State *L,
+	struct build_entry *entry,
+	const int index,
+	const int anchor,
+	const int i)
+{
+	lua_rawgeti (L, index, i);
+
+	if (!lua_istable (L, -1))
+	{
+		luaL_error (L, "bad manifest entry #%d (table expected, got %s)",
+			i, luaL_typename (L, -1));
+	}
+
+	lua_getfield (L, -1, "name");
+	lua_getfield (L, -2, "path");
+	lua_getfield (L, -3, "contents");
+	lua_getfield (L, -4, "compression");
+	lua_getfield (L, -5, "locale");
+
+	const char *name = lua_tostring (L, -5);
+	const char *path = lua_tostring (L, -4);
+
+	if (name == NULL)
+	{
+		luaL_error (L, "bad manifest entry #%d (name expected)", i);
+	}
+
+	if ((path == NULL) == (lua_type (L, -3) != LUA_TSTRING))
+	{
+		luaL_error (L,
+			"bad manifest entry #%d (path or contents expected)", i);
+	}
+
+	if ((!lua_isnil (L, -2) && lua_type (L, -2) != LUA_TNUMBER)
+		|| (!lua_isnil (L, -1) && lua_type (L, -1) != LUA_TNUMBER))
+	{
+		luaL_error (L,
+			"bad manifest entry #%d (number expected)", i);
+	}
+
+	entry->name = copy_string (name);
+	entry->path = path ? copy_string (path) : NULL;
+	entry->compression = lua_isnil (L, -2)
+		? MPQ_COMPRESSION_ZLIB
+		: (DWORD) lua_tointeger (L, -2);
+	entry->locale = (LCID) lua_tointeger (L, -1);
+
+	if (entry->name == NULL || (path && entry->path == NULL))
+	{
+		luaL_error (L, "not enough memory");
+	}
+
+	if (!path)
+	{
+		entry->contents = lua_tolstring (L, -3, &entry->size);
+		lua_pushvalue (L, -3);
+		lua_rawseti (L, anchor, i);
+	}
+
+	lua_pop (L, 6);
+}
+
+/*
+ * Raises the limit of `archive` (currently `*limit`) above `needed` files,
+ * multiplying it by `growth` until it fits.  StormLib rounds the limit to a
+ * power of two, so `*limit` is updated with what it settled upon.
+ */
+static bool
+grow_limit (
+	HANDLE archive,
+	DWORD *limit,
+	const size_t needed,
+	const size_t growth)
+{
+	size_t size = *limit > 0 ? *limit : HASH_TABLE_SIZE_MIN;
+
+	if (needed < *limit)
+	{
+		return true;
+	}
+
+	while (size <= needed)
+	{
+		size = size * growth;
+	}
+
+	if (size > HASH_TABLE_SIZE_MAX)
+	{
+		if (needed >= HASH_TABLE_SIZE_MAX)
+		{
+			SetLastError (ERROR_DISK_FULL);
+			return false;
+		}
+
+		size = HASH_TABLE_SIZE_MAX;
+	}
+
+	return SFileSetMaxFileCount (archive, (DWORD) size)
+		&& SFileGetFileInfo (archive, SFileMpqMaxFileCount,
+			limit, sizeof (*limit), NULL);
+}
+
+/*
+ * Ensures the archive has room for `count` more files, with a single
+ * rebuild of its tables at most.
+ */
+static bool
+build_reserve (
+	HANDLE archive,
+	const size_t count)
+{
+	DWORD files = 0;
+	DWORD limit = 0;
+
+	if (!SFileGetFileInfo (archive, SFileMpqNumberOfFiles,
+			&files, sizeof (files), NULL)
+		|| !SFileGetFileInfo (archive, SFileMpqMaxFileCount,
+			&limit, sizeof (limit), NULL))
+	{
+		return false;
+	}
+
+	/*
+	 * Unless flushed, certain files (i.e. the listfile, attributes, and
+	 * signature) do not appear in the count.  Err on the side of caution.
+	 */
+	return grow_limit (archive, &limit, files + count + 3, 2);
+}
+
+/*
+ * Pushes a started build job for the archive of `object`, which is busy
+ * until the job has finished.  Arguments begin at `first`: the manifest,
+ * and an optional number of threads.  Returns `false` on failure, with the
+ * error set.
+ */
+static bool
+build_all (
+	lua_State *L,
+	struct object *object,
+	const int first)
+{
+	HANDLE archive = object->handle;
+
+	luaL_checktype (L, first, LUA_TTABLE);
+	const lua_Integer threads = luaL_optinteger (L, first + 1, 0);
+	luaL_argcheck (L, threads >= 0, first + 1,
+		"threads must be non-negative");
+
+	const lua_Integer count = luaL_len (L, first);
+	luaL_argcheck (L, count >= 0 && count < INT_MAX, first,
+		"manifest is too large");
+
+	struct build *build = calloc (1, sizeof (*build));
+
+	if (build == NULL)
+	{
+		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+		return false;
+	}
+
+	lock_initialize (&build->lock);
+	build->archive = archive;
+	struct job *job = job_initialize (L, &build_type, build);
+	job_attach (job, object);
+	build->entries = calloc (count > 0 ? (size_t) count : 1,
+		sizeof (*build->entries));
+
+	if (build->entries == NULL)
+	{
+		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+		return false;
+	}
+
+	build->count = (size_t) count;
+
+	/*
+	 * The job anchors the archive, and the contents of the manifest, for
+	 * as long as it lives.
+	 */
+	lua_createtable (L, (int) count, 1);
+	lua_pushvalue (L, 1);
+	lua_setfield (L, -2, "archive");
+
+	for (int i = 1; i <= (int) count; i++)
+	{
+		build_entry_load (L, &build->entries [i - 1], first,
+			lua_gettop (L), i);
+	}
+
+	lua_rawsetp (L, LUA_REGISTRYINDEX, job);
+
+	if (!SFileGetFileInfo (archive, SFileMpqSectorSize,
+			&build->sector, sizeof (build->sector), NULL)
+		|| !build_reserve (archive, build->count))
+	{
+		return false;
+	}
+
+	return job_start (job, build->count,
+		threads > 0 ? (size_t) threads : thread_count ());
+}
+
+/**
+ * `SFileAddAll (archive, manifest [, threads])`
+ *
+ * Adds every file in `manifest` to the archive, compressing them across
+ * `threads` workers (by default, one per processor).  Each entry in the
+ * manifest is a table with the following fields:
+ *
+ * - `name`: The name within the archive.
+ * - `path` or `contents`: Where the data comes from.
+ * - `compression`: Defaults to `MPQ_COMPRESSION_ZLIB`.  Zero stores the
+ *   file as is.
+ * - `locale`: Defaults to zero.
+ *
+ * Existing files are replaced.  Returns a job.  The archive is busy until
+ * the job has finished, and using it is an error.
+ */
+static int
+archive_add_all (
+	lua_State *L)
+{
+	to_archive (L);
+	lua_settop (L, 3);
+
+	if (!build_all (L, to_object (L, 1), 2))
+	{
+		return to_error (L);
+	}
+
+	return 1;
+}
+
+/*
+ * Size of the chunks in which blocks are copied between archives.
+ */
+#define STORMLIB_COPY_CHUNK (1024 * 1024)
+
+/*
+ * Copies the block of `reader` into `destination` as is: its compressed
+ * (and encrypted) sectors, sector offset table, and sector checksums.  The
+ * block is written as if it were an uncompressed file, after which its
+ * file entry is patched to match the original (as is done by
+ * `build_write ()`).
+ */
+static bool
+copy_block (
+	HANDLE destination,
+	const char *name,
+	HANDLE reader,
+	char *chunk)
+{
+	const TMPQFile *file = reader;
+	const TFileEntry *entry = file->pFileEntry;
+	ULONGLONG position = file->RawFilePos;
+	DWORD remaining = entry->dwCmpSize;
+	LCID locale = 0;
+	HANDLE writer = NULL;
+
+	if (!SFileGetFileInfo (reader, SFileInfoLocale,
+			&locale, sizeof (locale), NULL)
+		|| !SFileCreateFile (destination, name, entry->FileTime,
+			entry->dwCmpSize, locale, MPQ_FILE_REPLACEEXISTING, &writer))
+	{
+		return false;
+	}
+
+	TFileEntry *copy = ((TMPQFile *) writer)->pFileEntry;
+	bool status = true;
+
+	while (status && remaining > 0)
+	{
+		const DWORD count = remaining < STORMLIB_COPY_CHUNK
+			? remaining
+			: STORMLIB_COPY_CHUNK;
+
+		status = FileStream_Read (
+				file->ha->pStream, &position, chunk, count)
+			&& SFileWriteFile (writer, chunk, count, 0);
+
+		position = position + count;
+		remaining = remaining - count;
+	}
+
+	if (!status)
+	{
+		const DWORD error = GetLastError ();
+		SFileFinishFile (writer);
+		SetLastError (error);
+		return false;
+	}
+
+	if (!SFileFinishFile (writer))
+	{
+		return false;
+	}
+
+	copy->dwFileSize = entry->dwFileSize;
+	copy->dwFlags = entry->dwFlags;
+	return SFileUpdateFileAttributes (destination, name);
+}
+
+/*
+ * Copies `reader` into `destination` by reading and writing it anew, with
+ * the same flags.  This is needed when the encryption key depends upon the
+ * position of the file (i.e. `MPQ_FILE_FIX_KEY`), when the archives differ
+ * in sector size (which the sector offset table depends upon), or when the
+ * file is patched (as its block only holds the base).  As the original
+ * codecs are not known, compressed files are recompressed with zlib.
+ */
+static bool
+copy_contents (
+	HANDLE destination,
+	const char *name,
+	HANDLE reader,
+	char *chunk)
+{
+	const TFileEntry *entry = ((const TMPQFile *) reader)->pFileEntry;
+	const DWORD flags = entry->dwFlags & STORMLIB_FILE_FLAGS;
+	const DWORD compression = flags & MPQ_FILE_COMPRESS
+		? MPQ_COMPRESSION_ZLIB
+		: 0;
+	const DWORD size = SFileGetFileSize (reader, NULL);
+	LCID locale = 0;
+	HANDLE writer = NULL;
+
+	/* The size is that of the patched file, which the entry is not. */
+	if (size == SFILE_INVALID_SIZE
+		|| !SFileGetFileInfo (reader, SFileInfoLocale,
+			&locale, sizeof (locale), NULL)
+		|| !SFileCreateFile (destination, name, entry->FileTime,
+			size, locale, flags | MPQ_FILE_REPLACEEXISTING, &writer))
+	{
+		return false;
+	}
+
+	bool status = true;
+	DWORD read = 0;
+
+	do
+	{
+		status = (SFileReadFile (
+				reader, chunk, STORMLIB_COPY_CHUNK, &read, NULL)
+			|| GetLastError () == ERROR_HANDLE_EOF)
+			&& (read == 0
+				|| SFileWriteFile (writer, chunk, read, compression));
+	}
+	while (status && read > 0);
+
+	if (!status)
+	{
+		const DWORD error = GetLastError ();
+		SFileFinishFile (writer);
+		SetLastError (error);
+		return false;
+	}
+
+	return SFileFinishFile (writer);
+}
+
+/*
+ * Copies each file named in the array at `index` from `source` into
+ * `destination`, which must differ.  Blocks are copied as is, without being
+ * decompressed and compressed again, unless their key depends upon their
+ * position, the archives differ in sector size, or the file is patched.
+ * Files are only ever opened from the archive itself.
+ */
+static bool
+copy_many (
+	lua_State *L,
+	HANDLE source,
+	HANDLE destination,
+	const int index)
+{
+	const lua_Integer count = luaL_len (L, index);
+
+	for (lua_Integer i = 1; i <= count; i++)
+	{
+		lua_rawgeti (L, index, i);
+
+		if (lua_type (L, -1) != LUA_TSTRING)
+		{
+			luaL_error (L, "bad name #%d (string expected)", (int) i);
+		}
+
+		lua_pop (L, 1);
+	}
+
+	/* A file replacing itself would be read from the entry it replaces. */
+	if (source == destination)
+	{
+		SetLastError (ERROR_INVALID_PARAMETER);
+		return false;
+	}
+
+	DWORD sector = 0;
+	DWORD target = 0;
+
+	if (!SFileGetFileInfo (source, SFileMpqSectorSize,
+			&sector, sizeof (sector), NULL)
+		|| !SFileGetFileInfo (destination, SFileMpqSectorSize,
+			&target, sizeof (target), NULL)
+		|| !build_reserve (destination, (size_t) count))
+	{
+		return false;
+	}
+
+	char *chunk = malloc (STORMLIB_COPY_CHUNK);
+
+	if (chunk == NULL)
+	{
+		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+		return false;
+	}
+
+	bool status = true;
+
+	for (lua_Integer i = 1; status && i <= count; i++)
+	{
+		lua_rawgeti (L, index, i);
+		const char *name = lua_tostring (L, -1);
+		HANDLE reader = NULL;
+
+		status = SFileOpenFileEx (
+			source, name, SFILE_OPEN_FROM_MPQ, &reader);
+
+		if (status)
+		{
+			const TMPQFile *file = reader;
+
+			if (file->pFileEntry == NULL || file->ha == NULL)
+			{
+				SetLastError (ERROR_NOT_SUPPORTED);
+				status = false;
+			}
+			else if (file->pFileEntry->dwFlags & MPQ_FILE_FIX_KEY
+				|| file->hfPatch != NULL
+				|| sector != target)
+			{
+				status = copy_contents (destination, name, reader, chunk);
+			}
+			else
+			{
+				status = copy_block (destination, name, reader, chunk);
+			}
+
+			const DWORD error = GetLastError ();
+			SFileCloseFile (reader);
+			SetLastError (error);
+		}
+
+		lua_pop (L, 1);
+	}
+
+	const DWORD error = GetLastError ();
+	free (chunk);
+	SetLastError (error);
+	return status;
+}
+
+/**
+ * `SFileCopyMany (source, destination, names)`
+ *
+ * Copies each file in the array `names` from the archive `source` into
+ * the archive `destination`, replacing existing files.  The blocks are
+ * copied as they are stored, rather than being decompressed and compressed
+ * again.  The exceptions are files whose encryption key depends upon their
+ * position, patched files, and archives that differ in sector size, where
+ * files are recompressed with zlib.  The archives must differ.
+ */
+static int
+archive_copy_many (
+	lua_State *L)
+{
+	HANDLE source = to_archive (L);
+	HANDLE destination = to_handle_at (L, 2, is_archive);
+	luaL_checktype (L, 3, LUA_TTABLE);
+	lua_settop (L, 3);
+
+	return to_result (
+		L, copy_many (L, source, destination, 3));
+}
+
+/*
+ * Compaction in the background.  StormLib compacts the archive on a single
+ * worker, which has the handle to itself until it is done.  Progress is
+ * reported through the job, rather than by calling back into Lua.
+ */
+struct compact
+{
+	HANDLE archive;
+	struct object *object;
+	char *listfile;
+	ULONGLONG reported;
+};
+
+/*
+ * Progress is reported in steps of this fraction of the total, at most.
+ */
+#define STORMLIB_COMPACT_STEPS 256
+
+static void
+compact_free (
+	void *context)
+{
+	struct compact *compact = context;
+	free (compact->listfile);
+	free (compact);
+}
+
+/*
+ * Only the copying of files is reported, as it is where the time goes.
+ */
+static void
+compact_progress (
+	void *data,
+	DWORD work,
+	ULONGLONG processed,
+	ULONGLONG total)
+{
+	struct job *job = data;
+	struct compact *compact = job->context;
+
+	if (work != CCB_COMPACTING_FILES)
+	{
+		return;
+	}
+
+	if (processed < total && processed >= compact->reported
+		&& processed - compact->reported < total / STORMLIB_COMPACT_STEPS)
+	{
+		return;
+	}
+
+	compact->reported = processed;
+	job_progress (job, processed, total);
+}
+
+static DWORD
+compact_run (
+	struct job *job,
+	const size_t worker,
+	const size_t item)
+{
+	struct compact *compact = job->context;
+	const struct object *object = compact->object;
+	DWORD error = ERROR_SUCCESS;
+	(void) worker;
+	(void) item;
+
+	if (!SFileSetCompactCallback (compact->archive, compact_progress, job)
+		|| !SFileCompactArchive (compact->archive, compact->listfile, 0))
+	{
+		error = GetLastError ();
+	}
+
+	/* Any callback set from Lua is put back. */
+	SFileSetCompactCallback (compact->archive,
+		object->compact ? compact_callback : NULL, (void *) object);
+
+	return error;
+}
+
+static const struct job_type
+compact_type =
+{
+	NULL,
+	compact_run,
+	NULL,
+	NULL,
+	compact_free
+};
+
+/**
+ * `SFileCompactArchiveAsync (archive [, listfile])`
+ *
+ * Compacts the archive on a thread of its own, as `SFileCompactArchive ()`
+ * would.  Returns a job, which reports progress in bytes.  Until the job
+ * has finished, the archive is busy: using it is an error, and its files
+ * must not be used either.  Cancelling the job only has an effect if
+ * compaction has yet to begin, as StormLib cannot be interrupted.
+ */
+static int
+archive_compact_async (
+	lua_State *L)
+{
+	struct object *object = to_object (L, 1);
+	HANDLE archive = to_archive (L);
+	const char *listfile = luaL_optstring (L, 2, NULL);
+	lua_settop (L, 2);
+
+	struct compact *compact = calloc (1, sizeof (*compact));
+
+	if (compact == NULL)
+	{
+		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+		return to_error (L);
+	}
+
+	compact->archive = archive;
+	compact->object = object;
+	struct job *job = job_initialize (L, &compact_type, compact);
+	job_attach (job, object);
+
+	/* The job anchors the archive for as long as it lives. */
+	lua_pushvalue (L, 1);
+	lua_rawsetp (L, LUA_REGISTRYINDEX, job);
+
+	if (listfile)
+	{
+		compact->listfile = copy_string (listfile);
+
+		if (compact->listfile == NULL)
+		{
+			SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+			return to_error (L);
+		}
+	}
+
+	if (!job_start (job, 1, 1))
+	{
+		return to_error (L);
+	}
+
+	return 1;
+}
+
+/*
+ * Checksums of many files.  Workers call `SFileGetFileChecksums ()` on
+ * handles of their own.  The results are held by the Lua state, as the
+ * context does not outlive the job.
+ */
+struct checksum_result
+{
+	DWORD crc;
+	char md5 [MD5_DIGEST_SIZE];
+};
+
+/*
+ * The extraction must remain the first member, as `extract_start ()` and
+ * `extract_stop ()` are shared.
+ */
+struct checksum
+{
+	struct extract extract;
+	struct checksum_result *results;
+};
+
+static void
+checksum_free (
+	void *context)
+{
+	struct checksum *checksum = context;
+
+	/* This releases `checksum` itself. */
+	extract_free (&checksum->extract);
+}
+
+static DWORD
+checksum_run (
+	struct job *job,
+	const size_t worker,
+	const size_t item)
+{
+	struct checksum *checksum = job->context;
+	struct checksum_result *result = &checksum->results [item];
+
+	if (!SFileGetFileChecksums (checksum->extract.archives [worker],
+			checksum->extract.entries [item].name,
+			&result->crc, result->md5))
+	{
+		return GetLastError ();
+	}
+
+	return ERROR_SUCCESS;
+}
+
+static const struct job_type
+checksum_type =
+{
+	extract_start,
+	checksum_run,
+	extract_stop,
+	NULL,
+	checksum_free
+};
+
+/*
+ * Pushes a table of the checksums of the files in `archive`, which are
+ * computed on a pool of workers.  Arguments begin at `first`: an optional
+ * filter, and an optional number of threads (as with `extract_all ()`).
+ * Returns `false` on failure, with the error set.
+ */
+static bool
+checksum_all (
+	lua_State *L,
+	HANDLE archive,
+	const int first)
+{
+	const int filter = first;
+	const lua_Integer threads = luaL_optinteger (L, first + 1, 0);
+
+	if (!lua_isnoneornil (L, filter)
+		&& !lua_isstring (L, filter)
+		&& !lua_isfunction (L, filter))
+	{
+		luaL_argerror (L, filter, "string or function expected");
+	}
+
+	luaL_argcheck (L, threads >= 0, first + 1,
+		"threads must be non-negative");
+
+	struct checksum *checksum = calloc (1, sizeof (*checksum));
+
+	if (checksum == NULL)
+	{
+		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+		return false;
+	}
+
+	struct job *job = job_initialize (L, &checksum_type, checksum);
+	struct extract *extract = &checksum->extract;
+	const size_t count = threads > 0 ? (size_t) threads : thread_count ();
+	DWORD size = 0;
+
+	SFileGetFileInfo (archive, SFileMpqFileName, NULL, 0, &size);
+	extract->path = size > 0 ? malloc (size) : NULL;
+	extract->archives = calloc (count, sizeof (*extract->archives));
+
+	if (extract->path == NULL || extract->archives == NULL)
+	{
+		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+		return false;
+	}
+
+	/* Workers read what is on disk, which must match what is collected. */
+	if (!SFileFlushArchive (archive)
+		|| !SFileGetFileInfo (archive, SFileMpqFileName,
+			extract->path, size, NULL)
+		|| !extract_collect (L, archive, extract, filter))
+	{
+		return false;
+	}
+
+	/* Reading in order of position keeps each worker moving forward. */
+	qsort (extract->entries, extract->count,
+		sizeof (*extract->entries), extract_compare);
+
+	const size_t total = extract->count;
+	struct checksum_result *results = lua_newuserdata (
+		L, total > 0 ? total * sizeof (*results) : 1);
+	checksum->results = results;
+
+	/* The names are taken now, as they are released with the job. */
+	lua_createtable (L, 0, 3);
+	lua_createtable (L, (int) total, 0);
+
+	for (size_t i = 0; i < total; i++)
+	{
+		lua_pushstring (L, extract->entries [i].name);
+		lua_rawseti (L, -2, (lua_Integer) i + 1);
+	}
+
+	lua_setfield (L, -2, "cFileName");
+
+	if (!job_start (job, total, count))
+	{
+		return false;
+	}
+
+	job_join (job);
+
+	if (job->error != ERROR_SUCCESS)
+	{
+		SetLastError (job->error);
+		return false;
+	}
+
+	lua_createtable (L, (int) total, 0);
+	lua_createtable (L, (int) total, 0);
+
+	for (size_t i = 0; i < total; i++)
+	{
+		lua_pushinteger (L, (lua_Integer) results [i].crc);
+		lua_rawseti (L, -3, (lua_Integer) i + 1);
+		lua_pushlstring (L, results [i].md5, sizeof (results [i].md5));
+		lua_rawseti (L, -2, (lua_Integer) i + 1);
+	}
+
+	lua_setfield (L, -3, "md5");
+	lua_setfield (L, -2, "dwCrc32");
+	return true;
+}
+
+/**
+ * `SFileChecksumAll (archive [, filter [, threads]])`
+ *
+ * Computes the CRC32 and MD5 of the contents of every matching file, on
+ * `threads` workers (by default, one per processor).  The filter is as
+ * with `SFileExtractAll ()`, and each worker opens the archive anew, so it
+ * is what is on disk that gets read.  Returns a table of arrays, where
+ * `cFileName [i]`, `dwCrc32 [i]`, and `md5 [i]` describe the same file.
+ * Each MD5 is a string of 16 bytes.
+ */
+static int
+archive_checksum_all (
+	lua_State *L)
+{
+	HANDLE archive = to_archive (L);
+	lua_settop (L, 3);
+
+	if (!checksum_all (L, archive, 2))
+	{
+		return to_error (L);
+	}
+
+	return 1;
+}
+
+/*
+ * Verification of many files.  Workers call `SFileVerifyFile ()` on
+ * handles of their own, and the first item has the signature verified
+ * (with `SFileVerifyArchive ()`) alongside them.  The first failure stops
+ * any more files from being handed out.  As with checksums, the results
+ * are held by the Lua state.
+ *
+ * Verification of raw data works the same way, but with
+ * `SFileVerifyRawData ()`, and the first item checks the header and each
+ * table instead of the signature.  Only archives of version 4 have MD5s
+ * of their raw data, so the tables are also checked against the archive
+ * for what they describe (see `verify_structure ()`).
+ */
+static const DWORD
+verify_tables [] =
+{
+	SFILE_VERIFY_MPQ_HEADER,
+	SFILE_VERIFY_HET_TABLE,
+	SFILE_VERIFY_BET_TABLE,
+	SFILE_VERIFY_HASH_TABLE,
+	SFILE_VERIFY_BLOCK_TABLE,
+	SFILE_VERIFY_HIBLOCK_TABLE
+};
+
+#define STORMLIB_VERIFY_TABLES \
+	(sizeof (verify_tables) / sizeof (*verify_tables))
+
+struct verify_result
+{
+	DWORD result;
+	bool done;
+};
+
+/*
+ * The extraction must remain the first member, as `extract_start ()` and
+ * `extract_stop ()` are shared.
+ */
+struct verify
+{
+	struct extract extract;
+	struct verify_result *results;
+	DWORD *tables;
+	DWORD flags;
+	bool raw;
+};
+
+static void
+verify_free (
+	void *context)
+{
+	struct verify *verify = context;
+
+	/* This releases `verify` itself. */
+	extract_free (&verify->extract);
+}
+
+/*
+ * Whether a table of `size` bytes at `position` lies within the first
+ * `limit` bytes of the archive.  A table that is absent always does.
+ */
+static bool
+verify_within (
+	const ULONGLONG position,
+	const ULONGLONG size,
+	const ULONGLONG limit)
+{
+	return size == 0 || (position <= limit && size <= limit - position);
+}
+
+/*
+ * Whether every existing file lies within the first `limit` bytes of the
+ * archive.
+ */
+static bool
+verify_files (
+	const TMPQArchive *mpq,
+	const ULONGLONG limit)
+{
+	for (DWORD i = 0; i < mpq->dwFileTableSize; i++)
+	{
+		const TFileEntry *entry = &mpq->pFileTable [i];
+
+		if (entry->dwFlags & MPQ_FILE_EXISTS
+			&& !verify_within (entry->ByteOffset, entry->dwCmpSize, limit))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Checks what `table` describes, as loaded by StormLib: the header must
+ * not claim more than is on disk, each table must lie within the archive,
+ * as must each file (checked with the block table, if any, or else the
+ * BET table), and each hash entry must refer to a block (or be free).
+ * Returns `ERROR_FILE_CORRUPT` otherwise.
+ */
+static DWORD
+verify_structure (
+	HANDLE archive,
+	const DWORD table)
+{
+	const TMPQArchive *mpq = archive;
+	const TMPQHeader *header = mpq->pHeader;
+	const ULONGLONG size = header->ArchiveSize64;
+	const bool blocks = header->dwBlockTableSize > 0;
+	bool valid = true;
+
+	switch (table)
+	{
+		case SFILE_VERIFY_MPQ_HEADER:
+		{
+			valid = mpq->FileSize >= mpq->MpqPos
+				&& size <= mpq->FileSize - mpq->MpqPos
+				&& header->dwHeaderSize <= size;
+			break;
+		}
+
+		case SFILE_VERIFY_HET_TABLE:
+		{
+			valid = verify_within (header->HetTablePos64,
+				header->HetTableSize64, size);
+			break;
+		}
+
+		case SFILE_VERIFY_BET_TABLE:
+		{
+			valid = verify_within (header->BetTablePos64,
+				header->BetTableSize64, size)
+				&& (blocks || verify_files (mpq, size));
+			break;
+		}
+
+		case SFILE_VERIFY_HASH_TABLE:
+		{
+			const ULONGLONG position = header->dwHashTablePos
+				| (ULONGLONG) header->wHashTablePosHi << 32;
+			valid = verify_within (position, header->HashTableSize64, size);
+
+			for (DWORD i = 0; valid && mpq->pHashTable
+				&& i < header->dwHashTableSize; i++)
+			{
+				const DWORD index = mpq->pHashTable [i].dwBlockIndex;
+				valid = index < header->dwBlockTableSize
+					|| index == HASH_ENTRY_FREE
+					|| index == HASH_ENTRY_DELETED;
+			}
+
+			break;
+		}
+
+		case SFILE_VERIFY_BLOCK_TABLE:
+		{
+			const ULONGLONG position = header->dwBlockTablePos
+				| (ULONGLONG) header->wBlockTablePosHi << 32;
+			valid = verify_within (position, header->BlockTableSize64, size)
+				&& (!blocks || verify_files (mpq, size));
+			break;
+		}
+
+		case SFILE_VERIFY_HIBLOCK_TABLE:
+		{
+			valid = verify_within (header->HiBlockTablePos64,
+				header->HiBlockTableSize64, size);
+			break;
+		}
+	}
+
+	return valid ? ERROR_SUCCESS : ERROR_FILE_CORRUPT;
+}
+
+static DWORD
+verify_run (
+	struct job *job,
+	const size_t worker,
+	const size_t item)
+{
+	struct verify *verify = job->context;
+	struct verify_result *result = &verify->results [item];
+	HANDLE archive = verify->extract.archives [worker];
+	bool failed = false;
+
+	if (item == 0 && verify->raw)
+	{
+		for (size_t i = 0; i < STORMLIB_VERIFY_TABLES; i++)
+		{
+			verify->tables [i] = SFileVerifyRawData (
+				archive, verify_tables [i], NULL);
+
+			if (verify->tables [i] == ERROR_SUCCESS)
+			{
+				verify->tables [i] = verify_structure (
+					archive, verify_tables [i]);
+			}
+
+			failed = failed || verify->tables [i] != ERROR_SUCCESS;
+		}
+	}
+	else if (item == 0)
+	{
+		result->result = SFileVerifyArchive (archive);
+		failed = result->result == ERROR_VERIFY_FAILED
+			|| result->result == ERROR_WEAK_SIGNATURE_ERROR
+			|| result->result == ERROR_STRONG_SIGNATURE_ERROR;
+	}
+	else if (verify->raw)
+	{
+		result->result = SFileVerifyRawData (archive, SFILE_VERIFY_FILE,
+			verify->extract.entries [item - 1].name);
+		failed = result->result != ERROR_SUCCESS;
+	}
+	else
+	{
+		result->result = SFileVerifyFile (archive,
+			verify->extract.entries [item - 1].name, verify->flags);
+		failed = (result->result & VERIFY_FILE_ERROR_MASK) != 0;
+	}
+
+	result->done = true;
+
+	if (failed)
+	{
+		job_cancel (job);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+static const struct job_type
+verify_type =
+{
+	extract_start,
+	verify_run,
+	extract_stop,
+	NULL,
+	verify_free
+};
+
+/*
+ * Pushes a table of the results of verifying `archive` on a pool of
+ * workers.  Arguments begin at `first`: optional flags for
+ * `SFileVerifyFile ()` (unless verifying `raw` data), and an optional
+ * number of threads.  Returns `false` on failure, with the error set.
+ */
+static bool
+verify_all (
+	lua_State *L,
+	HANDLE archive,
+	const int first,
+	const bool raw)
+{
+	const lua_Integer flags = raw
+		? 0
+		: luaL_optinteger (L, first, SFILE_VERIFY_ALL);
+	const int position = raw ? first : first + 1;
+	const lua_Integer threads = luaL_optinteger (L, position, 0);
+	luaL_argcheck (L, threads >= 0, position,
+		"threads must be non-negative");
+
+	struct verify *verify = calloc (1, sizeof (*verify));
+
+	if (verify == NULL)
+	{
+		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+		return false;
+	}
+
+	struct job *job = job_initialize (L, &verify_type, verify);
+	struct extract *extract = &verify->extract;
+	const size_t count = threads > 0 ? (size_t) threads : thread_count ();
+	DWORD size = 0;
+
+	verify->flags = (DWORD) flags;
+	verify->raw = raw;
+	SFileGetFileInfo (archive, SFileMpqFileName, NULL, 0, &size);
+	extract->path = size > 0 ? malloc (size) : NULL;
+	extract->archives = calloc (count, sizeof (*extract->archives));
+
+	if (extract->path == NULL || extract->archives == NULL)
+	{
+		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+		return false;
+	}
+
+	/* Workers read what is on disk, which must match what is collected. */
+	lua_pushnil (L);
+
+	if (!SFileFlushArchive (archive)
+		|| !SFileGetFileInfo (archive, SFileMpqFileName,
+			extract->path, size, NULL)
+		|| !extract_collect (L, archive, extract, lua_gettop (L)))
+	{
+		return false;
+	}
+
+	lua_pop (L, 1);
+
+	/* Reading in order of position keeps each worker moving forward. */
+	qsort (extract->entries, extract->count,
+		sizeof (*extract->entries), extract_compare);
+
+	/* The first result is that of the signature (unless `raw`). */
+	const size_t total = extract->count;
+	struct verify_result *results = lua_newuserdata (
+		L, (total + 1) * sizeof (*results));
+	memset (results, 0, (total + 1) * sizeof (*results));
+	verify->results = results;
+
+	DWORD *tables = NULL;
+
+	if (raw)
+	{
+		tables = lua_newuserdata (
+			L, STORMLIB_VERIFY_TABLES * sizeof (*tables));
+		verify->tables = tables;
+	}
+
+	/* The names are taken now, as they are released with the job. */
+	lua_createtable (L, 0, 3);
+	lua_createtable (L, (int) total, 0);
+
+	for (size_t i = 0; i < total; i++)
+	{
+		lua_pushstring (L, extract->entries [i].name);
+		lua_rawseti (L, -2, (lua_Integer) i + 1);
+	}
+
+	lua_setfield (L, -2, "cFileName");
+
+	if (!job_start (job, total + 1, count))
+	{
+		return false;
+	}
+
+	job_join (job);
+
+	if (job->error != ERROR_SUCCESS)
+	{
+		SetLastError (job->error);
+		return false;
+	}
+
+	/* Those not verified, due to an earlier failure, are `false`. */
+	lua_createtable (L, (int) total, 0);
+
+	for (size_t i = 1; i <= total; i++)
+	{
+		if (results [i].done)
+		{
+			lua_pushinteger (L, (lua_Integer) results [i].result);
+		}
+		else
+		{
+			lua_pushboolean (L, false);
+		}
+
+		lua_rawseti (L, -2, (lua_Integer) i);
+	}
+
+	lua_setfield (L, -2, "result");
+
+	if (raw && results [0].done)
+	{
+		lua_createtable (L, (int) STORMLIB_VERIFY_TABLES, 0);
+
+		for (size_t i = 0; i < STORMLIB_VERIFY_TABLES; i++)
+		{
+			lua_pushinteger (L, (lua_Integer) tables [i]);
+			lua_rawseti (L, -2, verify_tables [i]);
+		}
+	}
+	else if (results [0].done)
+	{
+		lua_pushinteger (L, (lua_Integer) results [0].result);
+	}
+	else
+	{
+		lua_pushboolean (L, false);
+	}
+
+	lua_setfield (L, -2, raw ? "tables" : "signature");
+	return true;
+}
+
+/**
+ * `SFileVerifyAll (archive [, flags [, threads]])`
+ *
+ * Verifies every file with `SFileVerifyFile ()` and the given `flags` (by
+ * default, `SFILE_VERIFY_ALL`), on `threads` workers (by default, one per
+ * processor).  The signature is verified by one of them in the meantime,
+ * as with `SFileVerifyArchive ()`.  Each worker opens the archive anew, so
+ * it is what is on disk that gets verified.  Returns a table with the
+ * arrays `cFileName` and `result`, where the same index describes the same
+ * file, and the `signature`.  The first failure (i.e. a result with any of
+ * `VERIFY_FILE_ERROR_MASK`, or a bad signature) stops the rest, whose
+ * results are `false`.
+ */
+static int
+archive_verify_all (
+	lua_State *L)
+{
+	HANDLE archive = to_archive (L);
+	lua_settop (L, 3);
+
+	if (!verify_all (L, archive, 2, false))
+	{
+		return to_error (L);
+	}
+
+	return 1;
+}
+
+/**
+ * `SFileVerifyRawDataAll (archive [, threads])`
+ *
+ * Checks the raw data of the archive against the MD5 of each of its raw
+ * chunks, with `SFileVerifyRawData ()`, without decompressing anything.
+ * The header and each table (i.e. the HET, BET, hash, block, and hi-block
+ * tables) are checked by one worker, while the rest check the files.
+ * Otherwise, this works as with `SFileVerifyAll ()`: each `result` is an
+ * error code (or `false`), and `tables` holds the result of each table by
+ * what was verified (e.g. `tables [SFILE_VERIFY_HASH_TABLE]`).  Only
+ * archives of version 4 have raw chunks, so elsewhere only the structure
+ * is checked: that the tables and files lie within the archive, and that
+ * each hash entry refers to a block.  Such a failure is reported as
+ * `ERROR_FILE_CORRUPT`.
+ */
+static int
+archive_verify_raw_all (
+	lua_State *L)
+{
+	HANDLE archive = to_archive (L);
+	lua_settop (L, 2);
+
+	if (!verify_all (L, archive, 2, true))
+	{
+		return to_error (L);
+	}
+
+	return 1;
+}
+
+/*
+ * Reads an optional integer field from the options table at `index`.  The
+ * error names the option, rather than the argument position.
+ */
+static lua_Integer
+option_integer (
+	lua_State *L,
+	const int index,
+	const char *name,
+	const lua_Integer fallback)
+{
+	lua_Integer value = fallback;
+
+	if (lua_isnoneornil (L, index))
+	{
+		return value;
+	}
+
+	lua_getfield (L, index, name);
+
+	if (!lua_isnil (L, -1))
+	{
+		if (lua_type (L, -1) != LUA_TNUMBER)
+		{
+			luaL_error (L, "bad argument for '%s' (%s expected, got %s)",
+				name, lua_typename (L, LUA_TNUMBER), luaL_typename (L, -1));
+		}
+
+		value = lua_tointeger (L, -1);
+	}
+
+	lua_pop (L, 1);
+	return value;
+}
+
+/*
+ * As with `option_integer ()`, but for any number.
+ */
+static lua_Number
+option_number (
+	lua_State *L,
+	const int index,
+	const char *name,
+	const lua_Number fallback)
+{
+	lua_Number value = fallback;
+
+	if (lua_isnoneornil (L, index))
+	{
+		return value;
+	}
+
+	lua_getfield (L, index, name);
+
+	if (!lua_isnil (L, -1))
+	{
+		if (lua_type (L, -1) != LUA_TNUMBER)
+		{
+			luaL_error (L, "bad argument for '%s' (%s expected, got %s)",
+				name, lua_typename (L, LUA_TNUMBER), luaL_typename (L, -1));
+		}
+
+		value = lua_tonumber (L, -1);
+	}
+
+	lua_pop (L, 1);
+	return value;
+}
+
+/*
+ * Rebuilding into a new archive.  Live files are read on a pool of workers,
+ * each with its own handle on the source, and written to the new archive in
+ * a fixed order (as with `build_commit ()`).  Blocks are copied as they are
+ * stored, unless they are to be recompressed.
+ *
+ * The extraction must remain the first member, as `extract_start ()` and
+ * `extract_stop ()` are shared.
+ */
+struct rebuild
+{
+	struct extract extract;
+	struct build build;
+	char *target;
+	char *temporary;
+	DWORD compression;
+	size_t threads;
+};
+
+static void
+rebuild_free (
+	void *context)
+{
+	struct rebuild *rebuild = context;
+	struct build *build = &rebuild->build;
+
+	/* A job that never finished leaves nothing behind. */
+	if (build->archive)
+	{
+		SFileCloseArchive (build->archive);
+		remove (rebuild->temporary);
+	}
+
+	for (size_t i = 0; i < build->count; i++)
+	{
+		free (build->entries [i].block);
+	}
+
+	lock_destroy (&build->lock);
+	free (build->entries);
+	free (rebuild->temporary);
+	free (rebuild->target);
+
+	/* Last, as this releases `rebuild` itself. */
+	extract_free (&rebuild->extract);
+}
+
+/*
+ * Reads the block of `file` as it is stored, to be written as is.
+ */
+static DWORD
+rebuild_block (
+	struct build_entry *entry,
+	const TMPQFile *file)
+{
+	ULONGLONG position = file->RawFilePos;
+	entry->length = file->pFileEntry->dwCmpSize;
+	entry->block = malloc (entry->length > 0 ? entry->length : 1);
+
+	if (entry->block == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	if (entry->length > 0 && !FileStream_Read (file->ha->pStream,
+			&position, entry->block, (DWORD) entry->length))
+	{
+		return GetLastError ();
+	}
+
+	entry->raw = true;
+	return ERROR_SUCCESS;
+}
+
+static DWORD
+rebuild_load (
+	const struct rebuild *rebuild,
+	struct build_entry *entry,
+	HANDLE reader)
+{
+	const TMPQFile *file = reader;
+	const bool compressed =
+		(file->pFileEntry->dwFlags & MPQ_FILE_COMPRESS_MASK) != 0;
+
+	entry->size = file->pFileEntry->dwFileSize;
+	entry->time = file->pFileEntry->FileTime;
+	entry->flags = file->pFileEntry->dwFlags;
+
+	if (!SFileGetFileInfo (reader, SFileInfoLocale,
+			&entry->locale, sizeof (entry->locale), NULL))
+	{
+		return GetLastError ();
+	}
+
+	if (!(entry->flags & MPQ_FILE_FIX_KEY)
+		&& (rebuild->compression == 0 || !compressed))
+	{
+		return rebuild_block (entry, file);
+	}
+
+	char *data = malloc (entry->size > 0 ? entry->size : 1);
+	DWORD read = 0;
+
+	if (data == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	if (entry->size > 0 && !SFileReadFile (
+			reader, data, (DWORD) entry->size, &read, NULL))
+	{
+		const DWORD error = GetLastError ();
+		free (data);
+		return error;
+	}
+
+	entry->compression = rebuild->compression != 0
+		? rebuild->compression
+		: MPQ_COMPRESSION_ZLIB;
+
+	/* StormLib compresses (and encrypts) these as they are written. */
+	if (entry->flags & MPQ_FILE_ENCRYPTED || !compressed || read == 0)
+	{
+		entry->block = data;
+		entry->length = read;
+		return ERROR_SUCCESS;
+	}
+
+	const DWORD error = build_compress (&rebuild->build, entry, data);
+	free (data);
+	return error;
+}
+
+static DWORD
+rebuild_run (
+	struct job *job,
+	const size_t worker,
+	const size_t item)
+{
+	struct rebuild *rebuild = job->context;
+	struct build_entry *entry = &rebuild->build.entries [item];
+	HANDLE reader = NULL;
+
+	if (!SFileOpenFileEx (rebuild->extract.archives [worker], entry->name,
+			SFILE_OPEN_FROM_MPQ, &reader))
+	{
+		return GetLastError ();
+	}
+
+	DWORD error = rebuild_load (rebuild, entry, reader);
+	SFileCloseFile (reader);
+
+	/* Once committed, the entry belongs to whichever worker writes it. */
+	if (error == ERROR_SUCCESS)
+	{
+		error = build_commit (&rebuild->build, item);
+	}
+
+	return error;
+}
+
+/*
+ * Moves `source` over `target`, in a single step.
+ */
+static DWORD
+rebuild_replace (
+	const char *source,
+	const char *target)
+{
+#if defined (_WIN32)
+	if (!MoveFileExA (source, target, MOVEFILE_REPLACE_EXISTING))
+	{
+		return GetLastError ();
+	}
+#else
+	if (rename (source, target) != 0)
+	{
+		return (DWORD) errno;
+	}
+#endif
+
+	return ERROR_SUCCESS;
+}
+
+/*
+ * Closes the new archive, and moves it into place if every file made it.
+ */
+static DWORD
+rebuild_finish (
+	struct job *job)
+{
+	struct rebuild *rebuild = job->context;
+	struct build *build = &rebuild->build;
+	const bool complete = job->error == ERROR_SUCCESS
+		&& build->written == build->count;
+	DWORD error = ERROR_SUCCESS;
+
+	if (!SFileCloseArchive (build->archive))
+	{
+		error = GetLastError ();
+	}
+
+	build->archive = NULL;
+
+	if (complete && error == ERROR_SUCCESS)
+	{
+		error = rebuild_replace (rebuild->temporary, rebuild->target);
+	}
+
+	if (!complete || error != ERROR_SUCCESS)
+	{
+		remove (rebuild->temporary);
+	}
+
+	return error;
+}
+
+static const struct job_type
+rebuild_type =
+{
+	extract_start,
+	rebuild_run,
+	extract_stop,
+	rebuild_finish,
+	rebuild_free
+};
+
+/*
+ * Files that StormLib maintains itself.  These are created anew.
+ */
+static bool
+rebuild_is_internal (
+	const char *name)
+{
+	return strcmp (name, LISTFILE_NAME) == 0
+		|| strcmp (name, ATTRIBUTES_NAME) == 0
+		|| strcmp (name, SIGNATURE_NAME) == 0;
+}
+
+/*
+ * Whether `name` is one that StormLib made up (i.e. `File00000000.xxx`) for
+ * a file whose real name is missing from the listfile.  Written under such
+ * a name, the file could no longer be found by its real one.
+ */
+static bool
+rebuild_is_unnamed (
+	HANDLE archive,
+	const char *name)
+{
+	const TMPQArchive *mpq = archive;
+	size_t index = 0;
+	int digits = 0;
+
+	if (strncmp (name, "File", 4) != 0)
+	{
+		return false;
+	}
+
+	for (name = name + 4; isdigit ((unsigned char) *name); name++)
+	{
+		index = index * 10 + (size_t) (*name - '0');
+		digits++;
+	}
+
+	return digits == 8
+		&& *name == '.'
+		&& index < mpq->dwFileTableSize
+		&& mpq->pFileTable [index].szFileName == NULL;
+}
+
+/*
+ * Decides the order in which the collected files are written: those named
+ * in the array at `order` (if any) come first, in that order, followed by
+ * the rest in order of their position.  A name found more than once (i.e.
+ * in more than one locale) is not supported, as workers open files by name.
+ * Nor is a file without a known name (see `rebuild_is_unnamed ()`).
+ */
+static bool
+rebuild_order (
+	lua_State *L,
+	HANDLE archive,
+	struct rebuild *rebuild,
+	const int order)
+{
+	const struct extract *extract = &rebuild->extract;
+	struct build *build = &rebuild->build;
+
+	lua_createtable (L, 0, (int) extract->count);
+	const int lookup = lua_gettop (L);
+
+	for (size_t i = 0; i < extract->count; i++)
+	{
+		const char *name = extract->entries [i].name;
+
+		if (rebuild_is_internal (name))
+		{
+			continue;
+		}
+
+		if (rebuild_is_unnamed (archive, name))
+		{
+			lua_pop (L, 1);
+			SetLastError (ERROR_NOT_SUPPORTED);
+			return false;
+		}
+
+		lua_getfield (L, lookup, name);
+
+		if (!lua_isnil (L, -1))
+		{
+			lua_pop (L, 2);
+			SetLastError (ERROR_NOT_SUPPORTED);
+			return false;
+		}
+
+		lua_pop (L, 1);
+		lua_pushinteger (L, (lua_Integer) i);
+		lua_setfield (L, lookup, name);
+	}
+
+	const lua_Integer count = lua_isnil (L, order)
+		? 0
+		: luaL_len (L, order);
+
+	for (lua_Integer i = 1; i <= count; i++)
+	{
+		lua_rawgeti (L, order, i);
+
+		if (lua_type (L, -1) != LUA_TSTRING)
+		{
+			luaL_error (L,
+				"bad order entry #%d (string expected)", (int) i);
+		}
+
+		lua_pushvalue (L, -1);
+		lua_rawget (L, lookup);
+
+		/* Each file is placed once.  Unknown names are ignored. */
+		if (lua_type (L, -1) == LUA_TNUMBER)
+		{
+			const size_t index = (size_t) lua_tointeger (L, -1);
+			build->entries [build->count++].name =
+				extract->entries [index].name;
+
+			lua_pop (L, 1);
+			lua_pushboolean (L, false);
+			lua_rawset (L, lookup);
+		}
+		else
+		{
+			lua_pop (L, 2);
+		}
+	}
+
+	for (size_t i = 0; i < extract->count; i++)
+	{
+		lua_getfield (L, lookup, extract->entries [i].name);
+
+		if (lua_type (L, -1) == LUA_TNUMBER)
+		{
+			build->entries [build->count++].name =
+				extract->entries [i].name;
+		}
+
+		lua_pop (L, 1);
+	}
+
+	lua_pop (L, 1);
+	return true;
+}
+
+/*
+ * Creates the new archive, as the temporary file.  It has the format and
+ * sector size of `archive`, such that blocks can be copied as they are, and
+ * the same attributes.
+ */
+static bool
+rebuild_create (
+	HANDLE archive,
+	struct rebuild *rebuild)
+{
+	const TMPQArchive *source = archive;
+	const DWORD attributes = SFileGetAttributes (archive);
+	const DWORD needed = (DWORD) rebuild->build.count + 3;
+	SFILE_CREATE_MPQ info;
+	DWORD limit = 0;
+
+	if (!SFileGetFileInfo (archive, SFileMpqMaxFileCount,
+			&limit, sizeof (limit), NULL))
+	{
+		return false;
+	}
+
+	memset (&info, 0, sizeof (info));
+	info.cbSize = sizeof (info);
+	info.dwMpqVersion = source->pHeader->wFormatVersion;
+	info.dwFileFlags1 = MPQ_FILE_DEFAULT_INTERNAL;
+
+	if (attributes != 0 && attributes != SFILE_INVALID_ATTRIBUTES)
+	{
+		info.dwFileFlags2 = MPQ_FILE_DEFAULT_INTERNAL;
+		info.dwAttrFlags = attributes;
+	}
+
+	info.dwSectorSize = source->dwSectorSize;
+	info.dwRawChunkSize = source->pHeader->dwRawChunkSize;
+	info.dwMaxFileCount = limit > needed ? limit : needed;
+	rebuild->build.sector = info.dwSectorSize;
+
+	remove (rebuild->temporary);
+	return SFileCreateArchive2 (
+		rebuild->temporary, &info, &rebuild->build.archive);
+}
+
+/*
+ * Pushes a rebuild job for `archive`, which is yet to be started (see
+ * `rebuild->threads`).  Arguments begin at `first`: the path, and an
+ * optional table of options.  Returns `NULL` on failure, with the error
+ * set.
+ */
+static struct job *
+rebuild_all (
+	lua_State *L,
+	HANDLE archive,
+	const int first)
+{
+	const char *path = luaL_checkstring (L, first);
+	const int options = first + 1;
+
+	if (!lua_isnoneornil (L, options))
+	{
+		luaL_checktype (L, options, LUA_TTABLE);
+	}
+
+	const lua_Integer threads = option_integer (L, options, "threads", 0);
+	luaL_argcheck (L, threads >= 0, options,
+		"threads must be non-negative");
+	const lua_Integer compression = option_integer (
+		L, options, "compression", 0);
+	lua_settop (L, options);
+
+	/* The order is left at `options + 1`. */
+	if (lua_isnil (L, options))
+	{
+		lua_pushnil (L);
+	}
+	else
+	{
+		lua_getfield (L, options, "order");
+
+		if (!lua_isnil (L, -1) && !lua_istable (L, -1))
+		{
+			luaL_error (L, "bad argument for 'order' (%s expected, got %s)",
+				lua_typename (L, LUA_TTABLE), luaL_typename (L, -1));
+		}
+	}
+
+	struct rebuild *rebuild = calloc (1, sizeof (*rebuild));
+
+	if (rebuild == NULL)
+	{
+		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+		return NULL;
+	}
+
+	lock_initialize (&rebuild->build.lock);
+	struct job *job = job_initialize (L, &rebuild_type, rebuild);
+	struct extract *extract = &rebuild->extract;
+	const size_t length = strlen (path);
+	DWORD size = 0;
+
+	rebuild->compression = (DWORD) compression;
+	rebuild->threads = threads > 0 ? (size_t) threads : thread_count ();
+	rebuild->target = copy_string (path);
+	rebuild->temporary = malloc (length + sizeof (".rebuild"));
+
+	SFileGetFileInfo (archive, SFileMpqFileName, NULL, 0, &size);
+	extract->path = size > 0 ? malloc (size) : NULL;
+	extract->archives = calloc (
+		rebuild->threads, sizeof (*extract->archives));
+
+	if (rebuild->target == NULL
+		|| rebuild->temporary == NULL
+		|| extract->path == NULL
+		|| extract->archives == NULL)
+	{
+		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+		return NULL;
+	}
+
+	memcpy (rebuild->temporary, path, length);
+	memcpy (rebuild->temporary + length, ".rebuild", sizeof (".rebuild"));
+
+	/* Workers read what is on disk, which must match what is collected. */
+	lua_pushnil (L);
+
+	if (!SFileFlushArchive (archive)
+		|| !SFileGetFileInfo (archive, SFileMpqFileName,
+			extract->path, size, NULL)
+		|| !extract_collect (L, archive, extract, lua_gettop (L)))
+	{
+		return NULL;
+	}
+
+	lua_pop (L, 1);
+	qsort (extract->entries, extract->count,
+		sizeof (*extract->entries), extract_compare);
+
+	rebuild->build.entries = calloc (extract->count > 0
+		? extract->count
+		: 1, sizeof (*rebuild->build.entries));
+
+	if (rebuild->build.entries == NULL)
+	{
+		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+		return NULL;
+	}
+
+	if (!rebuild_order (L, archive, rebuild, options + 1)
+		|| !rebuild_create (archive, rebuild))
+	{
+		return NULL;
+	}
+
+	return job;
+}
+
+/**
+ * `SFileRebuildArchive (archive, path [, options])`
+ *
+ * Compacts `archive` by rebuilding it into a new archive at `path`.  Live
+ * files are read on a pool of workers, each with its own handle on the
+ * archive, and their blocks are copied as they are stored.  The options
+ * are as follows:
+ *
+ * - `threads`: The number of workers (by default, one per processor).
+ * - `compression`: Recompresses compressed files with this, rather than
+ *   copying them as they are.
+ * - `order`: An array of names, which are written first, in that order.
+ *   The rest follow in order of their position within the archive.
+ *
+ * Files whose encryption key depends upon their position are always
+ * recompressed (with zlib, by default).  Every file must be known by name
+ * (see `SFileAddListFile ()`), or the rebuild fails rather than rename it.
+ * The new archive is written next to `path` and then moved into place,
+ * such that `path` may be that of the archive itself (except on Windows,
+ * where the archive must be closed by then).  Returns a job.  Until the
+ * job has finished, the archive is busy, and using it is an error.
+ */
+static int
+archive_rebuild (
+	lua_State *L)
+{
+	HANDLE archive = to_archive (L);
+	lua_settop (L, 3);
+
+	struct job *job = rebuild_all (L, archive, 2);
+
+	if (job == NULL)
+	{
+		return to_error (L);
+	}
+
+	/* The job anchors the archive, which is busy for as long as it runs. */
+	job_attach (job, to_object (L, 1));
+	lua_pushvalue (L, 1);
+	lua_rawsetp (L, LUA_REGISTRYINDEX, job);
+
+	const struct rebuild *rebuild = job->context;
+
+	if (!job_start (job, rebuild->build.count, rebuild->threads))
+	{
+		return to_error (L);
+	}
+
+	return 1;
+}
+
+/*
+ * Synchronizing with a directory.  Each file beneath the directory is
+ * compared with the file of the same name in the archive, and only those
+ * that differ are written (through a build, as with `build_all ()`).  A
+ * file whose size and time match is not read at all.  Otherwise, should
+ * the sizes match and the archive hold the CRC32 of the file, the worker
+ * that loads it compares the two, and leaves the file as is on a match.
+ *
+ * The build must remain the first member, as `build_free ()` is shared.
+ */
+struct sync
+{
+	struct build build;
+	bool *unchanged;
+	size_t capacity;
+	DWORD attributes;
+	DWORD compression;
+};
+
+static void
+sync_free (
+	void *context)
+{
+	struct sync *sync = context;
+	struct build *build = &sync->build;
+
+	/* The outcome of each entry is kept by the Lua state. */
+	if (sync->unchanged)
+	{
+		for (size_t i = 0; i < build->count; i++)
+		{
+			sync->unchanged [i] = build->entries [i].unchanged;
+		}
+	}
+
+	/* This releases `sync` itself. */
+	build_free (build);
+}
+
+static const struct job_type
+sync_type =
+{
+	NULL,
+	build_run,
+	NULL,
+	NULL,
+	sync_free
+};
+
+/*
+ * Pushes `name` in upper case, with forward slashes turned into
+ * backslashes, as StormLib compares names.
+ */
+static void
+sync_key (
+	lua_State *L,
+	const char *name)
+{
+	luaL_Buffer buffer;
+	luaL_buffinit (L, &buffer);
+
+	for (const char *c = name; *c; c++)
+	{
+		luaL_addchar (&buffer, *c == '/'
+			? '\\'
+			: (char) toupper ((unsigned char) *c));
+	}
+
+	luaL_pushresult (&buffer);
+}
+
+/*
+ * Pushes a table that maps the key (see `sync_key ()`) of each file in the
+ * archive to its index within the file table, and that index to its name.
+ * Files of other locales, and those StormLib maintains, are left out.
+ */
+static bool
+sync_lookup (
+	lua_State *L,
+	HANDLE archive)
+{
+	SFILE_FIND_DATA data;
+	HANDLE finder = SFileFindFirstFile (archive, "*", &data, NULL);
+	lua_newtable (L);
+
+	if (finder == NULL)
+	{
+		return GetLastError () == ERROR_NO_MORE_FILES;
+	}
+
+	do
+	{
+		if (data.lcLocale != 0 || rebuild_is_internal (data.cFileName))
+		{
+			continue;
+		}
+
+		sync_key (L, data.cFileName);
+		lua_pushinteger (L, data.dwBlockIndex);
+		lua_rawset (L, -3);
+		lua_pushstring (L, data.cFileName);
+		lua_rawseti (L, -2, data.dwBlockIndex);
+	}
+	while (SFileFindNextFile (finder, &data));
+
+	const DWORD error = GetLastError ();
+	SFileFindClose (finder);
+	SetLastError (error);
+	return error == ERROR_NO_MORE_FILES;
+}
+
+/*
+ * Compares the file at `path`, which is `name` within the archive, with
+ * its counterpart (if any), and adds it to the build should they differ.
+ * The lookup (see `sync_lookup ()`) is at `lookup`, followed by the array
+ * of added names, and the names of existing files by entry.
+ */
+static bool
+sync_compare (
+	lua_State *L,
+	struct sync *sync,
+	const int lookup,
+	const char *path,
+	const char *name,
+	const ULONGLONG size,
+	const ULONGLONG time)
+{
+	struct build *build = &sync->build;
+	const TMPQArchive *mpq = build->archive;
+	const TFileEntry *file = NULL;
+
+	sync_key (L, name);
+	lua_pushvalue (L, -1);
+	lua_rawget (L, lookup);
+
+	if (lua_type (L, -1) == LUA_TNUMBER)
+	{
+		file = &mpq->pFileTable [lua_tointeger (L, -1)];
+
+		/* Whatever is left once the walk is done gets removed. */
+		lua_pop (L, 1);
+		lua_pushboolean (L, false);
+		lua_rawset (L, lookup);
+	}
+	else
+	{
+		lua_pop (L, 2);
+	}
+
+	if (file && file->dwFileSize == size && file->FileTime == time)
+	{
+		return true;
+	}
+
+	if (build->count == sync->capacity)
+	{
+		const size_t capacity = sync->capacity > 0
+			? sync->capacity * 2
+			: 64;
+		struct build_entry *entries = realloc (
+			build->entries, capacity * sizeof (*entries));
+
+		if (entries == NULL)
+		{
+			SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+			return false;
+		}
+
+		build->entries = entries;
+		sync->capacity = capacity;
+	}
+
+	struct build_entry *entry = &build->entries [build->count++];
+	memset (entry, 0, sizeof (*entry));
+	entry->name = copy_string (name);
+	entry->path = copy_string (path);
+
+	if (entry->name == NULL || entry->path == NULL)
+	{
+		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+		return false;
+	}
+
+	for (char *c = entry->name; *c; c++)
+	{
+		if (*c == '/')
+		{
+			*c = '\\';
+		}
+	}
+
+	entry->compression = sync->compression;
+	entry->time = time;
+
+	if (file)
+	{
+		entry->verify = file->dwFileSize == size
+			&& sync->attributes & MPQ_ATTRIBUTE_CRC32;
+		entry->crc = file->dwCrc32;
+		entry->index = (DWORD) (file - mpq->pFileTable);
+		lua_pushstring (L, entry->name);
+		lua_rawseti (L, lookup + 2, (lua_Integer) build->count);
+	}
+	else
+	{
+		lua_pushstring (L, entry->name);
+		lua_rawseti (L, lookup + 1, (lua_Integer) lua_rawlen (
+			L, lookup + 1) + 1);
+	}
+
+	return true;
+}
+
+static char *
+sync_join (
+	const char *directory,
+	const char *name)
+{
+	const size_t length = strlen (directory);
+	const size_t size = strlen (name) + 1;
+	char *path = malloc (length + 1 + size);
+
+	if (path)
+	{
+		memcpy (path, directory, length);
+		path [length] = '/';
+		memcpy (path + length + 1, name, size);
+	}
+
+	return path;
+}
+
+/*
+ * Compares every file beneath `directory` (see `sync_compare ()`).  Names
+ * within the archive are relative to the first `root` characters.  Links
+ * (i.e. symbolic links, and reparse points on Windows) are skipped, as
+ * they may lead out of the directory, back into it, or nowhere at all.
+ */
+#if defined (_WIN32)
+static bool
+sync_walk (
+	lua_State *L,
+	struct sync *sync,
+	const int lookup,
+	const char *directory,
+	const size_t root)
+{
+	WIN32_FIND_DATAA data;
+	char *pattern = sync_join (directory, "*");
+
+	if (pattern == NULL)
+	{
+		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+		return false;
+	}
+
+	HANDLE finder = FindFirstFileA (pattern, &data);
+	free (pattern);
+
+	if (finder == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	bool status = true;
+
+	do
+	{
+		if (strcmp (data.cFileName, ".") == 0
+			|| strcmp (data.cFileName, "..") == 0
+			|| data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+		{
+			continue;
+		}
+
+		char *path = sync_join (directory, data.cFileName);
+
+		if (path == NULL)
+		{
+			SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+			status = false;
+		}
+		else if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		{
+			status = sync_walk (L, sync, lookup, path, root);
+		}
+		else
+		{
+			status = sync_compare (L, sync, lookup, path,
+				path + root + 1,
+				((ULONGLONG) data.nFileSizeHigh << 32)
+					| data.nFileSizeLow,
+				((ULONGLONG) data.ftLastWriteTime.dwHighDateTime << 32)
+					| data.ftLastWriteTime.dwLowDateTime);
+		}
+
+		free (path);
+	}
+	while (status && FindNextFileA (finder, &data));
+
+	const DWORD error = status ? GetLastError () : ERROR_SUCCESS;
+	FindClose (finder);
+
+	if (status && error != ERROR_NO_MORE_FILES)
+	{
+		SetLastError (error);
+		status = false;
+	}
+
+	return status;
+}
+#else
+static bool
+sync_walk (
+	lua_State *L,
+	struct sync *sync,
+	const int lookup,
+	const char *directory,
+	const size_t root)
+{
+	DIR *handle = opendir (directory);
+
+	if (handle == NULL)
+	{
+		SetLastError (errno);
+		return false;
+	}
+
+	bool status = true;
+
+	while (status)
+	{
+		errno = 0;
+		const struct dirent *item = readdir (handle);
+
+		if (item == NULL)
+		{
+			if (errno != 0)
+			{
+				SetLastError (errno);
+				status = false;
+			}
+
+			break;
+		}
+
+		if (strcmp (item->d_name, ".") == 0
+			|| strcmp (item->d_name, "..") == 0)
+		{
+			continue;
+		}
+
+		char *path = sync_join (directory, item->d_name);
+		struct stat info;
+
+		if (path == NULL)
+		{
+			SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+			status = false;
+		}
+		else if (lstat (path, &info) != 0)
+		{
+			SetLastError (errno);
+			status = false;
+		}
+		else if (S_ISDIR (info.st_mode))
+		{
+			status = sync_walk (L, sync, lookup, path, root);
+		}
+		else if (S_ISREG (info.st_mode))
+		{
+			/* As StormLib does, the time is kept to the second. */
+			status = sync_compare (L, sync, lookup, path,
+				path + root + 1, (ULONGLONG) info.st_size,
+				((ULONGLONG) info.st_mtime + 11644473600ULL)
+					* 10000000ULL);
+		}
+
+		free (path);
+	}
+
+	closedir (handle);
+	return status;
+}
+#endif
+
+/*
+ * Removes every file left in the lookup at `lookup`, after pushing an
+ * array of their names.
+ */
+static bool
+sync_remove (
+	lua_State *L,
+	HANDLE archive,
+	const int lookup)
+{
+	lua_newtable (L);
+	const int removed = lua_gettop (L);
+	int count = 0;
+
+	lua_pushnil (L);
+
+	while (lua_next (L, lookup))
+	{
+		if (lua_type (L, -2) == LUA_TSTRING
+			&& lua_type (L, -1) == LUA_TNUMBER)
+		{
+			lua_rawget (L, lookup);
+			lua_rawseti (L, removed, ++count);
+		}
+		else
+		{
+			lua_pop (L, 1);
+		}
+	}
+
+	for (int i = 1; i <= count; i++)
+	{
+		lua_rawgeti (L, removed, i);
+		const bool status = SFileRemoveFile (
+			archive, lua_tostring (L, -1), 0);
+		lua_pop (L, 1);
+
+		if (!status)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Returns the share of the archive that is taken by neither its header,
+ * its tables, nor the blocks of its files.  This is what compaction would
+ * reclaim.
+ */
+static double
+sync_unused (
+	HANDLE archive)
+{
+	const TMPQArchive *mpq = archive;
+	const TMPQHeader *header = mpq->pHeader;
+	const ULONGLONG size = header->ArchiveSize64;
+	ULONGLONG used = header->dwHeaderSize
+		+ header->HashTableSize64
+		+ header->BlockTableSize64
+		+ header->HiBlockTableSize64
+		+ header->HetTableSize64
+		+ header->BetTableSize64;
+
+	for (DWORD i = 0; i < mpq->dwFileTableSize; i++)
+	{
+		if (mpq->pFileTable [i].dwFlags & MPQ_FILE_EXISTS)
+		{
+			used = used + mpq->pFileTable [i].dwCmpSize;
+		}
+	}
+
+	return size > used ? (double) (size - used) / (double) size : 0;
+}
+
+/*
+ * Synchronizes `archive` with a directory, and pushes a table of what
+ * changed.  Arguments begin at `first`: the directory, and an optional
+ * table of options.  Returns `false` on failure, with the error set.
+ */
+static bool
+sync_all (
+	lua_State *L,
+	HANDLE archive,
+	const int first)
+{
+	const char *directory = luaL_checkstring (L, first);
+	const int options = first + 1;
+
+	if (!lua_isnoneornil (L, options))
+	{
+		luaL_checktype (L, options, LUA_TTABLE);
+	}
+
+	const lua_Integer threads = option_integer (L, options, "threads", 0);
+	luaL_argcheck (L, threads >= 0, options,
+		"threads must be non-negative");
+	const lua_Integer compression = option_integer (
+		L, options, "compression", MPQ_COMPRESSION_ZLIB);
+	const lua_Number threshold = option_number (L, options, "compact", -1);
+	lua_settop (L, options);
+
+	struct sync *sync = calloc (1, sizeof (*sync));
+
+	if (sync == NULL)
+	{
+		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+		return false;
+	}
+
+	lock_initialize (&sync->build.lock);
+	sync->build.archive = archive;
+	sync->compression = (DWORD) compression;
+	sync->attributes = SFileGetAttributes (archive);
+	struct job *job = job_initialize (L, &sync_type, sync);
+
+	if (sync->attributes == SFILE_INVALID_ATTRIBUTES)
+	{
+		sync->attributes = 0;
+	}
+
+	if (!SFileGetFileInfo (archive, SFileMpqSectorSize,
+			&sync->build.sector, sizeof (sync->build.sector), NULL)
+		|| !sync_lookup (L, archive))
+	{
+		return false;
+	}
+
+	const int lookup = lua_gettop (L);
+	lua_newtable (L);
+	lua_newtable (L);
+
+	if (!sync_walk (L, sync, lookup, directory, strlen (directory))
+		|| !sync_remove (L, archive, lookup))
+	{
+		return false;
+	}
+
+	const size_t count = sync->build.count;
+
+	if (!build_reserve (archive, count))
+	{
+		return false;
+	}
+
+	/* Joined either way, as the outcome is written into the Lua state. */
+	sync->unchanged = lua_newuserdata (L, count > 0 ? count : 1);
+	const bool started = job_start (job, count,
+		threads > 0 ? (size_t) threads : thread_count ());
+	DWORD error = GetLastError ();
+	job_join (job);
+
+	if (started)
+	{
+		error = job->error;
+	}
+
+	if (error != ERROR_SUCCESS)
+	{
+		SetLastError (error);
+		return false;
+	}
+
+	bool compacted = false;
+
+	if (threshold >= 0)
+	{
+		if (!SFileFlushArchive (archive))
+		{
+			return false;
+		}
+
+		if (sync_unused (archive) > threshold)
+		{
+			if (!SFileCompactArchive (archive, NULL, false))
+			{
+				return false;
+			}
+
+			compacted = true;
+		}
+	}
+
+	/* The result, with the arrays of added, and of removed, names. */
+	const bool *unchanged = lua_touserdata (L, lookup + 4);
+	lua_createtable (L, 0, 4);
+	lua_pushvalue (L, lookup + 1);
+	lua_setfield (L, -2, "added");
+	lua_pushvalue (L, lookup + 3);
+	lua_setfield (L, -2, "removed");
+	lua_pushboolean (L, compacted);
+	lua_setfield (L, -2, "compacted");
+	lua_newtable (L);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		lua_rawgeti (L, lookup + 2, (lua_Integer) i + 1);
+
+		if (lua_isnil (L, -1) || unchanged [i])
+		{
+			lua_pop (L, 1);
+		}
+		else
+		{
+			lua_rawseti (L, -2, (lua_Integer) lua_rawlen (L, -2) + 1);
+		}
+	}
+
+	lua_setfield (L, -2, "modified");
+	return true;
+}
+
+/**
+ * `SFileSyncArchive (archive, directory [, options])`
+ *
+ * Brings `archive` in line with `directory`, such that it holds a file for
+ * each file beneath the directory (named by its relative path), and
+ * nothing else.  Only files that were added or changed are written, and
+ * files that no longer exist are removed.  A file is unchanged if its
+ * size and time match those stored by the archive, or, failing that, if
+ * its size and CRC32 do (in which case, the stored time is brought up to
+ * date).  Both depend upon the `(attributes)` of the archive (see
+ * `SFileGetAttributes ()`).  The options are as follows:
+ *
+ * - `threads`: The number of workers that load, check, and compress files
+ *   (by default, one per processor).
+ * - `compression`: Defaults to `MPQ_COMPRESSION_ZLIB`.  Zero stores files
+ *   as they are.
+ * - `compact`: Once synchronized, the archive is compacted if more than
+ *   this share of it (from zero to one) is unused.  By default, it is
+ *   never compacted.
+ *
+ * Files of other locales, and those StormLib maintains itself (e.g. the
+ * listfile), are left alone.  Returns a table with arrays of the names
+ * that were `added`, `modified`, and `removed`, and whether the archive
+ * was `compacted`.
+ */
+static int
+archive_sync (
+	lua_State *L)
+{
+	HANDLE archive = to_archive (L);
+	lua_settop (L, 3);
+
+	if (!sync_all (L, archive, 2))
+	{
+		return to_error (L);
+	}
+
+	return 1;
+}
+
+/*
+ * The following implements the Lua API, which mirrors the Lua I/O library.
+ * An archive keeps a list of its open files, such that they can be written
+ * back (and closed) along with it.
+ */
+#define STORMLIB_ARCHIVE_METATABLE "StormLib Archive"
+#define STORMLIB_FILE_METATABLE "StormLib File"
+
+/*
+ * Archives opened read-only are mapped into memory once they reach this
+ * many bytes.
+ */
+#define STORMLIB_MAP_THRESHOLD (64 * 1024 * 1024)
+
+/*
+ * A minimal abstraction over read-only file mappings.  The mapping outlives
+ * the handle (or descriptor) used to create it.
+ */
+#if defined (_WIN32)
+static bool
+map_size (
+	const char *path,
+	ULONGLONG *size)
+{
+	WIN32_FILE_ATTRIBUTE_DATA data;
+
+	if (!GetFileAttributesExA (path, GetFileExInfoStandard, &data))
+	{
+		return false;
+	}
+
+	*size = ((ULONGLONG) data.nFileSizeHigh << 32) | data.nFileSizeLow;
+	return true;
+}
+
+static bool
+map_open (
+	const char *path,
+	char **data,
+	size_t *size)
+{
+	LARGE_INTEGER length;
+	HANDLE file = CreateFileA (path, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	if (!GetFileSizeEx (file, &length))
+	{
+		CloseHandle (file);
+		return false;
+	}
+
+	if ((ULONGLONG) length.QuadPart > SIZE_MAX)
+	{
+		CloseHandle (file);
+		SetLastError (ERROR_NOT_SUPPORTED);
+		return false;
+	}
+
+	HANDLE mapping = CreateFileMappingA (
+		file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle (file);
+
+	if (mapping == NULL)
+	{
+		return false;
+	}
+
+	*data = MapViewOfFile (mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle (mapping);
+
+	if (*data == NULL)
+	{
+		return false;
+	}
+
+	*size = (size_t) length.QuadPart;
+	return true;
+}
+
+static void
+map_close (
+	char *data,
+	size_t size)
+{
+	UnmapViewOfFile (data);
+}
+#else
+static bool
+map_size (
+	const char *path,
+	ULONGLONG *size)
+{
+	struct stat status;
+
+	if (stat (path, &status) != 0)
+	{
+		SetLastError (errno);
+		return false;
+	}
+
+	*size = (ULONGLONG) status.st_size;
+	return true;
+}
+
+static bool
+map_open (
+	const char *path,
+	char **data,
+	size_t *size)
+{
+	struct stat status;
+	const int descriptor = open (path, O_RDONLY);
+
+	if (descriptor == -1)
+	{
+		SetLastError (errno);
+		return false;
+	}
+
+	if (fstat (descriptor, &status) != 0)
+	{
+		SetLastError (errno);
+		close (descriptor);
+		return false;
+	}
+
+	if (status.st_size <= 0 || (uintmax_t) status.st_size > SIZE_MAX)
+	{
+		close (descriptor);
+		SetLastError (ERROR_NOT_SUPPORTED);
+		return false;
+	}
+
+	void *mapping = mmap (NULL, (size_t) status.st_size,
+		PROT_READ, MAP_SHARED, descriptor, 0);
+	close (descriptor);
+
+	if (mapping == MAP_FAILED)
+	{
+		SetLastError (errno);
+		return false;
+	}
+
+	*data = mapping;
+	*size = (size_t) status.st_size;
+	return true;
+}
+
+static void
+map_close (
+	char *data,
+	size_t size)
+{
+	munmap (data, size);
+}
+#endif
+
+struct io_file;
+
+/*
+ * How the compression of a file is decided, as it is written back.  Tables
+ * and functions are anchored in the registry, keyed by `&policy`.
+ */
+enum io_policy
+{
+	IO_POLICY_DEFAULT,
+	IO_POLICY_FIXED,
+	IO_POLICY_TABLE,
+	IO_POLICY_FUNCTION
+};
+
+/*
+ * The number of files, and the limit, are cached.  They are only queried
+ * again once `synced` is cleared (e.g. after changes made behind the back
+ * of the archive).
+ *
+ * A read-only archive may also be mapped into memory, as `view`.  Files
+ * stored as is are then read straight out of the mapping.  The archive
+ * itself begins at `view_offset` (i.e. past any data that precedes the
+ * header).
+ */
+struct io_archive
+{
+	struct object *object;
+	struct io_file *files;
+	size_t buffer_limit;
+	size_t growth;
+	DWORD count;
+	DWORD limit;
+	char *view;
+	size_t view_size;
+	ULONGLONG view_offset;
+	enum io_policy policy;
+	DWORD compression;
+	bool synced;
+	bool writable;
+};
+
+/*
+ * The buffer must remain the first member, as the buffer functions (e.g.
+ * `buffer_lines_helper ()`) rely upon it.
+ */
+struct io_file
+{
+	struct buffer buffer;
+	struct io_archive *archive;
+	struct io_file *previous;
+	struct io_file *next;
+	char *name;
+	bool readable;
+	bool writable;
+	bool append;
+	bool existed;
+	bool removed;
+	bool modified;
+	bool truncated;
+	bool hashed;
+	uint32_t crc;
+};
+
+/*
+ * Mimics `assert ()`, in that the error message is raised as is.
+ */
+static int
+raise_error (
+	lua_State *L)
+{
+	lua_pushstring (L, strerror ((int) GetLastError ()));
+	return lua_error (L);
+}
+
+static struct io_archive *
+to_io_archive (
+	lua_State *L,
+	const int index)
+{
+	struct io_archive *archive = luaL_checkudata (
+		L, index, STORMLIB_ARCHIVE_METATABLE);
+
+	if (archive->object == NULL)
+	{
+		luaL_error (L, "attempt to use a closed archive");
+	}
+
+	if (archive->object->job && job_is_running (archive->object->job))
+	{
+		luaL_error (L, "attempt to use a busy archive");
+	}
+
+	return archive;
+}
+
+static struct io_file *
+to_io_file (
+	lua_State *L,
+	const int index)
+{
+	struct io_file *file = luaL_checkudata (
+		L, index, STORMLIB_FILE_METATABLE);
+
+	if (file->archive == NULL)
+	{
+		luaL_error (L, "attempt to use a closed file");
+	}
+
+	if (file->archive->object->job
+		&& job_is_running (file->archive->object->job))
+	{
+		luaL_error (L, "attempt to use a busy archive");
+	}
+
+	return file;
+}
+
+static bool
+io_archive_has (
+	lua_State *L,
+	HANDLE archive,
+	const char *name)
+{
+	if (SFileHasFile (archive, name))
+	{
+		return true;
+	}
+
+	if (GetLastError () != ERROR_FILE_NOT_FOUND)
+	{
+		raise_error (L);
+	}
+
+	return false;
+}
+
+/*
+ * Longest extension considered by the compression policy.
+ */
+#define STORMLIB_EXTENSION_MAX 15
+
+/*
+ * Extensions of files whose contents are compressed already, and so are
+ * stored as is by the default policy.  Kept sorted.
+ */
+static const char *const
+io_stored_extensions [] =
+{
+	"7z",
+	"bik",
+	"bz2",
+	"flac",
+	"gif",
+	"gz",
+	"jpeg",
+	"jpg",
+	"mp3",
+	"mp4",
+	"mpq",
+	"ogg",
+	"png",
+	"w3m",
+	"w3x",
+	"webm",
+	"webp",
+	"xz",
+	"zip"
+};
+
+/*
+ * Writes the extension of `name`, in lowercase and without the dot, to
+ * `extension`.  Names without an extension (or with one that is too long)
+ * produce an empty string.
+ */
+static void
+io_extension (
+	const char *name,
+	char *extension)
+{
+	const char *dot = strrchr (name, '.');
+	size_t length = 0;
+
+	*extension = '\0';
+
+	if (dot == NULL || strpbrk (dot, "\\/") != NULL
+		|| strlen (dot + 1) > STORMLIB_EXTENSION_MAX)
+	{
+		return;
+	}
+
+	for (dot++; *dot != '\0'; dot++)
+	{
+		extension [length++] = (char) tolower ((unsigned char) *dot);
+	}
+
+	extension [length] = '\0';
+}
+
+static int
+io_extension_compare (
+	const void *key,
+	const void *element)
+{
+	return strcmp (key, *(const char *const *) element);
+}
+
+/*
+ * Files that are compressed already are stored, and everything else uses
+ * zlib.
+ */
+static DWORD
+io_default_compression (
+	const char *extension)
+{
+	const size_t count = sizeof (io_stored_extensions)
+		/ sizeof (*io_stored_extensions);
+
+	return bsearch (extension, io_stored_extensions, count,
+			sizeof (*io_stored_extensions), io_extension_compare)
+		? 0
+		: MPQ_COMPRESSION_ZLIB;
+}
+
+/*
+ * Decides the compression of `file`, as per the policy of the archive:
+ *
+ * - A number is used for every file.
+ * - A table maps extensions (in lowercase, without the dot) to
+ *   compressions, falling back to its `default` field.
+ * - A function is called with the name and size of the file.
+ *
+ * Anything that yields `nil` falls back to the default policy.  On
+ * failure, an error message is left on the stack.
+ */
+static bool
+io_archive_compression (
+	lua_State *L,
+	const struct io_archive *archive,
+	const struct io_file *file,
+	DWORD *compression)
+{
+	char extension [STORMLIB_EXTENSION_MAX + 1];
+	int pushed = 1;
+
+	io_extension (file->name, extension);
+	*compression = io_default_compression (extension);
+
+	switch (archive->policy)
+	{
+		case IO_POLICY_DEFAULT:
+		{
+			return true;
+		}
+
+		case IO_POLICY_FIXED:
+		{
+			*compression = archive->compression;
+			return true;
+		}
+
+		case IO_POLICY_TABLE:
+		{
+			lua_rawgetp (L, LUA_REGISTRYINDEX, &archive->policy);
+			lua_getfield (L, -1, extension);
+
+			if (lua_isnil (L, -1))
+			{
+				lua_pop (L, 1);
+				lua_getfield (L, -1, "default");
+			}
+
+			pushed = 2;
+			break;
+		}
+
+		case IO_POLICY_FUNCTION:
+		{
+			lua_rawgetp (L, LUA_REGISTRYINDEX, &archive->policy);
+			lua_pushstring (L, file->name);
+			lua_pushinteger (L, (lua_Integer) file->buffer.size);
+
+			if (lua_pcall (L, 2, 1, 0) != LUA_OK)
+			{
+				return false;
+			}
+
+			break;
+		}
+	}
+
+	if (!lua_isnil (L, -1) && !lua_isinteger (L, -1))
+	{
+		lua_pop (L, pushed);
+		lua_pushfstring (L, "bad compression for '%s' (integer expected)",
+			file->name);
+		return false;
+	}
+
+	if (!lua_isnil (L, -1))
+	{
+		*compression = (DWORD) lua_tointeger (L, -1);
+	}
+
+	lua_pop (L, pushed);
+	return true;
+}
+
+/*
+ * Ensures there is room for `extra` more files, growing the limit as per
+ * the growth policy of the archive.
+ */
+static bool
+io_archive_grow (
+	struct io_archive *archive,
+	const size_t extra)
+{
+	HANDLE handle = archive->object->handle;
+
+	if (!archive->synced)
+	{
+		if (!SFileGetFileInfo (handle, SFileMpqNumberOfFiles,
+				&archive->count, sizeof (archive->count), NULL)
+			|| !SFileGetFileInfo (handle, SFileMpqMaxFileCount,
+				&archive->limit, sizeof (archive->limit), NULL))
+		{
+			return false;
+		}
+
+		archive->synced = true;
+	}
+
+	/*
+	 * Unless flushed, certain files (i.e. the listfile, attributes, and
+	 * signature) do not appear in the count.  Err on the side of caution.
+	 */
+	return grow_limit (handle, &archive->limit,
+		archive->count + extra + 3, archive->growth);
+}
+
+/*
+ * Writes the contents of `file` into the archive, replacing any existing
+ * file.  The buffer is written in pieces, so that a spilled buffer does not
+ * have to be loaded into memory all at once.
+ */
+static bool
+io_archive_write (
+	struct io_archive *archive,
+	struct io_file *file,
+	const DWORD compression)
+{
+	HANDLE handle = archive->object->handle;
+	struct buffer *buffer = &file->buffer;
+	HANDLE writer = NULL;
+
+	if (!io_archive_grow (archive, 0))
+	{
+		return false;
+	}
+
+	const DWORD flags = MPQ_FILE_REPLACEEXISTING
+		| (compression != 0 ? MPQ_FILE_COMPRESS : 0);
+
+	if (!SFileCreateFile (handle, file->name, 0, (DWORD) buffer->size, 0,
+			flags, &writer))
+	{
+		return false;
+	}
+
+	const char *bytes = NULL;
+	size_t available = 0;
+	bool status = true;
+	buffer->position = 0;
+
+	while (status && (bytes = buffer_peek (buffer, &available)))
+	{
+		status = SFileWriteFile (writer, bytes, (DWORD) available,
+			compression);
+		buffer_skip (buffer, available);
+	}
+
+	if (status && !buffer->failed)
+	{
+		if (!SFileFinishFile (writer))
+		{
+			return false;
+		}
+
+		if (!file->existed)
+		{
+			archive->count++;
+			file->existed = true;
+		}
+
+		return true;
+	}
+
+	const DWORD error = GetLastError ();
+	SFileFinishFile (writer);
+	SetLastError (error);
+	return false;
+}
+
+/*
+ * Loads the existing contents of `file` from the archive.
+ */
+static bool
+io_archive_read (
+	struct io_archive *archive,
+	struct io_file *file)
+{
+	HANDLE handle = archive->object->handle;
+	struct buffer *buffer = &file->buffer;
+	HANDLE reader = NULL;
+
+	if (!SFileOpenFileEx (handle, file->name, SFILE_OPEN_FROM_MPQ, &reader))
+	{
+		return false;
+	}
+
+	const DWORD size = SFileGetFileSize (reader, NULL);
+	char *chunk = NULL;
+	bool status = size != SFILE_INVALID_SIZE;
+
+	/* Read in place, unless the file is going to spill anyways. */
+	if (status && size <= buffer->limit)
+	{
+		DWORD read = 0;
+		status = buffer_reserve (buffer, size)
+			&& (SFileReadFile (reader, buffer->data, size, &read, NULL)
+				|| GetLastError () == ERROR_HANDLE_EOF);
+		buffer->size = read;
+		file->crc = crc32_update (0, buffer->data, read);
+	}
+	else if (status)
+	{
+		chunk = malloc (STORMLIB_BUFFER_WINDOW);
+		status = chunk != NULL;
+
+		if (!status)
+		{
+			SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+		}
+
+		while (status)
+		{
+			DWORD read = 0;
+
+			if (!SFileReadFile (reader, chunk, STORMLIB_BUFFER_WINDOW,
+					&read, NULL)
+				&& GetLastError () != ERROR_HANDLE_EOF)
+			{
+				status = false;
+			}
+			else if (read == 0)
+			{
+				break;
+			}
+			else
+			{
+				status = buffer_write (buffer, chunk, read);
+				file->crc = crc32_update (file->crc, chunk, read);
+			}
+		}
+	}
+
+	const DWORD error = GetLastError ();
+	free (chunk);
+	SFileCloseFile (reader);
+	SetLastError (error);
+
+	buffer->position = 0;
+	file->hashed = status;
+	return status;
+}
+
+/*
+ * Whether the contents of `file` match what is in the archive.  Sizes are
+ * compared first, then the CRC-32 of the original contents (if known), in
+ * which case a match is taken as is.  Only otherwise are the contents
+ * themselves compared.  Any error counts as a difference.
+ */
+static bool
+io_archive_compare (
+	struct io_archive *archive,
+	struct io_file *file)
+{
+	HANDLE handle = archive->object->handle;
+	struct buffer *buffer = &file->buffer;
+	const char *bytes = NULL;
+	size_t available = 0;
+	HANDLE reader = NULL;
+
+	if (!SFileOpenFileEx (handle, file->name, SFILE_OPEN_FROM_MPQ, &reader))
+	{
+		return false;
+	}
+
+	bool same = SFileGetFileSize (reader, NULL) == buffer->size;
+	buffer->position = 0;
+
+	if (same && file->hashed)
+	{
+		uint32_t crc = 0;
+
+		while ((bytes = buffer_peek (buffer, &available)))
+		{
+			crc = crc32_update (crc, bytes, available);
+			buffer_skip (buffer, available);
+		}
+
+		same = !buffer->failed && crc == file->crc;
+		buffer->failed = false;
+		SFileCloseFile (reader);
+		return same;
+	}
+
+	char *chunk = malloc (STORMLIB_BUFFER_WINDOW);
+	same = same && chunk != NULL;
+
+	while (same && (bytes = buffer_peek (buffer, &available)))
+	{
+		DWORD read = 0;
+
+		if (available > STORMLIB_BUFFER_WINDOW)
+		{
+			available = STORMLIB_BUFFER_WINDOW;
+		}
+
+		same = (SFileReadFile (reader, chunk, (DWORD) available, &read,
+				NULL) || GetLastError () == ERROR_HANDLE_EOF)
+			&& read == available
+			&& memcmp (chunk, bytes, available) == 0;
+		buffer_skip (buffer, available);
+	}
+
+	same = same && !buffer->failed;
+	buffer->failed = false;
+	free (chunk);
+	SFileCloseFile (reader);
+	return same;
+}
+
+/*
+ * Whether `file` has to be written back to the archive.  Files that were
+ * not written to (nor truncated) are left alone, as are those whose
+ * contents turn out to be the same.
+ */
+static bool
+io_archive_is_dirty (
+	struct io_archive *archive,
+	struct io_file *file)
+{
+	if (!file->writable || file->removed)
+	{
+		return false;
+	}
+
+	if (!file->existed)
+	{
+		return true;
+	}
+
+	if (!file->modified && !file->truncated)
+	{
+		return false;
+	}
+
+	return !io_archive_compare (archive, file);
+}
+
+static void
+io_archive_link (
+	struct io_archive *archive,
+	struct io_file *file)
+{
+	file->archive = archive;
+	file->previous = NULL;
+	file->next = archive->files;
+
+	if (archive->files)
+	{
+		archive->files->previous = file;
+	}
+
+	archive->files = file;
+}
+
+static void
+io_archive_unlink (
+	struct io_archive *archive,
+	struct io_file *file)
+{
+	if (file->previous)
+	{
+		file->previous->next = file->next;
+	}
+	else
+	{
+		archive->files = file->next;
+	}
+
+	if (file->next)
+	{
+		file->next->previous = file->previous;
+	}
+
+	file->archive = NULL;
+	file->previous = NULL;
+	file->next = NULL;
+}
+
+/*
+ * Closes `file`, writing its contents back to the archive if needed.  The
+ * file is closed regardless.  Returns `false` on failure, with the message
+ * pushed.
+ */
+static bool
+io_file_release (
+	lua_State *L,
+	struct io_file *file)
+{
+	struct io_archive *archive = file->archive;
+	DWORD compression = 0;
+	bool decided = true;
+	bool status = true;
+
+	if (io_archive_is_dirty (archive, file))
+	{
+		decided = io_archive_compression (L, archive, file, &compression);
+		status = decided && io_archive_write (archive, file, compression);
+	}
+
+	const DWORD error = GetLastError ();
+	io_archive_unlink (archive, file);
+	buffer_free (L, &file->buffer);
+	free (file->name);
+	file->name = NULL;
+
+	/* The file no longer keeps the archive alive. */
+	lua_pushnil (L);
+	lua_rawsetp (L, LUA_REGISTRYINDEX, &file->archive);
+
+	/* The message from the policy is still atop the stack. */
+	if (!decided)
+	{
+		return false;
+	}
+
+	if (!status)
+	{
+		lua_pushstring (L, strerror ((int) error));
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * As with `io_file_release ()`, but any error is raised.
+ */
+static void
+io_file_finalize (
+	lua_State *L,
+	struct io_file *file)
+{
+	if (!io_file_release (L, file))
+	{
+		lua_error (L);
+	}
+}
+
+/**
+ * `file:close ()`
+ */
+static int
+io_file_close (
+	lua_State *L)
+{
+	struct io_file *file = to_io_file (L, 1);
+	io_file_finalize (L, file);
+	lua_pushboolean (L, true);
+	return 1;
+}
+
+/**
+ * `file:flush ()`
+ */
+static int
+io_file_flush (
+	lua_State *L)
+{
+	to_io_file (L, 1);
+	lua_pushboolean (L, true);
+	return 1;
+}
+
+/**
+ * `file:lines (...)`
+ */
+static int
+io_file_lines (
+	lua_State *L)
+{
+	const struct io_file *file = to_io_file (L, 1);
+
+	if (!file->readable)
+	{
+		return luaL_error (L, "bad file descriptor");
+	}
+
+	return buffer_lines_helper (L);
+}
+
+/**
+ * `file:read (...)`
+ */
+static int
+io_file_read (
+	lua_State *L)
+{
+	struct io_file *file = to_io_file (L, 1);
+
+	if (!file->readable)
+	{
+		return luaL_error (L, "bad file descriptor");
+	}
+
+	return buffer_read_helper (L, &file->buffer, 2);
+}
+
+/**
+ * `file:seek ([whence [, offset]])`
+ */
+static int
+io_file_seek (
+	lua_State *L)
+{
+	struct io_file *file = to_io_file (L, 1);
+	return buffer_seek_helper (L, &file->buffer);
+}
+
+/**
+ * `file:setvbuf (mode [, size])`
+ *
+ * Accepted for compatibility with the Lua I/O library.  It does nothing.
+ */
+static int
+io_file_setvbuf (
+	lua_State *L)
+{
+	static const char *const modes [] = { "no", "full", "line", NULL };
+
+	to_io_file (L, 1);
+	luaL_checkoption (L, 2, NULL, modes);
+	lua_pushboolean (L, true);
+	return 1;
+}
+
+/**
+ * `file:write (...)`
+ */
+static int
+io_file_write (
+	lua_State *L)
+{
+	struct io_file *file = to_io_file (L, 1);
+
+	if (!file->writable)
+	{
+		return luaL_error (L, "bad file descriptor");
+	}
+
+	if (file->append)
+	{
+		file->buffer.position = file->buffer.size;
+	}
+
+	file->modified = true;
+	return buffer_write_helper (L, &file->buffer);
+}
+
+static int
+io_file_garbage_collect (
+	lua_State *L)
+{
+	struct io_file *file = luaL_checkudata (
+		L, 1, STORMLIB_FILE_METATABLE);
+
+	if (file->archive)
+	{
+		struct job *job = file->archive->object->job;
+
+		/* Whatever runs on the archive has to finish first. */
+		if (job)
+		{
+			job_join (job);
 		}
 
-		case SFileMpqHetTable:
-		{
-			return info_archive (L, class, info_het_table);
-		}
+		io_file_finalize (L, file);
+	}
+
+	return 0;
+}
+
+static int
+io_file_to_string (
+	lua_State *L)
+{
+	const struct io_file *file = luaL_checkudata (
+		L, 1, STORMLIB_FILE_METATABLE);
+	const char *text = file->archive ? "%s (%p)" : "%s (Closed)";
+	lua_pushfstring (L, text, STORMLIB_FILE_METATABLE, file);
+	return 1;
+}
+
+static const luaL_Reg
+io_file_methods [] =
+{
+	{ "__gc", io_file_garbage_collect },
+	{ "__tostring", io_file_to_string },
+	{ "close", io_file_close },
+	{ "flush", io_file_flush },
+	{ "lines", io_file_lines },
+	{ "read", io_file_read },
+	{ "seek", io_file_seek },
+	{ "setvbuf", io_file_setvbuf },
+	{ "write", io_file_write },
+	{ NULL, NULL }
+};
+
+/*
+ * Points the buffer of `file` at its contents within the mapping of the
+ * archive.  This is only possible for files that are stored as is (i.e.
+ * not compressed, encrypted, or a patch).  Otherwise, returns `false`, and
+ * the file must be read through StormLib.
+ */
+static bool
+io_archive_map (
+	struct io_archive *archive,
+	struct io_file *file)
+{
+	const DWORD excluded = MPQ_FILE_COMPRESS_MASK | MPQ_FILE_ENCRYPTED
+		| MPQ_FILE_PATCH_FILE | MPQ_FILE_DELETE_MARKER;
+
+	HANDLE reader = NULL;
+	ULONGLONG offset = 0;
+	DWORD flags = 0;
+	DWORD size = 0;
+	DWORD compressed = 0;
+
+	if (archive->view == NULL || !SFileOpenFileEx (
+			archive->object->handle, file->name,
+			SFILE_OPEN_FROM_MPQ, &reader))
+	{
+		return false;
+	}
+
+	const bool status =
+		SFileGetFileInfo (reader, SFileInfoFlags,
+			&flags, sizeof (flags), NULL)
+		&& SFileGetFileInfo (reader, SFileInfoByteOffset,
+			&offset, sizeof (offset), NULL)
+		&& SFileGetFileInfo (reader, SFileInfoFileSize,
+			&size, sizeof (size), NULL)
+		&& SFileGetFileInfo (reader, SFileInfoCompressedSize,
+			&compressed, sizeof (compressed), NULL);
+
+	SFileCloseFile (reader);
+
+	if (!status
+		|| !(flags & MPQ_FILE_EXISTS)
+		|| (flags & excluded)
+		|| compressed != size)
+	{
+		return false;
+	}
+
+	offset = offset + archive->view_offset;
 
-		case SFileMpqBetTableOffset:
-		case SFileMpqBetTableSize:
-		{
-			return info_archive (L, class, info_integer64);
-		}
+	if (offset > archive->view_size || size > archive->view_size - offset)
+	{
+		return false;
+	}
 
-		case SFileMpqBetHeader:
-		{
-			return info_archive (L, class, info_bet_header);
-		}
+	file->buffer.data = archive->view + offset;
+	file->buffer.size = size;
+	file->buffer.mapped = true;
+	return true;
+}
 
-		case SFileMpqBetTable:
-		{
-			return info_archive (L, class, info_bet_table);
-		}
+/*
+ * Accepts the same modes as the Lua I/O library.  The binary flag is
+ * ignored.
+ */
+static bool
+io_check_mode (
+	const char *mode)
+{
+	if (*mode == '\0' || strchr ("rwa", *mode++) == NULL)
+	{
+		return false;
+	}
 
-		case SFileMpqHashTableOffset:
-		case SFileMpqHashTableSize64:
-		{
-			return info_archive (L, class, info_integer64);
-		}
+	mode = mode + strspn (mode, "b");
 
-		case SFileMpqHashTableSize:
-		{
-			return info_archive (L, class, info_integer32);
-		}
+	if (*mode == '+')
+	{
+		mode++;
+	}
 
-		case SFileMpqHashTable:
-		{
-			return info_archive (L, class, info_hash_table);
-		}
+	return strspn (mode, "b") == strlen (mode);
+}
 
-		case SFileMpqBlockTableOffset:
-		case SFileMpqBlockTableSize64:
-		{
-			return info_archive (L, class, info_integer64);
-		}
+/**
+ * `archive:open (name [, mode])`
+ */
+static int
+io_archive_open (
+	lua_State *L)
+{
+	struct io_archive *archive = to_io_archive (L, 1);
+	const char *name = luaL_checkstring (L, 2);
+	const char *mode = luaL_optstring (L, 3, "r");
+	luaL_argcheck (L, io_check_mode (mode), 3, "invalid mode");
+	lua_settop (L, 3);
 
-		case SFileMpqBlockTableSize:
-		{
-			return info_archive (L, class, info_integer32);
-		}
+	HANDLE handle = archive->object->handle;
+	const bool exists = io_archive_has (L, handle, name);
+	const bool update = strchr (mode, '+') != NULL;
 
-		case SFileMpqBlockTable:
-		{
-			return info_archive (L, class, info_block_table);
-		}
+	if (!exists && *mode == 'r')
+	{
+		lua_pushnil (L);
+		lua_pushliteral (L, "no such file or directory");
+		return 2;
+	}
 
-		case SFileMpqHiBlockTableOffset:
-		case SFileMpqHiBlockTableSize64:
-		{
-			return info_archive (L, class, info_integer64);
-		}
+	struct io_file *file = lua_newuserdata (L, sizeof (*file));
+	memset (file, 0, sizeof (*file));
+	file->readable = *mode == 'r' || update;
+	file->writable = *mode != 'r' || update;
+	file->append = *mode == 'a';
+	file->existed = exists;
+	file->truncated = exists && *mode == 'w';
+	file->buffer.limit = archive->buffer_limit;
 
-		case SFileMpqHiBlockTable:
-		{
-			return info_not_implemented_yet (L);
-		}
+	if (luaL_newmetatable (L, STORMLIB_FILE_METATABLE))
+	{
+		luaL_setfuncs (L, io_file_methods, 0);
+		lua_pushvalue (L, -1);
+		lua_setfield (L, -2, "__index");
+	}
 
-		case SFileMpqSignatures:
-		{
-			return info_archive (L, class, info_integer32);
-		}
+	lua_setmetatable (L, -2);
 
-		case SFileMpqStrongSignatureOffset:
-		{
-			return info_archive (L, class, info_integer64);
-		}
+	const size_t length = strlen (name);
+	file->name = malloc (length + 1);
 
-		case SFileMpqStrongSignatureSize:
-		{
-			return info_archive (L, class, info_integer32);
-		}
+	if (file->name == NULL)
+	{
+		return luaL_error (L, "not enough memory");
+	}
 
-		case SFileMpqStrongSignature:
+	memcpy (file->name, name, length + 1);
+
+	/*
+	 * Read-only files are read straight out of the mapping of the archive,
+	 * when possible, or streamed from the archive, such that only what is
+	 * read gets decompressed.  This is limited to read-only archives, as
+	 * modifying an archive (e.g. replacing, removing, or compacting) would
+	 * pull the data out from under the stream.  Otherwise, the file is kept
+	 * in memory until it exceeds the buffer limit, at which point it is
+	 * moved to a temporary file.
+	 */
+	bool status = true;
+
+	if (exists && !file->writable && !archive->writable)
+	{
+		status = io_archive_map (archive, file)
+			|| buffer_stream (L, &file->buffer, handle, name,
+				SFILE_OPEN_FROM_MPQ, STORMLIB_BUFFER_SECTORS);
+	}
+	else if (exists && *mode != 'w')
+	{
+		status = io_archive_read (archive, file);
+	}
+
+	if (!status)
+	{
+		const DWORD error = GetLastError ();
+		buffer_free (L, &file->buffer);
+		free (file->name);
+		file->name = NULL;
+		SetLastError (error);
+		return raise_error (L);
+	}
+
+	/*
+	 * Mimic the behavior of the Lua I/O library, which allows multiple
+	 * unique file handles to be opened with the same name.  Each keeps the
+	 * archive alive until it is closed.
+	 */
+	io_archive_link (archive, file);
+	lua_pushvalue (L, 1);
+	lua_rawsetp (L, LUA_REGISTRYINDEX, &file->archive);
+	return 1;
+}
+
+enum io_match
+{
+	IO_MATCH_ALL,
+	IO_MATCH_PREFIX,
+	IO_MATCH_SUFFIX,
+	IO_MATCH_EXACT,
+	IO_MATCH_SUBSTRING,
+	IO_MATCH_PATTERN
+};
+
+/*
+ * State of the `archive:files ()` iterator.  Most patterns are simple
+ * enough to be matched in C (and to be given to StormLib as a mask), such
+ * that only matching names cross into Lua.
+ */
+struct io_files
+{
+	struct object *finder;
+	SFILE_FIND_DATA data;
+	DWORD error;
+	bool pending;
+	enum io_match match;
+	size_t length;
+	char text [];
+};
+
+/*
+ * Reduces a Lua pattern to a literal prefix, suffix, exact, or substring
+ * match.  This is only possible when the pattern has nothing special
+ * beyond anchors and escaped punctuation.  The literal is written to
+ * `files->text`, which must be at least as long as the pattern.
+ */
+static enum io_match
+io_files_compile (
+	struct io_files *files,
+	const char *pattern,
+	size_t length,
+	const bool plain)
+{
+	size_t count = 0;
+	bool prefix = false;
+	bool suffix = false;
+
+	if (plain)
+	{
+		memcpy (files->text, pattern, length);
+		count = length;
+	}
+	else
+	{
+		if (length > 0 && *pattern == '^')
 		{
-			return info_archive (L, class, info_string);
+			prefix = true;
+			pattern++;
+			length--;
 		}
 
-		case SFileMpqArchiveSize64:
+		for (size_t i = 0; i < length; i++)
 		{
-			return info_archive (L, class, info_integer64);
+			const char c = pattern [i];
+
+			if (c == '%')
+			{
+				if (i + 1 == length
+					|| isalnum ((unsigned char) pattern [i + 1]))
+				{
+					return IO_MATCH_PATTERN;
+				}
+
+				files->text [count++] = pattern [++i];
+			}
+			else if (c == '$' && i + 1 == length)
+			{
+				suffix = true;
+			}
+			else if (c == '\0' || strchr ("^$()%.[]*+-?", c))
+			{
+				return IO_MATCH_PATTERN;
+			}
+			else
+			{
+				files->text [count++] = c;
+			}
 		}
+	}
 
-		case SFileMpqArchiveSize:
-		case SFileMpqMaxFileCount:
-		case SFileMpqFileTableSize:
-		case SFileMpqSectorSize:
-		case SFileMpqNumberOfFiles:
-		case SFileMpqRawChunkSize:
-		case SFileMpqStreamFlags:
-		case SFileMpqFlags:
+	/* Names cannot contain an embedded zero.  Let Lua sort it out. */
+	if (memchr (files->text, '\0', count))
+	{
+		return IO_MATCH_PATTERN;
+	}
+
+	files->text [count] = '\0';
+	files->length = count;
+
+	if (prefix && suffix)
+	{
+		return IO_MATCH_EXACT;
+	}
+
+	return prefix
+		? IO_MATCH_PREFIX
+		: suffix ? IO_MATCH_SUFFIX : IO_MATCH_SUBSTRING;
+}
+
+/*
+ * Pushes the StormLib mask for the compiled match.  StormLib compares
+ * masks without regard to case, so a name still has to be checked.
+ */
+static void
+io_files_mask (
+	lua_State *L,
+	const struct io_files *files)
+{
+	const char *text = files->text;
+
+	if (files->match == IO_MATCH_ALL
+		|| files->match == IO_MATCH_PATTERN
+		|| strpbrk (text, "*?"))
+	{
+		lua_pushliteral (L, "*");
+		return;
+	}
+
+	switch (files->match)
+	{
+		case IO_MATCH_PREFIX:
 		{
-			return info_archive (L, class, info_integer32);
+			lua_pushfstring (L, "%s*", text);
+			break;
 		}
 
-		case SFileInfoPatchChain:
+		case IO_MATCH_SUFFIX:
 		{
-			return info_file (L, class, info_string_array);
+			lua_pushfstring (L, "*%s", text);
+			break;
 		}
 
-		case SFileInfoFileEntry:
+		case IO_MATCH_EXACT:
 		{
-			return info_file (L, class, info_file_entry);
+			lua_pushstring (L, text);
+			break;
 		}
 
-		case SFileInfoHashEntry:
+		default:
 		{
-			return info_file (L, class, info_hash_entry);
+			lua_pushfstring (L, "*%s*", text);
+			break;
 		}
+	}
+}
 
-		case SFileInfoHashIndex:
-		case SFileInfoNameHash1:
-		case SFileInfoNameHash2:
+static bool
+io_files_match (
+	lua_State *L,
+	const struct io_files *files,
+	const char *name)
+{
+	const size_t length = strlen (name);
+
+	switch (files->match)
+	{
+		case IO_MATCH_ALL:
 		{
-			return info_file (L, class, info_integer32);
+			return true;
 		}
 
-		case SFileInfoNameHash3:
+		case IO_MATCH_PREFIX:
 		{
-			return info_file (L, class, info_integer64);
+			return strncmp (name, files->text, files->length) == 0;
 		}
 
-		case SFileInfoLocale:
-		case SFileInfoFileIndex:
+		case IO_MATCH_SUFFIX:
 		{
-			return info_file (L, class, info_integer32);
+			return length >= files->length
+				&& memcmp (name + length - files->length,
+					files->text, files->length) == 0;
 		}
 
-		case SFileInfoByteOffset:
-		case SFileInfoFileTime:
+		case IO_MATCH_EXACT:
 		{
-			return info_file (L, class, info_integer64);
+			return strcmp (name, files->text) == 0;
 		}
 
-		case SFileInfoFileSize:
-		case SFileInfoCompressedSize:
-		case SFileInfoFlags:
-		case SFileInfoEncryptionKey:
-		case SFileInfoEncryptionKeyRaw:
-		case SFileInfoCRC32:
+		case IO_MATCH_SUBSTRING:
 		{
-			return info_file (L, class, info_integer32);
+			return strstr (name, files->text) != NULL;
 		}
 
 		default:
 		{
-			return luaL_argerror (L, 2, "invalid info class");
+			break;
 		}
 	}
-}
-
-/**
- * `SFileGetFileName (file)`
- */
-static int
-file_name (
-	lua_State *L)
-{
-	HANDLE file = to_file (L);
-	char name [MAX_PATH + 1] = { 0 };
-
-	if (!SFileGetFileName (file, name))
-	{
-		return to_error (L);
-	}
-
-	lua_pushstring (L, name);
-	return 1;
-}
-
-/*
- * `SFileExtractFile (archive, name, path)`
- */
-static int
-archive_extract (
-	lua_State *L)
-{
-	HANDLE archive = to_archive (L);
-	const char *name = luaL_checkstring (L, 2);
-	const char *path = luaL_checkstring (L, 3);
-	const DWORD scope = luaL_checkinteger (L, 4);
-
-	return to_result (
-		L, SFileExtractFile (archive, name, path, scope));
-}
-
-/*
- * `SFileVerifyFile (archive)`
- */
-static int
-archive_verify (
-	lua_State *L)
-{
-	HANDLE archive = to_archive (L);
-	const char *name = luaL_checkstring (L, 2);
-	const DWORD flags = luaL_checkinteger (L, 3);
-	const DWORD result = SFileVerifyFile (archive, name, flags);
-
-	if (result & VERIFY_OPEN_ERROR)
-	{
-		return to_error (L);
-	}
 
-	lua_pushinteger (L, result);
-	return 1;
+	/* `name:find (pattern, 1, plain)` */
+	lua_pushstring (L, name);
+	lua_getfield (L, -1, "find");
+	lua_insert (L, -2);
+	lua_pushvalue (L, lua_upvalueindex (3));
+	lua_pushinteger (L, 1);
+	lua_pushvalue (L, lua_upvalueindex (4));
+	lua_call (L, 4, 1);
+
+	const bool status = lua_toboolean (L, -1);
+	lua_pop (L, 1);
+	return status;
 }
 
-/**
- * `SFileSignArchive (archive, type)`
- */
 static int
-archive_sign (
+io_archive_files_iterator (
 	lua_State *L)
 {
-	HANDLE archive = to_archive (L);
-	const DWORD type = luaL_checkinteger (L, 2);
+	struct io_files *files = lua_touserdata (L, lua_upvalueindex (1));
 
-	return to_result (
-		L, SFileSignArchive (archive, type));
-}
+	if (files->error != ERROR_NO_MORE_FILES)
+	{
+		SetLastError (files->error);
+		files->error = ERROR_NO_MORE_FILES;
+		return raise_error (L);
+	}
 
-/*
- * `SFileVerifyArchive (archive)`
- */
-static int
-stormlib_verify (
-	lua_State *L)
-{
-	HANDLE archive = to_archive (L);
-	const DWORD result = SFileVerifyArchive (archive);
+	if (files->finder == NULL)
+	{
+		return 0;
+	}
 
-	lua_pushinteger (L, result);
-	return 1;
-}
+	if (is_closed (files->finder))
+	{
+		return luaL_error (L, "attempt to use a closed handle");
+	}
 
-static void
-finder_load_data (
-	lua_State *L,
-	SFILE_FIND_DATA data)
-{
-	lua_createtable (L, 0, 10);
-	lua_pushstring (L, data.cFileName);
-	lua_setfield (L, -2, "cFileName");
-	lua_pushstring (L, data.szPlainName);
-	lua_setfield (L, -2, "szPlainName");
-	lua_pushinteger (L, data.dwHashIndex);
-	lua_setfield (L, -2, "dwHashIndex");
-	lua_pushinteger (L, data.dwBlockIndex);
-	lua_setfield (L, -2, "dwBlockIndex");
-	lua_pushinteger (L, data.dwFileSize);
-	lua_setfield (L, -2, "dwFileSize");
-	lua_pushinteger (L, data.dwFileFlags);
-	lua_setfield (L, -2, "dwFileFlags");
-	lua_pushinteger (L, data.dwCompSize);
-	lua_setfield (L, -2, "dwCompSize");
-	lua_pushinteger (L, data.dwFileTimeLo);
-	lua_setfield (L, -2, "dwFileTimeLo");
-	lua_pushinteger (L, data.dwFileTimeHi);
-	lua_setfield (L, -2, "dwFileTimeHi");
-	lua_pushinteger (L, data.lcLocale);
-	lua_setfield (L, -2, "lcLocale");
-}
+	for (;;)
+	{
+		/* The first result comes from `SFileFindFirstFile ()`. */
+		if (files->pending)
+		{
+			files->pending = false;
+		}
+		else if (!SFileFindNextFile (files->finder->handle, &files->data))
+		{
+			const DWORD error = GetLastError ();
+			object_finalize (L, files->finder);
+			files->finder = NULL;
 
-/**
- * `SFileFindFirstFile (archive, mask [, listfile])`
- */
-static int
-file_finder_open (
-	lua_State *L)
-{
-	HANDLE archive = to_archive (L);
-	const char *mask = luaL_checkstring (L, 2);
-	const char *listfile = luaL_optstring (L, 3, NULL);
+			if (error != ERROR_NO_MORE_FILES)
+			{
+				SetLastError (error);
+				return raise_error (L);
+			}
 
-	SFILE_FIND_DATA data;
-	HANDLE finder = SFileFindFirstFile (archive, mask, &data, listfile);
+			return 0;
+		}
 
-	if (finder == NULL)
-	{
-		return to_error (L);
+		if (io_files_match (L, files, files->data.cFileName))
+		{
+			lua_pushstring (L, files->data.cFileName);
+			return 1;
+		}
 	}
-
-	object_initialize (L, finder, SFileFindClose, archive);
-	finder_load_data (L, data);
-	return 2;
 }
 
 /**
- * `SFileFindNextFile (finder)`
+ * `archive:files ([pattern [, plain]])`
  */
 static int
-file_finder_next (
+io_archive_files (
 	lua_State *L)
 {
-	HANDLE finder = to_file_finder (L);
-	SFILE_FIND_DATA data;
-
-	if (!SFileFindNextFile (finder, &data))
+	struct io_archive *archive = to_io_archive (L, 1);
+	size_t length = 0;
+	const char *pattern = luaL_optlstring (L, 2, NULL, &length);
+	const bool plain = lua_toboolean (L, 3);
+	lua_settop (L, 2);
+	lua_pushboolean (L, plain);
+
+	struct io_files *files = lua_newuserdata (
+		L, sizeof (*files) + length + 1);
+	memset (files, 0, sizeof (*files));
+	files->error = ERROR_NO_MORE_FILES;
+	files->match = pattern
+		? io_files_compile (files, pattern, length, plain)
+		: IO_MATCH_ALL;
+
+	HANDLE handle = archive->object->handle;
+	io_files_mask (L, files);
+	const char *mask = lua_tostring (L, -1);
+	HANDLE finder = SFileFindFirstFile (handle, mask, &files->data, NULL);
+	lua_pop (L, 1);
+
+	if (finder)
 	{
-		return to_error (L);
+		object_initialize (L, finder, SFileFindClose, handle);
+		files->finder = to_object (L, -1);
+		files->pending = true;
+	}
+	else
+	{
+		files->error = GetLastError ();
+		lua_pushnil (L);
 	}
 
-	finder_load_data (L, data);
+	/* Upvalues: state, finder, pattern, and plain. */
+	lua_pushvalue (L, 2);
+	lua_pushvalue (L, 3);
+	lua_pushcclosure (L, io_archive_files_iterator, 4);
 	return 1;
 }
 
-/**
- * `SFileFindClose (finder)`
- */
-static int
-file_finder_close (
-	lua_State *L)
-{
-	to_file_finder (L);
-	return object_close (L);
-}
-
 /*
- * `SListFileFindFirstFile (archive, mask [, listfile])`
+ * Marks any open files named `name` as removed, such that closing them
+ * does not write them back.
  */
-static int
-listfile_finder_open (
-	lua_State *L)
+static void
+io_archive_removed (
+	struct io_archive *archive,
+	const char *name)
 {
-	HANDLE archive = to_archive (L);
-	const char *mask = luaL_checkstring (L, 2);
-	const char *listfile = luaL_optstring (L, 3, NULL);
-
-	SFILE_FIND_DATA data;
-	HANDLE finder = SListFileFindFirstFile (archive, listfile, mask, &data);
-
-	if (finder == NULL)
+	for (struct io_file *file = archive->files; file; file = file->next)
 	{
-		return to_error (L);
+		if (strcmp (file->name, name) == 0)
+		{
+			file->removed = true;
+		}
 	}
-
-	object_initialize (L, finder, SListFileFindClose, archive);
-	lua_pushstring (L, data.cFileName);
-	return 2;
 }
 
 /**
- * `SListFileFineNextFile (finder)`
+ * `archive:remove (name)`
  */
 static int
-listfile_finder_next (
+io_archive_remove (
 	lua_State *L)
 {
-	HANDLE finder = to_listfile_finder (L);
-	SFILE_FIND_DATA data;
+	struct io_archive *archive = to_io_archive (L, 1);
+	const char *name = luaL_checkstring (L, 2);
 
-	if (!SListFileFindNextFile (finder, &data))
+	if (!SFileRemoveFile (archive->object->handle, name, 0))
 	{
 		return to_error (L);
 	}
 
-	lua_pushstring (L, data.cFileName);
-	return 1;
-}
+	io_archive_removed (archive, name);
 
-/**
- * `SListFileFindClose (finder)`
- */
-static int
-listfile_finder_close (
-	lua_State *L)
-{
-	to_listfile_finder (L);
-	return object_close (L);
-}
+	if (archive->count > 0)
+	{
+		archive->count--;
+	}
 
-/*
- * A basic wrapper around `SFileEnumLocales` to make it behave closer to
- * most of the functions in the public API.  That is, returning `true` on
- * success, and returning `false` on failure with an error accessible via
- * `GetLastError`.
- */
-static bool
-SFileEnumLocalesWrapper (
-	HANDLE archive,
-	const char *name,
-	LCID *locales,
-	DWORD *count)
-{
-	const int status = SFileEnumLocales (archive, name, locales, count, 0);
-	SetLastError (status);
-	return status == ERROR_SUCCESS;
+	return to_result (L, true);
 }
 
 /**
- * `SFileEnumLocales (archive, name)`
+ * `archive:rename (old, new)`
  */
 static int
-archive_locales (
+io_archive_rename (
 	lua_State *L)
 {
-	HANDLE archive = to_archive (L);
-	const char *name = luaL_checkstring (L, 2);
+	struct io_archive *archive = to_io_archive (L, 1);
+	const char *old = luaL_checkstring (L, 2);
+	const char *new = luaL_checkstring (L, 3);
+	HANDLE handle = archive->object->handle;
 
-	/*
-	 * Passing a `NULL` buffer here will elicit a related error.  Success
-	 * can also be returned as well, as is the case with a nonexistent file.
-	 * In these cases, a valid count will be set.
-	 */
-	DWORD count = 0;
-	if (!SFileEnumLocalesWrapper (archive, name, NULL, &count)
-		&& GetLastError () != ERROR_INSUFFICIENT_BUFFER)
+	if (strcmp (old, new) == 0)
 	{
-		return to_error (L);
+		return to_result (L, true);
 	}
 
-	lua_createtable (L, (int) count, 0);
-	if (count == 0)
+	if (!io_archive_has (L, handle, old))
 	{
-		return 1;
+		lua_pushnil (L);
+		lua_pushliteral (L, "no such file or directory");
+		return 2;
 	}
 
-	LCID *locales = calloc (count, sizeof (LCID));
-	if (locales == NULL)
+	/*
+	 * Use of `SFileRenameFile ()` will error if a file already exists.
+	 * Ensure this will not be the case.
+	 */
+	if (SFileRemoveFile (handle, new, 0))
 	{
-		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
-		return to_error (L);
+		io_archive_removed (archive, new);
+
+		if (archive->count > 0)
+		{
+			archive->count--;
+		}
 	}
 
-	int result = 1;
-	if (SFileEnumLocalesWrapper (archive, name, locales, &count))
+	const size_t length = strlen (new);
+
+	for (struct io_file *file = archive->files; file; file = file->next)
 	{
-		for (int i = 0; i < count; i++)
+		if (strcmp (file->name, old) != 0)
 		{
-			lua_pushinteger (L, locales [i]);
-			lua_rawseti (L, -2, i + 1);
+			continue;
+		}
+
+		char *name = realloc (file->name, length + 1);
+
+		if (name == NULL)
+		{
+			return luaL_error (L, "not enough memory");
 		}
+
+		memcpy (name, new, length + 1);
+		file->name = name;
 	}
-	else
+
+	return to_result (
+		L, SFileRenameFile (handle, old, new));
+}
+
+/**
+ * `archive:add_all (manifest [, threads])`
+ */
+static int
+io_archive_add_all (
+	lua_State *L)
+{
+	struct io_archive *archive = to_io_archive (L, 1);
+	lua_settop (L, 3);
+
+	/* The job reserves room itself.  Query the count afresh afterwards. */
+	archive->synced = false;
+
+	if (!build_all (L, archive->object, 2))
 	{
-		result = to_error (L);
+		return raise_error (L);
 	}
 
-	free (locales);
-	return result;
+	return 1;
 }
 
 /**
- * `SFileCreateFile (archive, name, time, size, locale, flags)`
+ * `archive:checksum_all ([filter [, threads]])`
  */
 static int
-writer_open (
+io_archive_checksum_all (
 	lua_State *L)
 {
-	HANDLE archive = to_archive (L);
-	const char *name = luaL_checkstring (L, 2);
-	const ULONGLONG time = luaL_checkinteger (L, 3);
-	const DWORD size = luaL_checkinteger (L, 4);
-	const LCID locale = luaL_checkinteger (L, 5);
-	const DWORD flags = luaL_checkinteger (L, 6);
-	HANDLE writer = NULL;
+	struct io_archive *archive = to_io_archive (L, 1);
+	lua_settop (L, 3);
 
-	if (!SFileCreateFile (
-		archive, name, time, size, locale, flags, &writer))
+	if (!checksum_all (L, archive->object->handle, 2))
 	{
-		if (writer)
-		{
-			SFileFinishFile (writer);
-		}
-
-		return to_error (L);
+		return raise_error (L);
 	}
 
-	return object_initialize (L, writer, SFileFinishFile, archive);
+	return 1;
 }
 
 /**
- * `SFileWriteFile (file, data, compression)`
+ * `archive:copy_many (source, names)`
+ *
+ * Copies the named files from the archive `source`, without decompressing
+ * them.  Files of this archive that are open are not affected until they
+ * are closed.
  */
 static int
-writer_write (
+io_archive_copy_many (
 	lua_State *L)
 {
-	HANDLE file = to_writer (L);
-	size_t size;
-	const char *data = luaL_checklstring (L, 2, &size);
-	const DWORD compression = luaL_checkinteger (L, 3);
+	struct io_archive *archive = to_io_archive (L, 1);
+	struct io_archive *source = to_io_archive (L, 2);
+	luaL_checktype (L, 3, LUA_TTABLE);
+	lua_settop (L, 3);
+
+	/* Room is reserved directly.  Query the count afresh afterwards. */
+	archive->synced = false;
+
+	return to_result (L, copy_many (L, source->object->handle,
+		archive->object->handle, 3));
+}
+
+/**
+ * `archive:extract_all (directory [, filter [, threads]])`
+ */
+static int
+io_archive_extract_all (
+	lua_State *L)
+{
+	struct io_archive *archive = to_io_archive (L, 1);
+	lua_settop (L, 4);
 
-	return to_result (
-		L, SFileWriteFile (file, data, size, compression));
+	if (!extract_all (L, archive->object->handle, 2))
+	{
+		return raise_error (L);
+	}
+
+	return 1;
 }
 
 /**
- * `SFileFinishFile (file)`
+ * `archive:read_many (names)`
+ *
+ * Reads many files at once.  Missing files are `nil`.
  */
 static int
-writer_close (
+io_archive_read_many (
 	lua_State *L)
 {
-	to_writer (L);
-	return object_close (L);
+	struct io_archive *archive = to_io_archive (L, 1);
+	luaL_checktype (L, 2, LUA_TTABLE);
+	lua_settop (L, 2);
+
+	if (!read_many (L, archive->object->handle, 2, SFILE_OPEN_FROM_MPQ))
+	{
+		return raise_error (L);
+	}
+
+	return 1;
 }
 
 /**
- * `SFileAddFileEx (
- *     archive, path, name, flags,
- *     compression, compression_next)`
+ * `archive:reserve (count)`
+ *
+ * Makes room for `count` more files, such that adding them does not cause
+ * the tables of the archive to be rebuilt along the way.
  */
 static int
-archive_insert (
+io_archive_reserve (
 	lua_State *L)
 {
-	HANDLE archive = to_archive (L);
-	const char *path = luaL_checkstring (L, 2);
-	const char *name = luaL_checkstring (L, 3);
-	const DWORD flags = luaL_checkinteger (L, 4);
-	const DWORD compression = luaL_checkinteger (L, 5);
-	const DWORD compression_next = luaL_checkinteger (L, 6);
+	struct io_archive *archive = to_io_archive (L, 1);
+	const lua_Integer count = luaL_checkinteger (L, 2);
+	luaL_argcheck (L, count >= 0, 2, "count must be non-negative");
 
 	return to_result (
-		L, SFileAddFileEx (
-			archive, path, name, flags,
-			compression, compression_next));
+		L, io_archive_grow (archive, (size_t) count));
 }
 
 /**
- * `SFileRemoveFile (archive, name)`
+ * `archive:compact ()`
  */
 static int
-archive_remove (
+io_archive_compact (
 	lua_State *L)
 {
-	HANDLE archive = to_archive (L);
-	const char *name = luaL_checkstring (L, 2);
+	struct io_archive *archive = to_io_archive (L, 1);
 
 	return to_result (
-		L, SFileRemoveFile (archive, name, 0));
+		L, SFileCompactArchive (archive->object->handle, NULL, 0));
 }
 
 /**
- * `SFileRenameFile (archive, old, new)`
+ * `archive:rebuild ([options])`
+ *
+ * Compacts the archive by rebuilding it into a new file, which then takes
+ * the place of the original.  Any open files are written back and closed
+ * first, as the archive itself is closed while it is rebuilt.  The options
+ * are those of `SFileRebuildArchive ()`.
  */
 static int
-archive_rename (
+io_archive_rebuild (
 	lua_State *L)
 {
-	HANDLE archive = to_archive (L);
-	const char *old = luaL_checkstring (L, 2);
-	const char *new = luaL_checkstring (L, 3);
+	struct io_archive *archive = to_io_archive (L, 1);
+	lua_settop (L, 2);
 
-	return to_result (
-		L, SFileRenameFile (archive, old, new));
+	if (!archive->writable)
+	{
+		SetLastError (ERROR_ACCESS_DENIED);
+		return to_error (L);
+	}
+
+	while (archive->files)
+	{
+		io_file_finalize (L, archive->files);
+	}
+
+	struct object *object = archive->object;
+	DWORD size = 0;
+
+	/* The path is at index 3, followed by the options. */
+	SFileGetFileInfo (object->handle, SFileMpqFileName, NULL, 0, &size);
+	char *path = lua_newuserdata (L, size > 0 ? size : 1);
+	*path = '\0';
+	SFileGetFileInfo (object->handle, SFileMpqFileName, path, size, NULL);
+	lua_pushstring (L, path);
+	lua_replace (L, 3);
+	lua_pushvalue (L, 2);
+
+	struct job *job = rebuild_all (L, object->handle, 3);
+	bool status = job != NULL;
+	DWORD error = GetLastError ();
+
+	/* Closed, such that it can be replaced (and is flushed to disk). */
+	if (!object_finalize (L, object) && status)
+	{
+		status = false;
+		error = GetLastError ();
+	}
+
+	if (status)
+	{
+		const struct rebuild *rebuild = job->context;
+		status = job_start (job, rebuild->build.count, rebuild->threads);
+		error = GetLastError ();
+	}
+
+	if (status)
+	{
+		job_join (job);
+		status = job->error == ERROR_SUCCESS;
+		error = job->error;
+	}
+
+	/* Whatever happened, the archive at the path is opened anew. */
+	HANDLE handle = NULL;
+	archive->object = NULL;
+	archive->synced = false;
+
+	if (SFileOpenArchive (lua_tostring (L, 3), 0, 0, &handle))
+	{
+		object_initialize (L, handle, SFileCloseArchive, NULL);
+		archive->object = to_object (L, -1);
+		lua_rawsetp (L, LUA_REGISTRYINDEX, archive);
+	}
+	else
+	{
+		/* Left closed, as by `archive:close ()`. */
+		error = status ? GetLastError () : error;
+		status = false;
+		lua_pushnil (L);
+		lua_rawsetp (L, LUA_REGISTRYINDEX, archive);
+		lua_pushnil (L);
+		lua_rawsetp (L, LUA_REGISTRYINDEX, &archive->policy);
+	}
+
+	SetLastError (error);
+	return to_result (L, status);
 }
 
 /**
- * `SFileSetFileLocale (file, locale)`
+ * `archive:sync (directory [, options])`
+ *
+ * Brings the archive in line with `directory`, writing only what changed
+ * (see `SFileSyncArchive ()`).  Any open files are written back and closed
+ * first, such that they are compared as they stand.
  */
 static int
-file_locale (
+io_archive_sync (
 	lua_State *L)
 {
-	HANDLE file = to_file (L);
-	const LCID locale = luaL_checkinteger (L, 2);
+	struct io_archive *archive = to_io_archive (L, 1);
+	lua_settop (L, 3);
 
-	return to_result (
-		L, SFileSetFileLocale (file, locale));
-}
+	if (!archive->writable)
+	{
+		SetLastError (ERROR_ACCESS_DENIED);
+		return raise_error (L);
+	}
 
-static void
-insert_callback (
-	void *data,
-	DWORD written,
-	/* NOLINTNEXTLINE(bugprone-easily-swappable-parameters) */
-	DWORD total,
-	char finished)
-{
-	const struct object *object = data;
-	lua_State *L = object->insert;
+	while (archive->files)
+	{
+		io_file_finalize (L, archive->files);
+	}
 
-	lua_rawgetp (L, LUA_REGISTRYINDEX, &object->insert);
-	lua_pushinteger (L, written);
-	lua_pushinteger (L, total);
-	lua_pushboolean (L, finished);
-	lua_call (L, 3, 0);
+	/* Files are added and removed.  Query the count afresh afterwards. */
+	archive->synced = false;
+
+	if (!sync_all (L, archive->object->handle, 2))
+	{
+		return raise_error (L);
+	}
+
+	return 1;
 }
 
 /**
- * `SFileSetAddFileCallback (archive [, callback])`
+ * `archive:verify_all ([flags [, threads]])`
  */
 static int
-archive_insert_callback (
+io_archive_verify_all (
 	lua_State *L)
 {
-	struct object *object = to_object (L, 1);
-	HANDLE archive = to_archive (L);
-	SFILE_ADDFILE_CALLBACK callback = NULL;
+	struct io_archive *archive = to_io_archive (L, 1);
+	lua_settop (L, 3);
 
-	if (lua_isfunction (L, 2))
-	{
-		callback = insert_callback;
-		object->insert = L;
-	}
-	else if (!lua_isnoneornil (L, 2))
+	if (!verify_all (L, archive->object->handle, 2, false))
 	{
-		luaL_checktype (L, 2, LUA_TFUNCTION);
+		return raise_error (L);
 	}
 
+	return 1;
+}
+
+/**
+ * `archive:verify_raw_all ([threads])`
+ */
+static int
+io_archive_verify_raw_all (
+	lua_State *L)
+{
+	struct io_archive *archive = to_io_archive (L, 1);
 	lua_settop (L, 2);
-	lua_rawsetp (L, LUA_REGISTRYINDEX, &object->insert);
 
-	return to_result (
-		L, SFileSetAddFileCallback (archive, callback, object));
+	if (!verify_all (L, archive->object->handle, 2, true))
+	{
+		return raise_error (L);
+	}
+
+	return 1;
 }
 
 /**
- * `SCompCompress (in, compression [, level])`
+ * `archive:close ()`
+ *
+ * Closes any open files, writing them back to the archive, before closing
+ * the archive itself.
  */
 static int
-stormlib_compress (
+io_archive_close (
 	lua_State *L)
 {
-	size_t in_size;
-	const char *in = luaL_checklstring (L, 1, &in_size);
-	const int compression = (int) luaL_checkinteger (L, 2);
-	const int level = (int) luaL_optinteger (L, 3, 0);
+	struct io_archive *archive = to_io_archive (L, 1);
+	struct object *object = archive->object;
 
 	/*
-	 * StormLib's compression accepts `int`.  It also 'fails' if the output
-	 * would otherwise exceed the input length, and returns the input.
+	 * Should the object have been finalized first (i.e. as the state is
+	 * closed, after a rebuild), its handle is gone.  The files can only be
+	 * discarded.
 	 */
-	if (in_size > INT_MAX)
+	const bool closed = is_closed (object);
+	int failures = 0;
+
+	/* Every file is written back, and only the first error is kept. */
+	while (archive->files)
 	{
-		const char *message = lua_pushfstring (
-			L, "input length exceeded: %d", INT_MAX);
-		return luaL_argerror (L, 1, message);
+		if (closed)
+		{
+			archive->files->writable = false;
+		}
+
+		if (!io_file_release (L, archive->files) && ++failures > 1)
+		{
+			lua_pop (L, 1);
+		}
 	}
 
-	void *in_copy = malloc (in_size);
-	if (in_copy == NULL)
+	archive->object = NULL;
+
+	const bool status = closed || object_finalize (L, object);
+	lua_pushnil (L);
+	lua_rawsetp (L, LUA_REGISTRYINDEX, archive);
+	lua_pushnil (L);
+	lua_rawsetp (L, LUA_REGISTRYINDEX, &archive->policy);
+
+	if (archive->view)
 	{
-		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
-		return to_error (L);
+		map_close (archive->view, archive->view_size);
+		archive->view = NULL;
 	}
 
-	memcpy (in_copy, in, in_size);
-	luaL_Buffer buffer;
-	int out_size = (int) in_size;
-	char *out = luaL_buffinitsize (L, &buffer, out_size);
-
-	int result = 1;
-	if (SCompCompress (
-		out, &out_size, in_copy, (int) in_size, compression, 0, level))
+	if (failures > 0)
 	{
-		luaL_pushresultsize (&buffer, out_size);
+		return lua_error (L);
 	}
-	else
+
+	return to_result (L, status);
+}
+
+static int
+io_archive_garbage_collect (
+	lua_State *L)
+{
+	struct io_archive *archive = luaL_checkudata (
+		L, 1, STORMLIB_ARCHIVE_METATABLE);
+
+	if (archive->object)
 	{
-		result = to_error (L);
+		/* Whatever runs on the archive has to finish first. */
+		if (archive->object->job)
+		{
+			job_join (archive->object->job);
+		}
+
+		io_archive_close (L);
 	}
 
-	free (in_copy);
-	return result;
+	return 0;
 }
 
+static int
+io_archive_to_string (
+	lua_State *L)
+{
+	const struct io_archive *archive = luaL_checkudata (
+		L, 1, STORMLIB_ARCHIVE_METATABLE);
+	const char *text = archive->object ? "%s (%p)" : "%s (Closed)";
+	lua_pushfstring (L, text, STORMLIB_ARCHIVE_METATABLE, archive);
+	return 1;
+}
+
+static const luaL_Reg
+io_archive_methods [] =
+{
+	{ "__gc", io_archive_garbage_collect },
+	{ "__tostring", io_archive_to_string },
+	{ "add_all", io_archive_add_all },
+	{ "checksum_all", io_archive_checksum_all },
+	{ "close", io_archive_close },
+	{ "compact", io_archive_compact },
+	{ "copy_many", io_archive_copy_many },
+	{ "extract_all", io_archive_extract_all },
+	{ "files", io_archive_files },
+	{ "open", io_archive_open },
+	{ "read_many", io_archive_read_many },
+	{ "rebuild", io_archive_rebuild },
+	{ "remove", io_archive_remove },
+	{ "rename", io_archive_rename },
+	{ "reserve", io_archive_reserve },
+	{ "sync", io_archive_sync },
+	{ "verify_all", io_archive_verify_all },
+	{ "verify_raw_all", io_archive_verify_raw_all },
+	{ NULL, NULL }
+};
+
 /**
- * `SCompDecompress (in, out_size)`
+ * `SArchiveOpen (path [, mode [, options]])`
+ *
+ * Opens an archive in the style of the Lua I/O library.  This is the
+ * `stormlib.open ()` of the Lua API.  Modes 'r', 'rm', 'r+', and 'w+'
+ * are supported.  Errors are raised, rather than returned.
+ *
+ * Mode 'rm' is read-only, with the archive mapped into memory.  Mode 'r'
+ * does the same once the archive reaches `map_threshold` bytes (negative
+ * to never do so).
  */
 static int
-stormlib_decompress (
+io_archive_new (
 	lua_State *L)
 {
-	size_t in_size;
-	const char *in = luaL_checklstring (L, 1, &in_size);
-	int out_size = (int) luaL_checkinteger (L, 2);
+	const char *path = luaL_checkstring (L, 1);
+	const char *mode = luaL_optstring (L, 2, "r");
 
-	if (in_size > INT_MAX)
+	if (!lua_isnoneornil (L, 3))
 	{
-		const char *message = lua_pushfstring (
-			L, "input length exceeded: %d", INT_MAX);
-		return luaL_argerror (L, 1, message);
+		luaL_checktype (L, 3, LUA_TTABLE);
 	}
 
-	void *in_copy = malloc (in_size);
-	if (in_copy == NULL)
+	const lua_Integer limit = option_integer (
+		L, 3, "buffer_limit", STORMLIB_BUFFER_LIMIT);
+	luaL_argcheck (L, limit >= 0, 3, "buffer_limit must be non-negative");
+	const lua_Integer growth = option_integer (L, 3, "growth", 2);
+	luaL_argcheck (L, growth >= 2, 3, "growth must be at least 2");
+	const lua_Integer threshold = option_integer (
+		L, 3, "map_threshold", STORMLIB_MAP_THRESHOLD);
+	lua_settop (L, 3);
+
+	/* The compression policy is left at index 4. */
+	enum io_policy policy = IO_POLICY_DEFAULT;
+
+	if (lua_isnoneornil (L, 3))
 	{
-		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
-		return to_error (L);
+		lua_pushnil (L);
+	}
+	else
+	{
+		lua_getfield (L, 3, "compression");
 	}
 
-	memcpy (in_copy, in, in_size);
-	luaL_Buffer buffer;
-	char *out = luaL_buffinitsize (L, &buffer, out_size);
+	switch (lua_type (L, 4))
+	{
+		case LUA_TNIL:
+		{
+			break;
+		}
 
-	int result = 1;
-	if (SCompDecompress (out, &out_size, in_copy, (int) in_size))
+		case LUA_TNUMBER:
+		{
+			if (!lua_isinteger (L, 4))
+			{
+				return luaL_error (L, "bad argument for 'compression' "
+					"(number has no integer representation)");
+			}
+
+			policy = IO_POLICY_FIXED;
+			break;
+		}
+
+		case LUA_TTABLE:
+		{
+			policy = IO_POLICY_TABLE;
+			break;
+		}
+
+		case LUA_TFUNCTION:
+		{
+			policy = IO_POLICY_FUNCTION;
+			break;
+		}
+
+		default:
+		{
+			return luaL_error (L, "bad argument for 'compression' "
+				"(number, table, or function expected, got %s)",
+				luaL_typename (L, 4));
+		}
+	}
+
+	HANDLE handle = NULL;
+	bool status = false;
+	bool map = false;
+
+	if (strcmp (mode, "r") == 0 || strcmp (mode, "rm") == 0)
+	{
+		const DWORD flags = STREAM_FLAG_READ_ONLY;
+		ULONGLONG size = 0;
+
+		map = mode [1] == 'm' || (threshold >= 0
+			&& map_size (path, &size)
+			&& size >= (ULONGLONG) threshold);
+
+		status = map && SFileOpenArchive (
+			path, 0, flags | BASE_PROVIDER_MAP, &handle);
+
+		/* Only an explicit request for a mapping fails without one. */
+		if (!status && mode [1] != 'm')
+		{
+			map = false;
+			status = SFileOpenArchive (path, 0, flags, &handle);
+		}
+	}
+	else if (strcmp (mode, "r+") == 0)
+	{
+		status = SFileOpenArchive (path, 0, 0, &handle);
+	}
+	else if (strcmp (mode, "w+") == 0)
 	{
-		luaL_pushresultsize (&buffer, out_size);
+		remove (path);
+		status = SFileCreateArchive (
+			path, MPQ_CREATE_LISTFILE | MPQ_CREATE_ATTRIBUTES,
+			HASH_TABLE_SIZE_MIN, &handle);
 	}
 	else
 	{
-		result = to_error (L);
+		return luaL_argerror (L, 2, "invalid mode");
 	}
 
-	free (in_copy);
-	return result;
+	if (!status)
+	{
+		return raise_error (L);
+	}
+
+	/*
+	 * The archive handle is anchored in the registry.  Its object comes
+	 * first, such that it is finalized after the archive (e.g. as the state
+	 * is closed), whose files are written back through it.
+	 */
+	object_initialize (L, handle, SFileCloseArchive, NULL);
+
+	struct io_archive *archive = lua_newuserdata (L, sizeof (*archive));
+	memset (archive, 0, sizeof (*archive));
+	archive->object = to_object (L, -2);
+	lua_pushvalue (L, -2);
+	lua_rawsetp (L, LUA_REGISTRYINDEX, archive);
+	archive->buffer_limit = (size_t) limit;
+	archive->growth = (size_t) growth;
+	archive->writable = *mode != 'r' || mode [1] == '+';
+	archive->policy = policy;
+	archive->compression = (DWORD) lua_tointeger (L, 4);
+	lua_pushvalue (L, 4);
+	lua_rawsetp (L, LUA_REGISTRYINDEX, &archive->policy);
+
+	if (luaL_newmetatable (L, STORMLIB_ARCHIVE_METATABLE))
+	{
+		luaL_setfuncs (L, io_archive_methods, 0);
+		lua_pushvalue (L, -1);
+		lua_setfield (L, -2, "__index");
+	}
+
+	lua_setmetatable (L, -2);
+
+	/*
+	 * StormLib maps the archive for its own reads.  A mapping of our own
+	 * is kept for files stored as is.  Without it, such files are simply
+	 * streamed.
+	 */
+	if (map && (!SFileGetFileInfo (handle, SFileMpqHeaderOffset,
+			&archive->view_offset, sizeof (archive->view_offset), NULL)
+		|| !map_open (path, &archive->view, &archive->view_size)))
+	{
+		archive->view = NULL;
+	}
+
+	return 1;
 }
 
 /*
@@ -1768,9 +11290,9 @@ stormlib_functions [] =
 	{ "SFileGetMaxFileCount", archive_get_limit },
 	{ "SFileSetMaxFileCount", archive_set_limit },
 
-	/* SFileGetAttributes: Not implemented. */
-	/* SFileSetAttributes: Not implemented. */
-	/* SFileUpdateFileAttributes: Not implemented. */
+	{ "SFileGetAttributes", archive_get_attributes },
+	{ "SFileSetAttributes", archive_set_attributes },
+	{ "SFileUpdateFileAttributes", archive_update_attributes },
 
 	{ "SFileOpenPatchArchive", archive_patch },
 	{ "SFileIsPatchedArchive", archive_is_patched },
@@ -1788,9 +11310,9 @@ stormlib_functions [] =
 
 	{ "SFileExtractFile", archive_extract },
 
-	/* SFileGetFileChecksums: Not implemented. */
+	{ "SFileGetFileChecksums", archive_checksums },
 	{ "SFileVerifyFile", archive_verify },
-	/* SFileVerifyRawData: Not implemented. */
+	{ "SFileVerifyRawData", archive_verify_raw },
 	{ "SFileSignArchive", archive_sign },
 	{ "SFileVerifyArchive", stormlib_verify },
 
@@ -1821,7 +11343,27 @@ stormlib_functions [] =
 	/* SCompExplode: Use SCompDecompress with MPQ_COMPRESSION_PKWARE. */
 	{ "SCompCompress", stormlib_compress },
 	{ "SCompDecompress", stormlib_decompress },
-	/* SCompDecompress2: Not implemented. */
+	{ "SCompDecompress2", stormlib_decompress2 },
+
+	/* Extensions: Not part of StormLib. */
+	{ "SBufferCreate", buffer_new },
+	{ "SBufferOpenFile", buffer_open },
+	{ "SFileOpenArchiveFromMemory", archive_open_memory },
+	{ "SFileListAll", archive_list_all },
+	{ "SFileListAttributes", archive_list_attributes },
+	{ "SFileReadMany", archive_read_many },
+	{ "SCompCompressMany", stormlib_compress_many },
+	{ "SCompDecompressMany", stormlib_decompress_many },
+	{ "SFileExtractAll", archive_extract_all },
+	{ "SFileAddAll", archive_add_all },
+	{ "SFileCopyMany", archive_copy_many },
+	{ "SFileRebuildArchive", archive_rebuild },
+	{ "SFileCompactArchiveAsync", archive_compact_async },
+	{ "SFileChecksumAll", archive_checksum_all },
+	{ "SFileSyncArchive", archive_sync },
+	{ "SFileVerifyAll", archive_verify_all },
+	{ "SFileVerifyRawDataAll", archive_verify_raw_all },
+	{ "SArchiveOpen", io_archive_new },
 
 	{ NULL, NULL }
 };
@@ -1835,6 +11377,7 @@ luaopen_stormlib_core (
 	lua_State *L)
 {
 	luaL_newlib (L, stormlib_functions);
+	crc32_initialize ();
 
 	/*
 	 * Error codes from StormPort.h.  Making the assumption that these are
@@ -1893,6 +11436,13 @@ luaopen_stormlib_core (
 	lua_stormlib_integer (L, HASH_TABLE_SIZE_DEFAULT);
 	lua_stormlib_integer (L, HASH_TABLE_SIZE_MAX);
 
+	/* For `SFileGetAttributes ()` and `SFileSetAttributes ()`. */
+	lua_stormlib_integer (L, MPQ_ATTRIBUTE_CRC32);
+	lua_stormlib_integer (L, MPQ_ATTRIBUTE_FILETIME);
+	lua_stormlib_integer (L, MPQ_ATTRIBUTE_MD5);
+	lua_stormlib_integer (L, MPQ_ATTRIBUTE_PATCH_BIT);
+	lua_stormlib_integer (L, MPQ_ATTRIBUTE_ALL);
+
 	/* For `SFileSignArchive ()`. */
 	lua_stormlib_integer (L, SIGNATURE_TYPE_NONE);
 	lua_stormlib_integer (L, SIGNATURE_TYPE_WEAK);
@@ -1986,6 +11536,15 @@ luaopen_stormlib_core (
 	lua_stormlib_integer (L, VERIFY_FILE_HAS_RAW_MD5);
 	lua_stormlib_integer (L, VERIFY_FILE_ERROR_MASK);
 
+	/* For `SFileVerifyRawData ()`. */
+	lua_stormlib_integer (L, SFILE_VERIFY_MPQ_HEADER);
+	lua_stormlib_integer (L, SFILE_VERIFY_HET_TABLE);
+	lua_stormlib_integer (L, SFILE_VERIFY_BET_TABLE);
+	lua_stormlib_integer (L, SFILE_VERIFY_HASH_TABLE);
+	lua_stormlib_integer (L, SFILE_VERIFY_BLOCK_TABLE);
+	lua_stormlib_integer (L, SFILE_VERIFY_HIBLOCK_TABLE);
+	lua_stormlib_integer (L, SFILE_VERIFY_FILE);
+
 	/* For `SFileVerifyArchive ()`. */
 	lua_stormlib_integer (L, ERROR_NO_SIGNATURE);
 	lua_stormlib_integer (L, ERROR_VERIFY_FAILED);
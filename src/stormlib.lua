@@ -1,7 +1,7 @@
-local Archive = require ('stormlib._archive')
+local C = require ('stormlib.core')
 
 local StormLib = {
-	open = Archive.new
+	open = C.SArchiveOpen
 }
 
 return StormLib